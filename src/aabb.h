@@ -0,0 +1,70 @@
+#pragma once
+
+#include "common.h"
+#include "vec3.h"
+
+#include <algorithm>
+
+class aabb {
+    public:
+	// default box is empty, so growing it by anything yields that thing
+	aabb() : minimum(infinity, infinity, infinity), maximum(-infinity, -infinity, -infinity) {}
+	aabb(const point3& a, const point3& b) : minimum(a), maximum(b) {}
+
+	point3 min() const { return minimum; }
+	point3 max() const { return maximum; }
+
+	bool hit(const ray& r, real t_min, real t_max) const {
+	    const vec3 inv_direction = r.inv_direction();
+	    for (int a = 0; a < 3; a++) {
+		auto inv_d = inv_direction[a];
+		auto t0 = (minimum[a] - r.origin()[a]) * inv_d;
+		auto t1 = (maximum[a] - r.origin()[a]) * inv_d;
+		if (inv_d < 0.0) std::swap(t0, t1);
+		t_min = t0 > t_min ? t0 : t_min;
+		t_max = t1 < t_max ? t1 : t_max;
+		if (t_max < t_min) return false;
+	    }
+	    return true;
+	}
+
+	void expand(const point3& p) {
+	    minimum = point3(fmin(minimum.x(), p.x()), fmin(minimum.y(), p.y()), fmin(minimum.z(), p.z()));
+	    maximum = point3(fmax(maximum.x(), p.x()), fmax(maximum.y(), p.y()), fmax(maximum.z(), p.z()));
+	}
+
+	// a union by corners, so growing by an empty box changes nothing
+	void expand(const aabb& box) {
+	    minimum = point3(fmin(minimum.x(), box.minimum.x()), fmin(minimum.y(), box.minimum.y()), fmin(minimum.z(), box.minimum.z()));
+	    maximum = point3(fmax(maximum.x(), box.maximum.x()), fmax(maximum.y(), box.maximum.y()), fmax(maximum.z(), box.maximum.z()));
+	}
+
+	bool empty() const {
+	    return maximum.x() < minimum.x() || maximum.y() < minimum.y() || maximum.z() < minimum.z();
+	}
+
+	point3 centroid() const {
+	    return 0.5 * (minimum + maximum);
+	}
+
+	double surface_area() const {
+	    if (empty()) return 0;
+	    auto d = maximum - minimum;
+	    return 2.0 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+	}
+
+	int longest_axis() const {
+	    auto d = maximum - minimum;
+	    if (d.x() > d.y() && d.x() > d.z()) return 0;
+	    return d.y() > d.z() ? 1 : 2;
+	}
+
+    public:
+	point3 minimum;
+	point3 maximum;
+};
+
+inline aabb surrounding_box(aabb box0, const aabb& box1) {
+    box0.expand(box1);
+    return box0;
+}
@@ -0,0 +1,143 @@
+#pragma once
+
+#include "arena.h"
+#include "camera.h"
+#include "colour.h"
+#include "common.h"
+#include "hittable.h"
+#include "render.h"
+#include "sampling.h"
+#include "vec3.h"
+
+#include <algorithm>
+#include <optional>
+#include <vector>
+
+// samples every pixel before its error is first estimated
+const int adaptive_min_samples = 16;
+
+// samples added to an unconverged pixel per round
+const int adaptive_batch = 8;
+
+// per pixel cap, as a multiple of samples_per_pixel
+const int adaptive_max_factor = 4;
+
+// path tracer that stops sampling converged pixels early
+//
+// each pixel tracks the running mean and variance of its luminance. a
+// pixel is done once the standard error of its mean drops under
+// settings.adaptive_threshold relative to its brightness. the tile keeps a
+// budget of samples_per_pixel per pixel, and whatever converged pixels leave
+// unspent goes to the noisy ones in rounds until none remain
+class adaptive_renderer {
+    public:
+	// returns the number of samples taken
+	long render_tile(framebuffer& image, const camera& cam, const hittable& world, const render_settings& settings, const tile_bounds& tile);
+
+    private:
+	struct pixel_state {
+	    colour sum;
+	    double mean;
+	    double m2;
+	    int n;
+	    sampler samples;
+	    feature_sum features;
+	};
+
+	void sample(pixel_state& p, int x, int y, int count, const camera& cam, const hittable& world, const render_settings& settings);
+	bool converged(const pixel_state& p, const render_settings& settings) const;
+
+	// per tile, carved from the thread's scratch arena
+	scratch_array<pixel_state> pixels;
+	scratch_array<int> active;
+};
+
+long adaptive_renderer::render_tile(framebuffer& image, const camera& cam, const hittable& world, const render_settings& settings, const tile_bounds& tile) {
+    const int tile_width = tile.end_x - tile.start_x;
+    const int tile_pixels = tile_width * (tile.end_y - tile.start_y);
+    const int min_samples = std::min(adaptive_min_samples, settings.samples_per_pixel);
+    const int max_samples = adaptive_max_factor * settings.samples_per_pixel;
+
+    long budget = static_cast<long>(settings.samples_per_pixel) * tile_pixels;
+    long taken = 0;
+
+    pixels = scratch_array<pixel_state>(thread_scratch(), tile_pixels);
+    active = scratch_array<int>(thread_scratch(), tile_pixels);
+    pixels.assign(tile_pixels, pixel_state());
+    for (int i = 0; i < tile_pixels; i++) {
+	const int x = tile.start_x + i % tile_width;
+	const int y = tile.start_y + i / tile_width;
+	pixels[i].samples.start_pixel(settings.pattern, settings.seed, x, y, settings.image_width);
+	sample(pixels[i], x, y, min_samples, cam, world, settings);
+    }
+    taken += static_cast<long>(min_samples) * tile_pixels;
+
+    while (taken < budget) {
+	active.clear();
+	for (int i = 0; i < tile_pixels; i++) {
+	    if (pixels[i].n < max_samples && !converged(pixels[i], settings)) {
+		active.push_back(i);
+	    }
+	}
+	if (active.empty()) break;
+
+	for (int i : active) {
+	    const int count = std::min(adaptive_batch, max_samples - pixels[i].n);
+	    sample(pixels[i], tile.start_x + i % tile_width, tile.start_y + i / tile_width, count, cam, world, settings);
+	    taken += count;
+	    if (taken >= budget) break;
+	}
+    }
+
+    tile_buffer result(thread_scratch(), tile);
+    std::optional<feature_tile> features;
+    if (settings.features) features.emplace(thread_scratch(), tile);
+    for (int i = 0; i < tile_pixels; i++) {
+	const int x = tile.start_x + i % tile_width;
+	const int y = tile.start_y + i / tile_width;
+	result.set(x, y, pixels[i].sum / pixels[i].n);
+	if (features) features->set(x, y, pixels[i].features);
+    }
+    result.commit(image);
+    if (features) features->commit(*settings.features);
+
+    return taken;
+}
+
+void adaptive_renderer::sample(pixel_state& p, int x, int y, int count, const camera& cam, const hittable& world, const render_settings& settings) {
+    sampler& samples = thread_sampler();
+    samples = p.samples;
+
+    for (int s = 0; s < count; s++) {
+	samples.start_sample(settings.first_sample + p.n);
+	auto u = double(x + sample_1d()) / (settings.image_width - 1);
+	auto v = 1.0 - double(y + sample_1d()) / (settings.image_height - 1);
+	ray r = cam.get_ray(u, v);
+	first_hit hit;
+	colour c = ray_colour(r, world, settings.max_depth, settings.features ? &hit : nullptr);
+	p.sum += c;
+	if (settings.features) {
+	    p.features.add_hit(hit);
+	    p.features.add_sample(c);
+	}
+
+	// welford update of the luminance statistics
+	const double lum = luminance(c);
+	p.n++;
+	const double delta = lum - p.mean;
+	p.mean += delta / p.n;
+	p.m2 += delta * (lum - p.mean);
+    }
+
+    p.samples = samples;
+}
+
+bool adaptive_renderer::converged(const pixel_state& p, const render_settings& settings) const {
+    if (p.n < 2) return false;
+
+    const double variance = p.m2 / (p.n - 1);
+    const double standard_error = sqrt(variance / p.n);
+
+    // floor the brightness so near black pixels aren't chased forever
+    return standard_error <= settings.adaptive_threshold * fmax(p.mean, 0.1);
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "camera.h"
+#include "common.h"
+#include "hittable.h"
+#include "sphere.h"
+#include "vec3.h"
+
+#include <cmath>
+#include <memory>
+#include <vector>
+
+// a looping sequence over t in [0, 1): the camera circles its focus point
+// once and every sphere resting on the ground plane bounces once
+class animation {
+    public:
+	animation(const camera& base) : base(base) {}
+
+	// pick up the spheres sitting on y = 0, leaving the ground itself be
+	void add_bouncers(const std::vector<shared_ptr<hittable>>& objects) {
+	    for (const auto& object : objects) {
+		auto s = std::dynamic_pointer_cast<sphere>(object);
+		if (!s || s->radius > 100 || fabs(s->center.y() - s->radius) > 1e-3) continue;
+
+		// a fixed hash of the slot spreads the phases without touching the scene rng
+		uint32_t h = static_cast<uint32_t>(bouncers.size()) * 0x9e3779b9u;
+		h ^= h >> 16;
+		h *= 0x85ebca6bu;
+		h ^= h >> 13;
+		bouncers.push_back({s.get(), s->center, 2 * s->radius, h / 4294967296.0});
+	    }
+	}
+
+	int bouncer_count() const { return static_cast<int>(bouncers.size()); }
+
+	camera camera_at(double t) const { return base.orbited(2 * pi * t); }
+
+	// move the bouncers to time t, after which the hierarchy holding them needs a refit
+	void move_objects(double t) {
+	    for (auto& b : bouncers) {
+		const double height = b.height * fabs(sin(pi * (t + b.phase)));
+		b.object->move_to(b.rest + vec3(0, height, 0));
+	    }
+	}
+
+    private:
+	struct bouncer {
+	    sphere* object;
+	    point3 rest;
+	    double height;
+	    double phase;
+	};
+
+	camera base;
+	std::vector<bouncer> bouncers;
+};
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// bump allocator over a list of large blocks
+//
+// objects made here sit next to each other in creation order and are all
+// released together by reset() or the destructor, with no per object heap
+// allocation or control block. reset() keeps the blocks, so an arena that
+// is refilled the same way each time, like per tile scratch, stops calling
+// malloc after the first round
+class arena {
+    public:
+	static const size_t default_block_size = 64 * 1024;
+
+	explicit arena(size_t block_size = default_block_size) : block_size(block_size) {}
+	~arena();
+
+	arena(const arena&) = delete;
+	arena& operator=(const arena&) = delete;
+
+	void* allocate(size_t size, size_t align);
+
+	// uninitialised storage for count objects that need no destructor
+	template <typename T>
+	T* allocate_array(size_t count) {
+	    static_assert(std::is_trivially_destructible<T>::value, "arena arrays are never destroyed");
+	    return static_cast<T*>(allocate(count * sizeof(T), alignof(T)));
+	}
+
+	// constructs a T, remembering to destroy it on reset if it needs it
+	template <typename T, typename... Args>
+	T* make(Args&&... args);
+
+	void reset();
+
+	size_t used() const;
+
+    private:
+	struct block {
+	    char* data;
+	    size_t size;
+	};
+
+	struct finalizer {
+	    void (*destroy)(void*);
+	    void* object;
+	    finalizer* next;
+	};
+
+	size_t block_size;
+	std::vector<block> blocks;
+	size_t current = 0; // block being filled
+	size_t offset = 0;  // bytes used in it
+	finalizer* finalizers = nullptr;
+};
+
+arena::~arena() {
+    reset();
+    for (auto& b : blocks) std::free(b.data);
+}
+
+void* arena::allocate(size_t size, size_t align) {
+    while (current < blocks.size()) {
+	const uintptr_t base = reinterpret_cast<uintptr_t>(blocks[current].data);
+	const size_t start = ((base + offset + align - 1) & ~(uintptr_t(align) - 1)) - base;
+	if (start + size <= blocks[current].size) {
+	    offset = start + size;
+	    return blocks[current].data + start;
+	}
+
+	// move on, reusing the next block if the request fits it
+	if (current + 1 < blocks.size() && size + align <= blocks[current + 1].size) {
+	    current++;
+	    offset = 0;
+	    continue;
+	}
+	break;
+    }
+
+    // a new block after the current one, big enough for oversized requests
+    const size_t bytes = std::max(block_size, size + align);
+    char* data = static_cast<char*>(std::malloc(bytes));
+    if (!data) throw std::bad_alloc();
+    const size_t at = blocks.empty() ? 0 : current + 1;
+    blocks.insert(blocks.begin() + at, {data, bytes});
+    current = at;
+    offset = 0;
+    return allocate(size, align);
+}
+
+template <typename T, typename... Args>
+T* arena::make(Args&&... args) {
+    T* object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    if (!std::is_trivially_destructible<T>::value) {
+	finalizer* f = static_cast<finalizer*>(allocate(sizeof(finalizer), alignof(finalizer)));
+	f->destroy = [](void* p) { static_cast<T*>(p)->~T(); };
+	f->object = object;
+	f->next = finalizers;
+	finalizers = f;
+    }
+    return object;
+}
+
+// destroys everything in reverse creation order and rewinds to the first block
+void arena::reset() {
+    for (finalizer* f = finalizers; f; f = f->next) {
+	f->destroy(f->object);
+    }
+    finalizers = nullptr;
+    current = 0;
+    offset = 0;
+}
+
+size_t arena::used() const {
+    size_t total = offset;
+    for (size_t i = 0; i < current && i < blocks.size(); i++) total += blocks[i].size;
+    return total;
+}
+
+// a fixed capacity array carved out of an arena, for per tile temporaries.
+// it never frees or grows, the arena's reset() reclaims it
+template <typename T>
+class scratch_array {
+    public:
+	scratch_array() {}
+	scratch_array(arena& a, size_t capacity) : items(a.allocate_array<T>(capacity)) {}
+
+	void push_back(const T& item) { items[count++] = item; }
+	void clear() { count = 0; }
+	void resize(size_t n) { count = n; } // new entries are left uninitialised
+	void assign(size_t n, const T& value) {
+	    count = n;
+	    for (size_t i = 0; i < n; i++) items[i] = value;
+	}
+
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+
+	T& operator[](size_t i) { return items[i]; }
+	const T& operator[](size_t i) const { return items[i]; }
+	T* begin() { return items; }
+	T* end() { return items + count; }
+	const T* begin() const { return items; }
+	const T* end() const { return items + count; }
+
+    private:
+	T* items = nullptr;
+	size_t count = 0;
+};
+
+// each render thread's scratch arena, reset at the start of every tile
+inline arena& thread_scratch() {
+    thread_local arena scratch(1 << 20);
+    return scratch;
+}
+
+// non owning shared_ptr to an arena object, for the shared_ptr based scene
+// interfaces. whoever holds it must keep the arena alive
+template <typename T>
+std::shared_ptr<T> arena_ptr(T* object) {
+    return std::shared_ptr<T>(std::shared_ptr<void>(), object);
+}
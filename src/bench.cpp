@@ -0,0 +1,299 @@
+#include "common.h"
+
+#include "bvh.h"
+#include "camera.h"
+#include "frame.h"
+#include "framebuffer.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "mesh.h"
+#include "render.h"
+#include "sampling.h"
+#include "scenes.h"
+#include "sphere.h"
+#include "vec3.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define BENCH_WIDTH 320
+#define BENCH_SAMPLES 8
+#define BENCH_DEPTH 50
+#define BENCH_SEED 1
+#define BENCH_REPEATS 5
+#define KERNEL_CALLS 200000
+
+#ifndef BENCH_COMMIT
+#define BENCH_COMMIT "unknown"
+#endif
+
+struct bench_result {
+    std::string name;
+    std::string unit;
+    double value; // lower is better for every result
+};
+
+std::vector<bench_result> results;
+
+// keeps kernel results alive so the calls aren't optimised away
+volatile double sink;
+
+// best of several runs, in seconds
+double time_best(int repeats, const std::function<void()>& f) {
+    double best = infinity;
+    for (int i = 0; i < repeats; i++) {
+	auto start = std::chrono::steady_clock::now();
+	f();
+	std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
+	best = std::min(best, diff.count());
+    }
+    return best;
+}
+
+void kernel(const std::string& name, const std::function<double(int)>& call) {
+    double seconds = time_best(BENCH_REPEATS, [&] {
+	double acc = 0;
+	for (int i = 0; i < KERNEL_CALLS; i++) {
+	    acc += call(i);
+	}
+	sink = acc;
+    });
+    results.push_back({name, "ns/call", 1e9 * seconds / KERNEL_CALLS});
+    std::cerr << name << ": " << results.back().value << " ns/call\n";
+}
+
+void bench_kernels() {
+    seed_random(BENCH_SEED);
+
+    // camera rays into random_balls, shared by the intersection kernels
+    hittable_list world;
+    camera cam;
+    double aspect_ratio = 16.0/9.0;
+    random_balls(world, cam, aspect_ratio);
+    bvh scene(world);
+
+    std::vector<ray> rays(KERNEL_CALLS);
+    for (auto& r : rays) {
+	r = cam.get_ray(random_double(), random_double());
+    }
+
+    const auto& ball = *std::static_pointer_cast<sphere>(world.objects.back());
+    std::vector<ray> ball_rays(KERNEL_CALLS);
+    for (auto& r : ball_rays) {
+	point3 from = ball.center + 4 * random_unit_vector();
+	r = ray(from, ball.center + random_in_unit_sphere() - from);
+    }
+
+    hit_record rec;
+    kernel("sphere::hit", [&](int i) {
+	return ball.hit(ball_rays[i], 0.001, infinity, rec) ? rec.t : 0.0;
+    });
+    kernel("hittable_list::hit", [&](int i) {
+	return world.hit(rays[i], 0.001, infinity, rec) ? rec.t : 0.0;
+    });
+    kernel("bvh::hit", [&](int i) {
+	return scene.hit(rays[i], 0.001, infinity, rec) ? rec.t : 0.0;
+    });
+    kernel("bvh::occluded", [&](int i) {
+	return scene.occluded(rays[i], 0.001, infinity) ? 1.0 : 0.0;
+    });
+
+    // a 100k triangle torus about y, with rays from around it through its tube
+    const int around = 400, tube = 125;
+    std::vector<float> vertices;
+    std::vector<uint32_t> indices;
+    for (int i = 0; i < around; i++) {
+	for (int j = 0; j < tube; j++) {
+	    const double u = 2 * pi * i / around, v = 2 * pi * j / tube;
+	    const double ring = 1 + 0.35 * cos(v);
+	    vertices.insert(vertices.end(), {float(ring * cos(u)), float(0.35 * sin(v)), float(ring * sin(u))});
+	    const uint32_t a = i * tube + j, b = ((i + 1) % around) * tube + j;
+	    const uint32_t c = ((i + 1) % around) * tube + (j + 1) % tube, d = i * tube + (j + 1) % tube;
+	    indices.insert(indices.end(), {a, d, c, a, c, b});
+	}
+    }
+    triangle_mesh torus(nullptr);
+    torus.build(vertices, indices);
+
+    std::vector<ray> torus_rays(KERNEL_CALLS);
+    for (auto& r : torus_rays) {
+	point3 from = 3 * random_unit_vector();
+	r = ray(from, 1.2 * random_in_unit_sphere() - from);
+    }
+    kernel("triangle_mesh::hit", [&](int i) {
+	return torus.hit(torus_rays[i], 0.001, infinity, rec) ? rec.t : 0.0;
+    });
+    kernel("triangle_mesh::occluded", [&](int i) {
+	return torus.occluded(torus_rays[i], 0.001, infinity) ? 1.0 : 0.0;
+    });
+
+    // image positions for the camera and uniforms for the sample warps, scalar
+    // and a vector of lanes per call
+    std::vector<real> uniforms(2 * KERNEL_CALLS + 2 * vreal::width);
+    for (auto& u : uniforms) {
+	u = random_double();
+    }
+    kernel("camera::get_ray", [&](int i) {
+	return cam.get_ray(uniforms[2*i], uniforms[2*i+1]).direction().x();
+    });
+    kernel("cosine_hemisphere", [&](int i) {
+	real x, y, z;
+	cosine_hemisphere(uniforms[2*i], uniforms[2*i+1], x, y, z);
+	return x + y + z;
+    });
+    kernel("cosine_hemisphere/vreal", [&](int i) {
+	const int first = (i * vreal::width) % KERNEL_CALLS;
+	vreal x, y, z;
+	cosine_hemisphere(vreal::load(&uniforms[first]), vreal::load(&uniforms[KERNEL_CALLS + first]), x, y, z);
+	real lanes[vreal::width];
+	(x + y + z).store(lanes);
+	return double(lanes[0]);
+    });
+
+    // a hit from above on a surface facing up
+    hit_record surface;
+    surface.p = point3(0, 0, 0);
+    surface.t = 1;
+    surface.set_face_normal(ray(point3(1, 1, 0), vec3(-1, -1, 0)), vec3(0, 1, 0));
+    const ray incoming(point3(1, 1, 0), vec3(-1, -1, 0));
+
+    lambertian diffuse(colour(0.5, 0.5, 0.5));
+    metal shiny(colour(0.8, 0.8, 0.8), 0.3);
+    dielectric glass(1.5);
+
+    auto scatter = [&](const material& m) {
+	return [&](int) {
+	    colour attenuation;
+	    ray scattered;
+	    m.scatter(incoming, surface, attenuation, scattered);
+	    return scattered.direction().y();
+	};
+    };
+    kernel("lambertian::scatter", scatter(diffuse));
+    kernel("metal::scatter", scatter(shiny));
+    kernel("dielectric::scatter", scatter(glass));
+}
+
+void bench_scene(const std::string& name, const std::function<void(hittable_list&, camera&, double&)>& build, int samples_per_pixel) {
+    seed_random(BENCH_SEED);
+
+    hittable_list world;
+    camera cam;
+    double aspect_ratio = 16.0/9.0;
+    build(world, cam, aspect_ratio);
+
+    const int threads = std::max(1u, std::thread::hardware_concurrency());
+    render_pool pool(threads);
+
+    // each build packs its leaves into the scene's arena, so the tree that's
+    // rendered is built last and only its leaves are counted
+    auto arena_bytes = [&] { return double(world.storage ? world.storage->used() : 0); };
+    const double object_bytes = arena_bytes();
+    bvh scene;
+    double build_seconds = time_best(BENCH_REPEATS, [&] { scene = bvh(world); });
+    double parallel_build_seconds = time_best(BENCH_REPEATS, [&] { scene = bvh(world, &pool); });
+    const double before_leaves = arena_bytes();
+    scene = bvh(world, &pool);
+    const double leaf_bytes = arena_bytes() - before_leaves;
+
+    const int image_height = image_height_for(BENCH_WIDTH, aspect_ratio);
+    const render_settings settings = {BENCH_WIDTH, image_height, samples_per_pixel, BENCH_DEPTH, BENCH_SEED, render_mode::path, 0, false, sample_pattern::sobol, 0};
+    framebuffer image(BENCH_WIDTH, image_height);
+
+    // on the pool's threads, as trace renders, so thread start up isn't timed
+    double render_seconds = time_best(BENCH_REPEATS, [&] { pool.render(image, cam, scene, settings); });
+    const double samples = double(BENCH_WIDTH) * image_height * samples_per_pixel;
+
+    // objects, materials and packed leaves, plus the top level arrays
+    const double scene_bytes = object_bytes + leaf_bytes
+	+ scene.nodes.size() * sizeof(bvh::node) + scene.primitives.size() * sizeof(shared_ptr<hittable>);
+
+    results.push_back({"build/" + name, "ms", 1e3 * build_seconds});
+    results.push_back({"build/" + name + "/parallel", "ms", 1e3 * parallel_build_seconds});
+    results.push_back({"memory/" + name, "MB", scene_bytes / (1 << 20)});
+    results.push_back({"render/" + name, "ms", 1e3 * render_seconds});
+    results.push_back({"render/" + name + "/us_per_sample", "us", 1e6 * render_seconds / samples});
+    std::cerr << name << ": build " << results[results.size() - 5].value << " ms, " << results[results.size() - 4].value << " ms parallel, " << results[results.size() - 3].value << " MB, render "
+	      << results[results.size() - 2].value << " ms [" << static_cast<int>(samples / 1000.0 / render_seconds) << " krps]\n";
+}
+
+// results of an earlier run, one {"name": ..., "value": ...} object per line
+std::map<std::string, double> read_baseline(const std::string& path) {
+    std::map<std::string, double> baseline;
+    std::ifstream in(path);
+    std::string line;
+
+    while (std::getline(in, line)) {
+	auto name_at = line.find("\"name\": \"");
+	auto value_at = line.find("\"value\": ");
+	if (name_at == std::string::npos || value_at == std::string::npos) continue;
+	name_at += 9;
+	auto name = line.substr(name_at, line.find('"', name_at) - name_at);
+	baseline[name] = std::stod(line.substr(value_at + 9));
+    }
+
+    return baseline;
+}
+
+int main(int argc, char *argv[]) {
+    std::string baseline_path;
+    double tolerance = 0.1;
+
+    for (int i = 1; i < argc; i++) {
+	std::string arg = argv[i];
+	if (arg.rfind("--baseline=", 0) == 0) {
+	    baseline_path = arg.substr(11);
+	} else if (arg.rfind("--tolerance=", 0) == 0) {
+	    tolerance = std::stod(arg.substr(12));
+	} else {
+	    std::cerr << "usage: bench [--baseline=file.json] [--tolerance=fraction]\n";
+	    return 1;
+	}
+    }
+
+    bench_kernels();
+
+    bench_scene("two_balls", [](hittable_list& w, camera& c, double& a) { two_balls(w, c, a); }, BENCH_SAMPLES);
+    bench_scene("three_balls", [](hittable_list& w, camera& c, double& a) { three_balls(w, c, a); }, BENCH_SAMPLES);
+    bench_scene("random_balls", random_balls, BENCH_SAMPLES);
+    bench_scene("large_balls_10k", [](hittable_list& w, camera& c, double& a) { large_balls(w, c, a, 10000); }, BENCH_SAMPLES / 2);
+    bench_scene("large_balls_100k", [](hittable_list& w, camera& c, double& a) { large_balls(w, c, a, 100000); }, BENCH_SAMPLES / 2);
+    bench_scene("instanced_balls_100k", [](hittable_list& w, camera& c, double& a) { instanced_balls(w, c, a, 100000 / 7); }, BENCH_SAMPLES / 2);
+
+    std::cout << "{\n";
+    std::cout << "  \"commit\": \"" << BENCH_COMMIT << "\",\n";
+    std::cout << "  \"threads\": " << std::thread::hardware_concurrency() << ",\n";
+    std::cout << "  \"width\": " << BENCH_WIDTH << ",\n";
+    std::cout << "  \"samples\": " << BENCH_SAMPLES << ",\n";
+    std::cout << "  \"seed\": " << BENCH_SEED << ",\n";
+    std::cout << "  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+	std::cout << "    {\"name\": \"" << results[i].name << "\", \"unit\": \"" << results[i].unit
+		  << "\", \"value\": " << results[i].value << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    std::cout << "  ]\n}\n";
+
+    if (baseline_path.empty()) return 0;
+
+    int regressions = 0;
+    auto baseline = read_baseline(baseline_path);
+    for (const auto& r : results) {
+	auto old = baseline.find(r.name);
+	if (old == baseline.end() || old->second <= 0) continue;
+
+	double change = r.value / old->second - 1;
+	bool regressed = change > tolerance;
+	regressions += regressed;
+	std::cerr << (regressed ? "REGRESSION " : "           ") << r.name << ": " << old->second << " -> " << r.value
+		  << " " << r.unit << " (" << (change >= 0 ? "+" : "") << 100 * change << "%)\n";
+    }
+
+    return regressions > 0 ? 2 : 0;
+}
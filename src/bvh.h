@@ -0,0 +1,564 @@
+#pragma once
+
+#include "aabb.h"
+#include "arena.h"
+#include "common.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "simd.h"
+#include "sphere.h"
+#include "sphere_set.h"
+#include "stats.h"
+#include "worker_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+// binned SAH build over bare boxes, shared by every hierarchy in the tree
+//
+// nodes are stored depth first, so an interior node's left child always
+// directly follows it and only the right child index needs storing. leaves
+// index runs of `order`, the input primitives permuted into leaf order.
+// primitives flagged packable are tested leaf_width at a time, which the
+// leaf cost accounts for
+//
+// given a pool, the top of the tree is binned across its threads and the
+// ranges below that are built as independent subtrees, one task each, then
+// spliced in depth first. bins merge by unions and sums, so the tree is the
+// one a serial build makes
+class bvh_builder {
+    public:
+	static const int bin_count = 16;
+	static const int max_depth = 64;
+	static const int parallel_grain = 4096; // smallest range worth a task
+
+	struct node {
+	    aabb box;
+	    int offset; // first primitive for leaves, right child for interior nodes
+	    int count;  // primitive count, 0 for interior nodes
+	    int axis;   // split axis, used to visit the nearer child first
+	};
+
+	bvh_builder(int max_leaf_size, int leaf_width) : max_leaf_size(max_leaf_size), leaf_width(leaf_width) {}
+
+	void build(const std::vector<aabb>& boxes, const std::vector<bool>& packable, worker_pool* workers = nullptr);
+
+    public:
+	std::vector<node> nodes;
+	std::vector<int> order;
+
+    private:
+	struct prim_info {
+	    aabb box;
+	    point3 centroid;
+	    int index;
+	    bool packable;
+	};
+
+	// a range's bounds and its centroids binned along each axis
+	struct bins {
+	    aabb bounds, centroid_bounds;
+	    int packable_count = 0;
+	    int counts[3][bin_count] = {};
+	    aabb boxes[3][bin_count];
+
+	    void merge(const bins& other);
+	};
+
+	// a range left for a task, its node a placeholder until the splice
+	struct subtree {
+	    int begin, end, depth;
+	};
+
+	int build(std::vector<prim_info>& prims, int begin, int end, int depth);
+
+	template <typename F>
+	void gather(int begin, int end, bins& into, const F& accumulate) const;
+
+	int splice(const std::vector<node>& top, const std::vector<int>& top_order, const std::vector<bvh_builder>& parts, int i);
+
+	int max_leaf_size;
+	int leaf_width;
+
+	// set while a pool builds the top of the tree
+	worker_pool* pool = nullptr;
+	int subtree_size = 0;
+	std::vector<subtree> subtrees;
+};
+
+void bvh_builder::bins::merge(const bins& other) {
+    bounds.expand(other.bounds);
+    centroid_bounds.expand(other.centroid_bounds);
+    packable_count += other.packable_count;
+    for (int axis = 0; axis < 3; axis++) {
+	for (int b = 0; b < bin_count; b++) {
+	    counts[axis][b] += other.counts[axis][b];
+	    boxes[axis][b].expand(other.boxes[axis][b]);
+	}
+    }
+}
+
+void bvh_builder::build(const std::vector<aabb>& boxes, const std::vector<bool>& packable, worker_pool* workers) {
+    nodes.clear();
+    order.clear();
+    subtrees.clear();
+    if (boxes.empty()) return;
+
+    std::vector<prim_info> prims(boxes.size());
+    for (size_t i = 0; i < boxes.size(); i++) {
+	prims[i] = {boxes[i], boxes[i].centroid(), static_cast<int>(i), packable[i]};
+    }
+
+    const int count = static_cast<int>(prims.size());
+    pool = workers && workers->size() > 1 && count >= 2 * parallel_grain ? workers : nullptr;
+    subtree_size = pool ? std::max(int(parallel_grain), count / (8 * pool->size())) : 0;
+
+    nodes.reserve(2 * prims.size() - 1);
+    order.reserve(prims.size());
+    build(prims, 0, count, 0);
+    if (!pool) return;
+
+    // largest first, so no big subtree is left to start last
+    std::vector<int> by_size(subtrees.size());
+    for (size_t i = 0; i < by_size.size(); i++) by_size[i] = static_cast<int>(i);
+    std::sort(by_size.begin(), by_size.end(), [&](int a, int b) {
+	return subtrees[a].end - subtrees[a].begin > subtrees[b].end - subtrees[b].begin;
+    });
+
+    std::vector<bvh_builder> parts(subtrees.size(), bvh_builder(max_leaf_size, leaf_width));
+    std::atomic<size_t> next(0);
+    pool->run([&](int) {
+	for (size_t k; (k = next++) < by_size.size();) {
+	    const subtree& s = subtrees[by_size[k]];
+	    parts[by_size[k]].build(prims, s.begin, s.end, s.depth);
+	}
+    });
+    pool = nullptr;
+
+    const std::vector<node> top = std::move(nodes);
+    const std::vector<int> top_order = std::move(order);
+    nodes.clear();
+    order.clear();
+    nodes.reserve(2 * prims.size() - 1);
+    order.reserve(prims.size());
+    splice(top, top_order, parts, 0);
+}
+
+// accumulate [begin, end) into `into`, in chunks across the pool when there's enough of it
+template <typename F>
+void bvh_builder::gather(int begin, int end, bins& into, const F& accumulate) const {
+    const int count = end - begin;
+    if (!pool || count < 2 * parallel_grain) {
+	accumulate(begin, end, into);
+	return;
+    }
+
+    const int workers = pool->size();
+    const int chunk = (count + workers - 1) / workers;
+    std::vector<bins> partial(workers);
+    pool->run([&](int worker) {
+	const int first = begin + std::min(count, worker * chunk);
+	const int last = begin + std::min(count, (worker + 1) * chunk);
+	accumulate(first, last, partial[worker]);
+    });
+    for (const auto& p : partial) {
+	into.merge(p);
+    }
+}
+
+int bvh_builder::build(std::vector<prim_info>& prims, int begin, int end, int depth) {
+    const int index = static_cast<int>(nodes.size());
+    nodes.push_back(node());
+
+    const int count = end - begin;
+    if (pool && count <= subtree_size) {
+	nodes[index].offset = static_cast<int>(subtrees.size());
+	nodes[index].count = -1;
+	subtrees.push_back({begin, end, depth});
+	return index;
+    }
+
+    bins b;
+    gather(begin, end, b, [&](int first, int last, bins& into) {
+	for (int i = first; i < last; i++) {
+	    into.bounds.expand(prims[i].box);
+	    into.centroid_bounds.expand(prims[i].centroid);
+	    if (prims[i].packable) into.packable_count++;
+	}
+    });
+
+    const aabb& bounds = b.bounds;
+    const aabb& centroid_bounds = b.centroid_bounds;
+    nodes[index].box = bounds;
+    nodes[index].axis = 0;
+
+    // pick the cheapest binned split over all three axes
+    int best_axis = -1;
+    int best_split = 0;
+    double best_cost = infinity;
+
+    if (count > 1 && depth < max_depth) {
+	gather(begin, end, b, [&](int first, int last, bins& into) {
+	    for (int axis = 0; axis < 3; axis++) {
+		const double cmin = centroid_bounds.min()[axis];
+		const double extent = centroid_bounds.max()[axis] - cmin;
+		if (extent <= 0) continue;
+
+		const double scale = bin_count / extent;
+		for (int i = first; i < last; i++) {
+		    int bin = std::min(bin_count - 1, static_cast<int>(scale * (prims[i].centroid[axis] - cmin)));
+		    into.counts[axis][bin]++;
+		    into.boxes[axis][bin].expand(prims[i].box);
+		}
+	    }
+	});
+
+	for (int axis = 0; axis < 3; axis++) {
+	    if (centroid_bounds.max()[axis] - centroid_bounds.min()[axis] <= 0) continue;
+	    const int* bin_counts = b.counts[axis];
+	    const aabb* bin_boxes = b.boxes[axis];
+
+	    // sweep from the right recording the cost of everything right of each split
+	    double right_cost[bin_count];
+	    aabb acc;
+	    int n = 0;
+	    for (int bin = bin_count - 1; bin > 0; bin--) {
+		acc.expand(bin_boxes[bin]);
+		n += bin_counts[bin];
+		right_cost[bin] = n * acc.surface_area();
+	    }
+
+	    acc = aabb();
+	    n = 0;
+	    for (int bin = 0; bin < bin_count - 1; bin++) {
+		acc.expand(bin_boxes[bin]);
+		n += bin_counts[bin];
+		double cost = n * acc.surface_area() + right_cost[bin + 1];
+		if (n > 0 && n < count && cost < best_cost) {
+		    best_cost = cost;
+		    best_axis = axis;
+		    best_split = bin + 1;
+		}
+	    }
+	}
+    }
+
+    // relative cost of a traversal step against a primitive test
+    const double traversal_cost = 0.125;
+    const double area = bounds.surface_area();
+    const int packed_tests = (b.packable_count + leaf_width - 1) / leaf_width;
+    const double leaf_cost = packed_tests + (count - b.packable_count);
+    const double split_cost = area > 0 ? traversal_cost + best_cost / area : infinity;
+
+    if (best_axis < 0 || (count <= max_leaf_size && leaf_cost <= split_cost)) {
+	nodes[index].offset = static_cast<int>(order.size());
+	nodes[index].count = count;
+	for (int i = begin; i < end; i++) {
+	    order.push_back(prims[i].index);
+	}
+	return index;
+    }
+
+    const double cmin = centroid_bounds.min()[best_axis];
+    const double scale = bin_count / (centroid_bounds.max()[best_axis] - cmin);
+    auto mid = std::partition(prims.begin() + begin, prims.begin() + end, [&](const prim_info& p) {
+	return std::min(bin_count - 1, static_cast<int>(scale * (p.centroid[best_axis] - cmin))) < best_split;
+    });
+    const int split = static_cast<int>(mid - prims.begin());
+
+    nodes[index].count = 0;
+    nodes[index].axis = best_axis;
+    build(prims, begin, split, depth + 1);
+    const int right = build(prims, split, end, depth + 1);
+    nodes[index].offset = right;
+
+    return index;
+}
+
+// copy the top of the tree depth first, dropping each task's subtree in
+// place of its placeholder with its node and primitive indices shifted
+int bvh_builder::splice(const std::vector<node>& top, const std::vector<int>& top_order, const std::vector<bvh_builder>& parts, int i) {
+    const node& n = top[i];
+    const int index = static_cast<int>(nodes.size());
+
+    if (n.count < 0) {
+	const bvh_builder& part = parts[n.offset];
+	const int order_base = static_cast<int>(order.size());
+	for (node copy : part.nodes) {
+	    copy.offset += copy.count > 0 ? order_base : index;
+	    nodes.push_back(copy);
+	}
+	order.insert(order.end(), part.order.begin(), part.order.end());
+	return index;
+    }
+
+    nodes.push_back(n);
+    if (n.count > 0) {
+	nodes[index].offset = static_cast<int>(order.size());
+	order.insert(order.end(), top_order.begin() + n.offset, top_order.begin() + n.offset + n.count);
+	return index;
+    }
+
+    splice(top, top_order, parts, i + 1);
+    nodes[index].offset = splice(top, top_order, parts, n.offset);
+    return index;
+}
+
+// the walks shared by every flattened hierarchy laid out as bvh_builder
+// leaves its nodes, whether held in memory or mapped from a cache.
+// node_box(n) gives a node's box
+inline const aabb& node_box(const bvh_builder::node& n) { return n.box; }
+
+// the nearest hit within [t_min, closest]. leaf(n, closest) tests a leaf's
+// primitives, shrinking closest and returning true on a hit
+template <typename Node, typename Leaf>
+bool bvh_nearest(const Node* nodes, const ray& r, real t_min, real& closest, const Leaf& leaf) {
+    const bool dir_neg[3] = {
+	r.direction().x() < 0, r.direction().y() < 0, r.direction().z() < 0
+    };
+
+    bool hit_anything = false;
+    int stack[bvh_builder::max_depth + 1];
+    int stack_size = 0;
+    int current = 0;
+
+    while (true) {
+	const Node& n = nodes[current];
+	STAT_INC(bvh_nodes);
+
+	if (node_box(n).hit(r, t_min, closest)) {
+	    if (n.count > 0) {
+		if (leaf(n, closest)) hit_anything = true;
+	    } else {
+		// visit the child nearer the ray origin first, defer the other
+		if (dir_neg[n.axis]) {
+		    stack[stack_size++] = current + 1;
+		    current = n.offset;
+		} else {
+		    stack[stack_size++] = n.offset;
+		    current = current + 1;
+		}
+		continue;
+	    }
+	}
+
+	if (stack_size == 0) break;
+	current = stack[--stack_size];
+    }
+
+    return hit_anything;
+}
+
+// whether anything is hit within [t_min, t_max]. the interval never
+// shrinks, so child order doesn't matter and the first leaf(n) to report
+// a hit ends the walk
+template <typename Node, typename Leaf>
+bool bvh_any(const Node* nodes, const ray& r, real t_min, real t_max, const Leaf& leaf) {
+    int stack[bvh_builder::max_depth + 1];
+    int stack_size = 0;
+    int current = 0;
+
+    while (true) {
+	const Node& n = nodes[current];
+	STAT_INC(bvh_nodes);
+
+	if (node_box(n).hit(r, t_min, t_max)) {
+	    if (n.count > 0) {
+		if (leaf(n)) return true;
+	    } else {
+		stack[stack_size++] = n.offset;
+		current = current + 1;
+		continue;
+	    }
+	}
+
+	if (stack_size == 0) break;
+	current = stack[--stack_size];
+    }
+
+    return false;
+}
+
+// flattened bounding volume hierarchy built with binned SAH
+//
+// spheres sharing a leaf are packed into a sphere_set so they are tested
+// a vector at a time. the sets are made in leaf order in the scene's arena,
+// which the hierarchy keeps alive along with the objects it points at
+class bvh : public hittable {
+    public:
+	static const int max_leaf_size = vreal::width > 2 ? 2 * vreal::width : 4;
+	static const int max_depth = bvh_builder::max_depth;
+
+	using node = bvh_builder::node;
+
+	bvh() {}
+	// the build runs on pool's threads when one is given
+	bvh(const hittable_list& list, worker_pool* pool = nullptr) : bvh(list.objects, list.storage, pool) {}
+	bvh(const std::vector<shared_ptr<hittable>>& objects, shared_ptr<arena> storage = nullptr, worker_pool* pool = nullptr);
+
+	virtual bool hit(
+		const ray& r, real t_min, real t_max, hit_record& rec) const override;
+
+	virtual bool intersect(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+
+	virtual bool bounding_box(aabb& output_box) const override;
+
+	virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+
+	// recompute every box bottom up after objects moved, keeping the tree's
+	// shape. far cheaper than a rebuild, though traversal slows as objects
+	// drift away from where the tree was built
+	void refit();
+
+    public:
+	std::vector<node> nodes;
+	std::vector<shared_ptr<hittable>> primitives;
+	std::vector<shared_ptr<hittable>> unbounded; // tested linearly, e.g. infinite planes
+	shared_ptr<arena> storage;
+
+    private:
+	// the spheres each packed set copied, to copy again on refit
+	struct packed_leaf {
+	    sphere_set* set;
+	    std::vector<const sphere*> sources;
+	};
+
+	std::vector<packed_leaf> packed_leaves;
+};
+
+bvh::bvh(const std::vector<shared_ptr<hittable>>& objects, shared_ptr<arena> scene_storage, worker_pool* pool) : storage(scene_storage) {
+    if (!storage) storage = make_shared<arena>();
+
+    std::vector<shared_ptr<hittable>> bounded;
+    std::vector<aabb> boxes;
+    std::vector<bool> packable;
+
+    for (const auto& object : objects) {
+	aabb box;
+	if (object->bounding_box(box)) {
+	    bounded.push_back(object);
+	    boxes.push_back(box);
+	    packable.push_back(std::dynamic_pointer_cast<sphere>(object) != nullptr);
+	} else {
+	    unbounded.push_back(object);
+	}
+    }
+
+    bvh_builder builder(max_leaf_size, vreal::width);
+    builder.build(boxes, packable, pool);
+    nodes = std::move(builder.nodes);
+    primitives.reserve(bounded.size());
+
+    // repoint leaves at their primitives, packing a leaf's spheres into one set
+    for (auto& n : nodes) {
+	if (n.count == 0) continue;
+
+	const int first = n.offset;
+	const int last = n.offset + n.count;
+	int packable_count = 0;
+	for (int i = first; i < last; i++) {
+	    packable_count += packable[builder.order[i]];
+	}
+
+	n.offset = static_cast<int>(primitives.size());
+	shared_ptr<sphere_set> packed;
+	if (packable_count > 1) {
+	    packed = arena_ptr(storage->make<sphere_set>());
+	    packed_leaves.push_back({packed.get(), {}});
+	}
+	for (int i = first; i < last; i++) {
+	    const int p = builder.order[i];
+	    if (packed && packable[p]) {
+		const sphere& s = *std::static_pointer_cast<sphere>(bounded[p]);
+		packed->add(s);
+		packed_leaves.back().sources.push_back(&s);
+	    } else {
+		primitives.push_back(bounded[p]);
+	    }
+	}
+	if (packed) {
+	    primitives.push_back(packed);
+	}
+	n.count = static_cast<int>(primitives.size()) - n.offset;
+    }
+}
+
+bool bvh::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    if (!intersect(r, t_min, t_max, rec)) return false;
+    complete_hit(r, rec);
+    rec.source = nullptr;
+    return true;
+}
+
+bool bvh::intersect(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    bool hit_anything = false;
+    auto closest_so_far = t_max;
+
+    for (const auto& object : unbounded) {
+	if (object->intersect(r, t_min, closest_so_far, rec)) {
+	    hit_anything = true;
+	    closest_so_far = rec.t;
+	}
+    }
+
+    if (nodes.empty()) return hit_anything;
+
+    const bool hit_nodes = bvh_nearest(nodes.data(), r, t_min, closest_so_far, [&](const node& n, real& closest) {
+	bool hit_leaf = false;
+	for (int i = n.offset; i < n.offset + n.count; i++) {
+	    if (primitives[i]->intersect(r, t_min, closest, rec)) {
+		hit_leaf = true;
+		closest = rec.t;
+	    }
+	}
+	return hit_leaf;
+    });
+    return hit_nodes || hit_anything;
+}
+
+bool bvh::occluded(const ray& r, real t_min, real t_max) const {
+    for (const auto& object : unbounded) {
+	if (object->occluded(r, t_min, t_max)) return true;
+    }
+
+    if (nodes.empty()) return false;
+
+    return bvh_any(nodes.data(), r, t_min, t_max, [&](const node& n) {
+	for (int i = n.offset; i < n.offset + n.count; i++) {
+	    if (primitives[i]->occluded(r, t_min, t_max)) return true;
+	}
+	return false;
+    });
+}
+
+void bvh::refit() {
+    for (auto& leaf : packed_leaves) {
+	for (size_t i = 0; i < leaf.sources.size(); i++) {
+	    leaf.set->update(static_cast<int>(i), leaf.sources[i]->center, leaf.sources[i]->radius);
+	}
+    }
+
+    // children always come after their parent, so a reverse sweep sees them first
+    for (int i = static_cast<int>(nodes.size()) - 1; i >= 0; i--) {
+	node& n = nodes[i];
+	aabb box;
+	if (n.count > 0) {
+	    for (int p = n.offset; p < n.offset + n.count; p++) {
+		aabb primitive_box;
+		if (primitives[p]->bounding_box(primitive_box)) box.expand(primitive_box);
+	    }
+	} else {
+	    box = nodes[i + 1].box;
+	    box.expand(nodes[n.offset].box);
+	}
+	n.box = box;
+    }
+}
+
+bool bvh::bounding_box(aabb& output_box) const {
+    if (!unbounded.empty()) return false;
+    if (nodes.empty()) return false;
+    output_box = nodes[0].box;
+    return true;
+}
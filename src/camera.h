@@ -1,6 +1,7 @@
 #pragma once
 
 #include "common.h"
+#include "sampling.h"
 #include "vec3.h"
 
 class camera {
@@ -40,8 +41,8 @@ class camera {
 	    lens_radius = aperture / 2;
 	}
 
-	ray get_ray(double s, double t) const {
-	    vec3 rd = lens_radius * random_in_unit_disk();
+	ray get_ray(real s, real t) const {
+	    vec3 rd = lens_radius * sample_unit_disk();
 	    vec3 offset = u * rd.x() + v * rd.y();
 
 	    return ray(
@@ -49,11 +50,36 @@ class camera {
 		lower_left_corner + s * horizontal + t * vertical - origin - offset);
 	}
 
+	// the same camera turned by angle radians about the vertical line
+	// through its focus point, which stays at the centre of the image
+	camera orbited(double angle) const {
+	    const point3 pivot = lower_left_corner + horizontal / 2 + vertical / 2;
+	    const real c = cos(angle), s = sin(angle);
+	    auto turn = [&](vec3 d) { return vec3(c * d.x() + s * d.z(), d.y(), c * d.z() - s * d.x()); };
+
+	    camera turned = *this;
+	    turned.origin = pivot + turn(origin - pivot);
+	    turned.lower_left_corner = pivot + turn(lower_left_corner - pivot);
+	    turned.horizontal = turn(horizontal);
+	    turned.vertical = turn(vertical);
+	    turned.u = turn(u);
+	    turned.v = turn(v);
+	    turned.w = turn(w);
+	    return turned;
+	}
+
     private:
 	point3 origin;
 	point3 lower_left_corner;
 	vec3 horizontal;
 	vec3 vertical;
 	vec3 u, v, w;
-	double lens_radius;
+	real lens_radius;
 };
+
+// rows for an image width at an aspect ratio. scene files give ratios to a
+// few decimals, 1.7777778 for 16/9, which leave the quotient a hair under a
+// whole row, so it's nudged up before truncating, as the exact ratio would be
+inline int image_height_for(int image_width, double aspect_ratio) {
+    return static_cast<int>(image_width / aspect_ratio * (1 + 1e-6));
+}
@@ -0,0 +1,278 @@
+#pragma once
+
+#include "colour.h"
+#include "framebuffer.h"
+#include "render.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// a render's accumulated samples kept in a memory mapped file, so a killed
+// render can start again where it stopped
+//
+// every pixel holds the sum of its samples so far and how many there are,
+// with a spare slot for the sum: a commit writes the new sum there, then
+// switches slot and count in one store, so a crash between the two never
+// leaves a pass in the sum but not the count, or the other way round.
+// samples are a function of pixel, sample index and settings alone, so the
+// count is all the sequence state there is: a pass adds samples
+// [first_sample, first_sample + n) to the pixels that have exactly
+// first_sample, and tiles whose pixels all have more are skipped. a finished
+// tile is in the file as soon as it's committed and the file is synced to
+// disk every few seconds, so a resumed render loses at most the tiles that
+// were in flight, and its image matches an uninterrupted one
+
+struct checkpoint_header {
+    static const uint32_t current_version = 2;
+
+    char magic[8];
+    uint32_t version;
+    int32_t width;
+    int32_t height;
+    int32_t samples_per_pixel;
+    int32_t max_depth;
+    int32_t mode;
+    int32_t pattern;
+    int32_t pass_samples; // 0 for a single pass
+    uint64_t seed;
+    double adaptive_threshold;
+    char scene[256];
+};
+
+// a pixel's samples, 64 bytes so no record straddles a page
+struct checkpoint_pixel {
+    static const uint64_t slot_bit = uint64_t(1) << 32;
+
+    double sums[2][3];
+    uint64_t state; // the sample count, with slot_bit set when sums[1] holds their sum
+    uint64_t pad;
+
+    uint32_t samples() const { return static_cast<uint32_t>(state); }
+    const double* sum() const { return sums[state & slot_bit ? 1 : 0]; }
+};
+
+static_assert(sizeof(checkpoint_pixel) == 64, "checkpoint pixels are a cache line");
+
+const char checkpoint_magic[8] = {'T', 'R', 'C', 'K', 'P', 'T', 0, 0};
+
+class render_checkpoint {
+    public:
+	render_checkpoint(double sync_seconds) : sync_seconds(sync_seconds) {}
+	~render_checkpoint() { close(); }
+
+	render_checkpoint(const render_checkpoint&) = delete;
+	render_checkpoint& operator=(const render_checkpoint&) = delete;
+
+	// the header identifying a render, which a file must match to resume it
+	static checkpoint_header describe(const render_settings& settings, int pass_samples, const std::string& scene);
+
+	// map path, creating it for a fresh render, or resuming the one it holds
+	// when its header matches expected
+	bool open(const std::string& path, const checkpoint_header& expected, std::string& error);
+
+	// the fewest samples any pixel has, where a resumed render carries on from
+	int samples_done() const;
+
+	// how many pixels have all of samples
+	long pixels_with(int samples) const;
+
+	// the samples every pixel has between them
+	long samples_total() const;
+
+	// whether every pixel in tile already has the samples a pass would add
+	bool holds(const tile_bounds& tile, const render_settings& settings) const;
+
+	// add a tile's pass, its mean in image, to the pixels waiting for it,
+	// syncing the file when it's been long enough since the last time
+	void commit(const framebuffer& image, const tile_bounds& tile, const render_settings& settings);
+
+	// the mean of each pixel's samples so far
+	void resolve(framebuffer& image) const;
+
+	void sync();
+
+    private:
+	void close();
+
+	checkpoint_pixel& at(int x, int y) const { return pixels[static_cast<size_t>(y) * width + x]; }
+
+	double sync_seconds;
+	int width = 0;
+	int height = 0;
+	void* mapping = nullptr;
+	size_t mapping_size = 0;
+	checkpoint_pixel* pixels = nullptr;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::atomic<double> last_sync{0};
+};
+
+checkpoint_header render_checkpoint::describe(const render_settings& settings, int pass_samples, const std::string& scene) {
+    checkpoint_header h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, checkpoint_magic, sizeof(h.magic));
+    h.version = checkpoint_header::current_version;
+    h.width = settings.image_width;
+    h.height = settings.image_height;
+    h.samples_per_pixel = settings.samples_per_pixel;
+    h.max_depth = settings.max_depth;
+    h.mode = static_cast<int32_t>(settings.mode);
+    h.pattern = static_cast<int32_t>(settings.pattern);
+    h.pass_samples = pass_samples;
+    h.seed = settings.seed;
+    h.adaptive_threshold = settings.adaptive_threshold;
+    std::strncpy(h.scene, scene.c_str(), sizeof(h.scene) - 1);
+    return h;
+}
+
+bool render_checkpoint::open(const std::string& path, const checkpoint_header& expected, std::string& error) {
+    close();
+
+    // records start on their own page, after the header
+    const size_t records_offset = 4096;
+    const size_t size = records_offset + static_cast<size_t>(expected.width) * expected.height * sizeof(checkpoint_pixel);
+
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+	error = "cannot open " + path;
+	return false;
+    }
+
+    struct stat st;
+    const bool fresh = fstat(fd, &st) == 0 && st.st_size == 0;
+    if (fresh && ftruncate(fd, size) != 0) {
+	::close(fd);
+	error = "cannot size " + path;
+	return false;
+    }
+    if (!fresh && static_cast<size_t>(st.st_size) != size) {
+	::close(fd);
+	error = path + " is not a checkpoint of this render";
+	return false;
+    }
+
+    mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+	mapping = nullptr;
+	error = "cannot map " + path;
+	return false;
+    }
+    mapping_size = size;
+
+    // a file sized but never given its header has nothing committed either
+    auto header = static_cast<checkpoint_header*>(mapping);
+    const char unwritten[sizeof(header->magic)] = {};
+    if (fresh || std::memcmp(header->magic, unwritten, sizeof(unwritten)) == 0) {
+	*header = expected;
+	sync();
+    } else if (std::memcmp(header, &expected, sizeof(expected)) != 0) {
+	close();
+	error = path + " is not a checkpoint of this render";
+	return false;
+    }
+
+    width = expected.width;
+    height = expected.height;
+    pixels = reinterpret_cast<checkpoint_pixel*>(static_cast<char*>(mapping) + records_offset);
+    return true;
+}
+
+int render_checkpoint::samples_done() const {
+    uint32_t fewest = UINT32_MAX;
+    for (int y = 0; y < height; y++) {
+	for (int x = 0; x < width; x++) {
+	    fewest = std::min(fewest, at(x, y).samples());
+	}
+    }
+    return pixels ? static_cast<int>(fewest) : 0;
+}
+
+long render_checkpoint::pixels_with(int samples) const {
+    long count = 0;
+    for (int y = 0; y < height; y++) {
+	for (int x = 0; x < width; x++) {
+	    if (at(x, y).samples() >= static_cast<uint32_t>(samples)) count++;
+	}
+    }
+    return count;
+}
+
+long render_checkpoint::samples_total() const {
+    long total = 0;
+    for (int y = 0; y < height; y++) {
+	for (int x = 0; x < width; x++) {
+	    total += at(x, y).samples();
+	}
+    }
+    return total;
+}
+
+bool render_checkpoint::holds(const tile_bounds& tile, const render_settings& settings) const {
+    const uint32_t needed = settings.first_sample + settings.samples_per_pixel;
+    for (int y = tile.start_y; y < tile.end_y; y++) {
+	for (int x = tile.start_x; x < tile.end_x; x++) {
+	    if (at(x, y).samples() < needed) return false;
+	}
+    }
+    return true;
+}
+
+void render_checkpoint::commit(const framebuffer& image, const tile_bounds& tile, const render_settings& settings) {
+    for (int y = tile.start_y; y < tile.end_y; y++) {
+	for (int x = tile.start_x; x < tile.end_x; x++) {
+	    checkpoint_pixel& p = at(x, y);
+	    if (p.samples() != static_cast<uint32_t>(settings.first_sample)) continue;
+
+	    // summed as colour, as an accumulation in memory would be
+	    const double* current = p.sum();
+	    colour sum(current[0], current[1], current[2]);
+	    sum += settings.samples_per_pixel * image.get(x, y);
+	    const int spare = p.state & checkpoint_pixel::slot_bit ? 0 : 1;
+	    p.sums[spare][0] = sum.x();
+	    p.sums[spare][1] = sum.y();
+	    p.sums[spare][2] = sum.z();
+
+	    // the sum is in place before the store that makes it current
+	    std::atomic_signal_fence(std::memory_order_release);
+	    p.state = (spare ? checkpoint_pixel::slot_bit : 0) | (p.samples() + settings.samples_per_pixel);
+	}
+    }
+
+    // one thread syncs while the rest carry on into the pages after it
+    const double now = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double last = last_sync;
+    if (now - last >= sync_seconds && last_sync.compare_exchange_strong(last, now)) {
+	sync();
+    }
+}
+
+void render_checkpoint::resolve(framebuffer& image) const {
+    for (int y = 0; y < height; y++) {
+	for (int x = 0; x < width; x++) {
+	    const checkpoint_pixel& p = at(x, y);
+	    if (p.samples() > 0) image.set(x, y, colour(p.sum()[0], p.sum()[1], p.sum()[2]) / p.samples());
+	}
+    }
+}
+
+void render_checkpoint::sync() {
+    if (mapping) msync(mapping, mapping_size, MS_SYNC);
+}
+
+void render_checkpoint::close() {
+    if (mapping) {
+	sync();
+	munmap(mapping, mapping_size);
+    }
+    mapping = nullptr;
+    pixels = nullptr;
+}
@@ -4,17 +4,20 @@
 
 #include <iostream>
 
-void write_colour(std::ostream &out, colour pixel_colour, int samples_per_pixel) {
-    auto r = pixel_colour.x();
-    auto g = pixel_colour.y();
-    auto b = pixel_colour.z();
+// rec. 709 luminance of a linear colour
+inline double luminance(const colour& c) {
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
+// gamma 2 encode one linear channel and quantize it to 8 bits
+inline unsigned char encode_channel(double linear) {
+    return static_cast<unsigned char>(256 * clamp(sqrt(linear), 0.0, 0.999));
+}
 
+void write_colour(std::ostream &out, colour pixel_colour, int samples_per_pixel) {
     auto scale = 1.0 / samples_per_pixel;
-    r = sqrt(scale * r);
-    g = sqrt(scale * g);
-    b = sqrt(scale * b);
-    
-    out << static_cast<int>(256 * clamp(r, 0.0, 0.999)) << ' '
-	<< static_cast<int>(256 * clamp(g, 0.0, 0.999)) << ' '
-	<< static_cast<int>(256 * clamp(b, 0.0, 0.999)) << '\n';
+
+    out << static_cast<int>(encode_channel(scale * pixel_colour.x())) << ' '
+	<< static_cast<int>(encode_channel(scale * pixel_colour.y())) << ' '
+	<< static_cast<int>(encode_channel(scale * pixel_colour.z())) << '\n';
 }
@@ -1,9 +1,9 @@
 #pragma once
 
 #include <cmath>
+#include <cstdint>
 #include <limits>
 #include <memory>
-#include <random>
 
 // usings
 
@@ -11,6 +11,14 @@ using std::shared_ptr;
 using std::make_shared;
 using std::sqrt;
 
+// scalar type for geometry and colour, float when built with -DTRACE_FLOAT
+
+#ifdef TRACE_FLOAT
+using real = float;
+#else
+using real = double;
+#endif
+
 // constants
 
 const double infinity = std::numeric_limits<double>::infinity();
@@ -22,22 +30,79 @@ inline double degrees_to_radians(double degrees) {
     return degrees * pi / 180.0;
 }
 
-inline int random_int(int min, int max) {
-    static std::uniform_int_distribution<int> distribution(min, max);
-    static std::mt19937 generator;
-    return distribution(generator);
+// xoshiro256+ generator
+//
+// each thread owns one, so render workers never share generator state, and
+// reseeding per pixel makes a render independent of tile scheduling
+class rng {
+    public:
+	rng(uint64_t seed = 0) { reseed(seed); }
+
+	void reseed(uint64_t seed) {
+	    // splitmix64 to spread a small seed over the whole state
+	    for (auto& word : s) {
+		seed += 0x9e3779b97f4a7c15;
+		word = mix(seed);
+	    }
+	}
+
+	uint64_t next() {
+	    const uint64_t result = s[0] + s[3];
+	    const uint64_t t = s[1] << 17;
+
+	    s[2] ^= s[0];
+	    s[3] ^= s[1];
+	    s[1] ^= s[2];
+	    s[0] ^= s[3];
+	    s[2] ^= t;
+	    s[3] = rotl(s[3], 45);
+
+	    return result;
+	}
+
+	// uniform in [0, 1) from the top 53 bits
+	double next_double() {
+	    return (next() >> 11) * 0x1.0p-53;
+	}
+
+	static uint64_t mix(uint64_t z) {
+	    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+	    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+	    return z ^ (z >> 31);
+	}
+
+    private:
+	static uint64_t rotl(uint64_t x, int k) {
+	    return (x << k) | (x >> (64 - k));
+	}
+
+	uint64_t s[4];
+};
+
+inline rng& thread_rng() {
+    thread_local rng generator;
+    return generator;
+}
+
+// combine a render seed with e.g. a pixel index into a generator seed
+inline uint64_t hash_seed(uint64_t seed, uint64_t index) {
+    return rng::mix(seed ^ rng::mix(index + 0x9e3779b97f4a7c15));
+}
+
+inline void seed_random(uint64_t seed) {
+    thread_rng().reseed(seed);
 }
 
 inline double random_double() {
-    static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-    static std::mt19937 generator;
-    return distribution(generator);
+    return thread_rng().next_double();
 }
 
 inline double random_double(double min, double max) {
-    static std::uniform_real_distribution<double> distribution(min, max);
-    static std::mt19937 generator;
-    return distribution(generator);
+    return min + (max - min) * random_double();
+}
+
+inline int random_int(int min, int max) {
+    return min + static_cast<int>(random_double() * (max - min + 1));
 }
 
 inline double clamp(double x, double min, double max) {
@@ -0,0 +1,183 @@
+#pragma once
+
+#include "colour.h"
+#include "common.h"
+#include "framebuffer.h"
+#include "worker_pool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// edge aware a-trous wavelet denoiser, after svgf (schied et al. 2017)
+//
+// colour is divided by its first hit albedo so only the lighting is blurred
+// and surface colour edges survive. each pass is a 5x5 b-spline whose taps
+// spread twice as far as the last pass's, each tap weighted down by how far
+// its normal, depth and luminance are from the centre's. the luminance
+// tolerance scales with the centre's remaining noise, whose variance is
+// filtered alongside, so noisy regions blur and converged detail doesn't
+struct denoise_settings {
+    int iterations = 3;
+    float sigma_luminance = 4;
+    float sigma_normal = 128;
+    float sigma_depth = 1;
+};
+
+// dark albedos are floored so demodulating them doesn't amplify their noise
+const float denoise_albedo_floor = 0.01f;
+
+// keeps its buffers between calls, so an animation allocates them once
+class denoiser {
+    public:
+	denoiser(const denoise_settings& settings = denoise_settings()) : settings(settings) {}
+
+	// filter image in place, running each pass across pool's threads when given
+	void run(framebuffer& image, const feature_buffers& features, worker_pool* pool = nullptr);
+
+    public:
+	denoise_settings settings;
+
+    private:
+	struct texel {
+	    float r, g, b;
+	    float variance; // of the luminance
+	};
+
+	struct surface {
+	    float nx, ny, nz;
+	    float depth;
+	    float gx, gy; // screen space depth gradient
+	};
+
+	static float texel_luminance(const texel& t) {
+	    return 0.2126f * t.r + 0.7152f * t.g + 0.0722f * t.b;
+	}
+
+	// call row(y) for every row, interleaved across the pool's threads when given
+	template <typename F>
+	static void for_each_row(int height, worker_pool* pool, const F& row) {
+	    if (!pool) {
+		for (int y = 0; y < height; y++) row(y);
+		return;
+	    }
+
+	    const int workers = pool->size();
+	    pool->run([&](int worker) {
+		for (int y = worker; y < height; y += workers) row(y);
+	    });
+	}
+
+	std::vector<texel> current, next;
+	std::vector<surface> surfaces;
+};
+
+void denoiser::run(framebuffer& image, const feature_buffers& features, worker_pool* pool) {
+    const int width = image.width();
+    const int height = image.height();
+    const size_t count = static_cast<size_t>(width) * height;
+    current.resize(count);
+    next.resize(count);
+    surfaces.resize(count);
+
+    auto floored_albedo = [&](int x, int y) {
+	const pixel& a = features.albedo.row(y)[x];
+	return texel{std::max(a.r, denoise_albedo_floor), std::max(a.g, denoise_albedo_floor), std::max(a.b, denoise_albedo_floor), a.a};
+    };
+
+    for_each_row(height, pool, [&](int y) {
+	const pixel* colours = image.row(y);
+	const pixel* normals = features.normal.row(y);
+	for (int x = 0; x < width; x++) {
+	    const texel a = floored_albedo(x, y);
+	    const float la = texel_luminance(a);
+	    current[y * width + x] = {colours[x].r / a.r, colours[x].g / a.g, colours[x].b / a.b, a.variance / (la * la)};
+	    surfaces[y * width + x] = {normals[x].r, normals[x].g, normals[x].b, normals[x].a, 0, 0};
+	}
+    });
+
+    // central differences, one sided at the borders
+    for_each_row(height, pool, [&](int y) {
+	for (int x = 0; x < width; x++) {
+	    auto depth = [&](int sx, int sy) {
+		return surfaces[std::min(height - 1, std::max(0, sy)) * width + std::min(width - 1, std::max(0, sx))].depth;
+	    };
+	    surface& s = surfaces[y * width + x];
+	    s.gx = 0.5f * (depth(x + 1, y) - depth(x - 1, y));
+	    s.gy = 0.5f * (depth(x, y + 1) - depth(x, y - 1));
+	}
+    });
+
+    const float spline[3] = {3.0f / 8, 1.0f / 4, 1.0f / 16};
+    const float gaussian[2] = {1.0f / 2, 1.0f / 4};
+
+    for (int iteration = 0; iteration < settings.iterations; iteration++) {
+	const int step = 1 << iteration;
+
+	for_each_row(height, pool, [&](int y) {
+	    for (int x = 0; x < width; x++) {
+		const int i = y * width + x;
+		const texel& c = current[i];
+		const surface& s = surfaces[i];
+		const float lc = texel_luminance(c);
+
+		// the centre's variance blurred 3x3, steadier than its own
+		float variance = 0, variance_weight = 0;
+		for (int dy = -1; dy <= 1; dy++) {
+		    for (int dx = -1; dx <= 1; dx++) {
+			const int qx = x + dx, qy = y + dy;
+			if (qx < 0 || qx >= width || qy < 0 || qy >= height) continue;
+			const float w = gaussian[std::abs(dx)] * gaussian[std::abs(dy)];
+			variance += w * current[qy * width + qx].variance;
+			variance_weight += w;
+		    }
+		}
+		const float luminance_scale = settings.sigma_luminance * std::sqrt(std::max(0.0f, variance / variance_weight)) + 1e-6f;
+
+		const float centre = spline[0] * spline[0];
+		float r = centre * c.r, g = centre * c.g, b = centre * c.b;
+		float weight_sum = centre;
+		float variance_sum = centre * centre * c.variance;
+
+		for (int dy = -2; dy <= 2; dy++) {
+		    for (int dx = -2; dx <= 2; dx++) {
+			const int qx = x + dx * step, qy = y + dy * step;
+			if ((dx == 0 && dy == 0) || qx < 0 || qx >= width || qy < 0 || qy >= height) continue;
+
+			const int j = qy * width + qx;
+			const texel& q = current[j];
+			const surface& t = surfaces[j];
+
+			const float facing = s.nx * t.nx + s.ny * t.ny + s.nz * t.nz;
+			if (facing <= 0) continue;
+
+			// the normal, depth and luminance weights multiplied as one exponential
+			const float expected = std::fabs(s.gx * dx * step + s.gy * dy * step);
+			const float normal_term = settings.sigma_normal * std::log(std::min(facing, 1.0f));
+			const float depth_term = std::fabs(s.depth - t.depth) / (settings.sigma_depth * expected + 1e-3f);
+			const float luminance_term = std::fabs(lc - texel_luminance(q)) / luminance_scale;
+
+			const float w = spline[std::abs(dx)] * spline[std::abs(dy)] * std::exp(normal_term - depth_term - luminance_term);
+			r += w * q.r;
+			g += w * q.g;
+			b += w * q.b;
+			weight_sum += w;
+			variance_sum += w * w * q.variance;
+		    }
+		}
+
+		next[i] = {r / weight_sum, g / weight_sum, b / weight_sum, variance_sum / (weight_sum * weight_sum)};
+	    }
+	});
+	std::swap(current, next);
+    }
+
+    for_each_row(height, pool, [&](int y) {
+	pixel* colours = image.row(y);
+	for (int x = 0; x < width; x++) {
+	    const texel a = floored_albedo(x, y);
+	    const texel& c = current[y * width + x];
+	    colours[x] = {c.r * a.r, c.g * a.g, c.b * a.b, 1.0f};
+	}
+    });
+}
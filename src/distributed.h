@@ -0,0 +1,519 @@
+#pragma once
+
+#include "camera.h"
+#include "common.h"
+#include "frame.h"
+#include "hittable.h"
+#include "render.h"
+#include "sampling.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+// rendering one frame's tiles on several machines over tcp
+//
+// a worker process listens for coordinators. for each frame the coordinator
+// sends the render settings and scene, then keeps a few tiles in flight per
+// worker and the worker streams each finished tile's pixels back. tiles come
+// from one shared pool, so fast workers take more, and the tiles of a worker
+// that drops or stalls go back into the pool for someone else. the
+// coordinator renders from the pool with its own cores as well, so it
+// finishes the frame even if every worker is lost
+//
+// pixels are a function of pixel, sample and settings only, so a frame is
+// the same whichever machine renders which tile, given identical builds
+
+const uint32_t job_magic = 0x424a5254; // "TRJB"
+const uint32_t protocol_version = 2;
+
+// a worker that sends nothing for this long is treated as dead
+const int remote_timeout_seconds = 600;
+
+// the largest image side and scene path a job may ask for
+const int max_image_size = 16384;
+const uint32_t max_scene_path = 4096;
+
+// messages are sent as raw structs, so every node must share byte order
+struct job_header {
+    uint32_t magic;
+    uint32_t version;
+    int32_t image_width;
+    int32_t image_height;
+    int32_t samples_per_pixel;
+    int32_t max_depth;
+    uint64_t seed;
+    uint64_t scene_seed;
+    int32_t mode;
+    int32_t pattern;
+    double adaptive_threshold;
+    int32_t first_sample;
+    uint32_t scene_path_size; // followed by the path, empty for the built in scene
+};
+
+struct worker_hello {
+    uint32_t status; // 0 once the scene is loaded
+    int32_t threads;
+};
+
+// a tile to render, or the end of the job when start_x is negative
+struct tile_message {
+    int32_t start_x, start_y;
+    int32_t end_x, end_y;
+};
+
+// followed by the tile's pixels, row by row
+struct tile_result {
+    tile_message tile;
+    int64_t samples;
+};
+
+// builds the scene a job names, e.g. the same way main does
+using world_loader = std::function<bool(const std::string& scene_path, uint64_t scene_seed, camera& cam, std::unique_ptr<hittable>& world, std::string& error)>;
+
+inline bool send_all(int fd, const void* data, size_t size) {
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+	const ssize_t n = ::send(fd, p, size, MSG_NOSIGNAL);
+	if (n <= 0) return false;
+	p += n;
+	size -= n;
+    }
+    return true;
+}
+
+inline bool recv_all(int fd, void* data, size_t size) {
+    char* p = static_cast<char*>(data);
+    while (size > 0) {
+	const ssize_t n = ::recv(fd, p, size, 0);
+	if (n <= 0) return false;
+	p += n;
+	size -= n;
+    }
+    return true;
+}
+
+// connect to host:port
+int connect_to(const std::string& address, std::string& error) {
+    const size_t colon = address.rfind(':');
+    if (colon == std::string::npos) {
+	error = "expected host:port, got " + address;
+	return -1;
+    }
+    const std::string host = address.substr(0, colon);
+    const std::string port = address.substr(colon + 1);
+
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* found = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &found) != 0) {
+	error = "cannot resolve " + address;
+	return -1;
+    }
+
+    int fd = -1;
+    for (addrinfo* a = found; a; a = a->ai_next) {
+	fd = ::socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+	if (fd < 0) continue;
+	if (::connect(fd, a->ai_addr, a->ai_addrlen) == 0) break;
+	::close(fd);
+	fd = -1;
+    }
+    freeaddrinfo(found);
+
+    if (fd < 0) {
+	error = "cannot connect to " + address;
+	return -1;
+    }
+
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return fd;
+}
+
+int listen_on(int port, std::string& error) {
+    int fd = ::socket(AF_INET6, SOCK_STREAM, 0);
+    if (fd < 0) {
+	error = "cannot create a socket";
+	return -1;
+    }
+
+    int on = 1;
+    int off = 0;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+
+    sockaddr_in6 address = {};
+    address.sin6_family = AF_INET6;
+    address.sin6_addr = in6addr_any;
+    address.sin6_port = htons(static_cast<uint16_t>(port));
+    if (::bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || ::listen(fd, 4) != 0) {
+	::close(fd);
+	error = "cannot listen on port " + std::to_string(port);
+	return -1;
+    }
+    return fd;
+}
+
+// tiles still to render, shared by the local threads and every connection
+class tile_pool {
+    public:
+	tile_pool(const std::vector<tile_bounds>& tiles) : queued(tiles.begin(), tiles.end()), count(static_cast<int>(tiles.size())) {}
+
+	// waits while every remaining tile is out, false once all are done
+	bool take(tile_bounds& tile) {
+	    std::unique_lock<std::mutex> guard(lock);
+	    changed.wait(guard, [&] { return !queued.empty() || completed == count; });
+	    if (queued.empty()) return false;
+	    tile = queued.front();
+	    queued.pop_front();
+	    return true;
+	}
+
+	bool try_take(tile_bounds& tile) {
+	    std::lock_guard<std::mutex> guard(lock);
+	    if (queued.empty()) return false;
+	    tile = queued.front();
+	    queued.pop_front();
+	    return true;
+	}
+
+	// hand a lost tile to whoever asks next
+	void requeue(const tile_bounds& tile) {
+	    {
+		std::lock_guard<std::mutex> guard(lock);
+		queued.push_front(tile);
+	    }
+	    changed.notify_one();
+	}
+
+	void finish() {
+	    bool all_done;
+	    {
+		std::lock_guard<std::mutex> guard(lock);
+		all_done = ++completed == count;
+	    }
+	    if (all_done) changed.notify_all();
+	}
+
+	int done() {
+	    std::lock_guard<std::mutex> guard(lock);
+	    return completed;
+	}
+
+	int total() const { return count; }
+
+    private:
+	std::mutex lock;
+	std::condition_variable changed;
+	std::deque<tile_bounds> queued;
+	int completed = 0;
+	int count = 0;
+};
+
+// drive one remote worker until the pool is drained or the worker is lost
+void renderRemote(const std::string& address, const std::string& scene_path, uint64_t scene_seed, framebuffer& image, const render_settings& settings, tile_pool& pool) {
+    std::string error;
+    int fd = connect_to(address, error);
+    if (fd < 0) {
+	std::cerr << error << ", rendering without it\n";
+	return;
+    }
+
+    const job_header job = {
+	job_magic, protocol_version,
+	settings.image_width, settings.image_height, settings.samples_per_pixel, settings.max_depth,
+	settings.seed, scene_seed,
+	static_cast<int32_t>(settings.mode), static_cast<int32_t>(settings.pattern),
+	settings.adaptive_threshold, settings.first_sample,
+	static_cast<uint32_t>(scene_path.size())
+    };
+    worker_hello hello;
+    if (!send_all(fd, &job, sizeof(job)) || !send_all(fd, scene_path.data(), scene_path.size())
+	|| !recv_all(fd, &hello, sizeof(hello)) || hello.status != 0) {
+	std::cerr << "worker " << address << " refused the job, rendering without it\n";
+	::close(fd);
+	return;
+    }
+
+    timeval timeout = {remote_timeout_seconds, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    // enough tiles in flight that the worker's threads never wait on the network
+    const size_t in_flight_limit = 2 * std::max(1, static_cast<int>(hello.threads));
+    std::deque<tile_bounds> in_flight;
+    std::vector<pixel> pixels;
+    bool lost = false;
+
+    auto send_tile = [&](const tile_bounds& t) {
+	in_flight.push_back(t);
+	const tile_message message = {t.start_x, t.start_y, t.end_x, t.end_y};
+	return send_all(fd, &message, sizeof(message));
+    };
+
+    while (!lost) {
+	tile_bounds t;
+	while (!lost && in_flight.size() < in_flight_limit && pool.try_take(t)) {
+	    lost = !send_tile(t);
+	}
+	if (lost) break;
+
+	if (in_flight.empty()) {
+	    if (!pool.take(t)) break;
+	    lost = !send_tile(t);
+	    continue;
+	}
+
+	// results arrive in whatever order the worker's threads finish them
+	tile_result result;
+	if (!recv_all(fd, &result, sizeof(result))) {
+	    lost = true;
+	    break;
+	}
+	auto match = std::find_if(in_flight.begin(), in_flight.end(), [&](const tile_bounds& b) {
+	    return b.start_x == result.tile.start_x && b.start_y == result.tile.start_y
+		&& b.end_x == result.tile.end_x && b.end_y == result.tile.end_y;
+	});
+	if (match == in_flight.end()) {
+	    lost = true;
+	    break;
+	}
+
+	const tile_bounds done = *match;
+	const int tile_width = done.end_x - done.start_x;
+	pixels.resize(static_cast<size_t>(tile_width) * (done.end_y - done.start_y));
+	if (!recv_all(fd, pixels.data(), pixels.size() * sizeof(pixel))) {
+	    lost = true;
+	    break;
+	}
+	in_flight.erase(match);
+
+	for (int y = done.start_y; y < done.end_y; y++) {
+	    stream_pixels(image.row(y) + done.start_x, &pixels[(y - done.start_y) * tile_width], tile_width);
+	}
+	asamples += result.samples;
+	pool.finish();
+    }
+
+    if (lost) {
+	std::cerr << "\nlost worker " << address << ", requeueing " << in_flight.size() << " tiles\n";
+	for (const auto& t : in_flight) pool.requeue(t);
+    } else {
+	const tile_message end = {-1, -1, -1, -1};
+	send_all(fd, &end, sizeof(end));
+    }
+    ::close(fd);
+}
+
+// a frame rendered across this machine's threads and the given workers
+void renderFrameDistributed(framebuffer& image, const camera& cam, const hittable& world, const render_settings& settings, int thread_count,
+	const std::vector<std::string>& workers, const std::string& scene_path, uint64_t scene_seed) {
+    // tiled as local renders are, so adaptive budgets match theirs
+    tile_pool pool(tile_scheduler::layout(render_region(settings), TILESIZE));
+    std::vector<std::thread> threads;
+
+    for (const auto& address : workers) {
+	threads.emplace_back(renderRemote, address, std::cref(scene_path), scene_seed, std::ref(image), std::cref(settings), std::ref(pool));
+    }
+
+    for (int i = 0; i < thread_count; i++) {
+	threads.emplace_back([&] {
+	    tile_renderers renderers;
+	    tile_bounds bounds;
+	    while (pool.take(bounds)) {
+		asamples += renderTile(image, cam, world, settings, bounds, renderers);
+		pool.finish();
+		if (settings.progress) {
+		    std::cerr << "\rtile " << pool.done() << " of " << pool.total() << " done\t\t\t" << std::flush;
+		}
+	    }
+	});
+    }
+
+    for (auto& t : threads) {
+	t.join();
+    }
+}
+
+// anyone can connect to a worker, so nothing in a job is trusted
+bool check_job(const job_header& job, std::string& error) {
+    if (job.magic != job_magic || job.version != protocol_version) {
+	error = "not a render job";
+    } else if (job.image_width < 1 || job.image_width > max_image_size || job.image_height < 1 || job.image_height > max_image_size) {
+	error = "image sizes run from 1 to " + std::to_string(max_image_size);
+    } else if (job.samples_per_pixel < 1 || job.max_depth < 1 || job.first_sample < 0) {
+	error = "samples per pixel and depth must be positive";
+    } else if (job.mode < 0 || job.mode > static_cast<int>(render_mode::adaptive)
+	       || job.pattern < 0 || job.pattern > static_cast<int>(sample_pattern::blue_noise)) {
+	error = "unknown mode or sampler";
+    } else if (!(std::isfinite(job.adaptive_threshold) && job.adaptive_threshold >= 0)) {
+	error = "the adaptive threshold must be a finite number, zero or more";
+    } else if (job.scene_path_size > max_scene_path) {
+	error = "scene path too long";
+    } else {
+	return true;
+    }
+    return false;
+}
+
+// serve one coordinator's job until it ends or the coordinator goes away
+void serveJob(int fd, int thread_count, const world_loader& load, std::string& loaded_key, camera& cam, std::unique_ptr<hittable>& world) {
+    job_header job;
+    std::string error;
+    if (!recv_all(fd, &job, sizeof(job))) return;
+    if (!check_job(job, error)) {
+	std::cerr << "worker: " << error << "\n";
+	return;
+    }
+    std::string scene_path(job.scene_path_size, '\0');
+    if (!recv_all(fd, &scene_path[0], scene_path.size())) return;
+
+    // progressive passes send the same scene again, so keep the last one
+    const std::string key = scene_path + "@" + std::to_string(job.scene_seed);
+    worker_hello hello = {0, thread_count};
+    if (key != loaded_key) {
+	world.reset();
+	loaded_key.clear();
+	if (load(scene_path, job.scene_seed, cam, world, error)) {
+	    loaded_key = key;
+	} else {
+	    std::cerr << "worker: " << error << "\n";
+	    hello.status = 1;
+	}
+    }
+    if (!send_all(fd, &hello, sizeof(hello)) || hello.status != 0) return;
+
+    const render_settings settings = {
+	job.image_width, job.image_height, job.samples_per_pixel, job.max_depth, job.seed,
+	static_cast<render_mode>(job.mode), job.adaptive_threshold, false,
+	static_cast<sample_pattern>(job.pattern), job.first_sample
+    };
+    std::cerr << "worker: rendering " << settings.image_width << "x" << settings.image_height << " at " << settings.samples_per_pixel << " samples per pixel\n";
+
+    // the tiles land in a full frame buffer, as the tile renderers expect
+    framebuffer image(settings.image_width, settings.image_height);
+    std::deque<tile_bounds> queued;
+    std::mutex lock;
+    std::mutex send_lock;
+    std::condition_variable changed;
+    bool ended = false;
+    bool lost = false; // a send failed, so the coordinator is gone
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < thread_count; i++) {
+	threads.emplace_back([&] {
+	    tile_renderers renderers;
+	    std::vector<pixel> pixels;
+	    while (true) {
+		tile_bounds t;
+		{
+		    std::unique_lock<std::mutex> guard(lock);
+		    changed.wait(guard, [&] { return !queued.empty() || ended || lost; });
+		    if (queued.empty() || lost) return;
+		    t = queued.front();
+		    queued.pop_front();
+		}
+
+		const long samples = renderTile(image, cam, *world, settings, t, renderers);
+		const int tile_width = t.end_x - t.start_x;
+		pixels.clear();
+		for (int y = t.start_y; y < t.end_y; y++) {
+		    const pixel* row = image.row(y) + t.start_x;
+		    pixels.insert(pixels.end(), row, row + tile_width);
+		}
+
+		const tile_result result = {{t.start_x, t.start_y, t.end_x, t.end_y}, samples};
+		bool sent;
+		{
+		    std::lock_guard<std::mutex> guard(send_lock);
+		    sent = send_all(fd, &result, sizeof(result)) && send_all(fd, pixels.data(), pixels.size() * sizeof(pixel));
+		}
+		if (sent) continue;
+
+		// stop every thread taking tiles, and wake the reader, so
+		// nothing more is rendered for nobody
+		{
+		    std::lock_guard<std::mutex> guard(lock);
+		    if (lost) return;
+		    lost = true;
+		    queued.clear();
+		}
+		std::cerr << "worker: lost the coordinator, dropping the rest of the job\n";
+		::shutdown(fd, SHUT_RDWR);
+		changed.notify_all();
+		return;
+	    }
+	});
+    }
+
+    // read tiles until the end message, or until the coordinator is gone
+    tile_message message;
+    bool connected;
+    while ((connected = recv_all(fd, &message, sizeof(message))) && message.start_x >= 0) {
+	if (message.start_x >= message.end_x || message.end_x > settings.image_width
+	    || message.start_y < 0 || message.start_y >= message.end_y || message.end_y > settings.image_height) {
+	    std::cerr << "worker: tile outside the image, dropping the coordinator\n";
+	    connected = false;
+	    break;
+	}
+	{
+	    std::lock_guard<std::mutex> guard(lock);
+	    queued.push_back({message.start_x, message.start_y, message.end_x, message.end_y});
+	}
+	changed.notify_one();
+    }
+    {
+	// nobody is left to send queued tiles to
+	std::lock_guard<std::mutex> guard(lock);
+	if (!connected) queued.clear();
+	ended = true;
+    }
+    changed.notify_all();
+
+    for (auto& t : threads) {
+	t.join();
+    }
+}
+
+// accept coordinators on port, one at a time, forever
+int runWorker(int port, int thread_count, const world_loader& load) {
+    std::string error;
+    int listener = listen_on(port, error);
+    if (listener < 0) {
+	std::cerr << error << "\n";
+	return 1;
+    }
+    std::cerr << "worker: listening on port " << port << " with " << thread_count << " threads\n";
+
+    std::string loaded_key;
+    camera cam;
+    std::unique_ptr<hittable> world;
+
+    while (true) {
+	int fd = ::accept(listener, nullptr, nullptr);
+	if (fd < 0) continue;
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	serveJob(fd, thread_count, load, loaded_key, cam, world);
+	::close(fd);
+    }
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include "adaptive.h"
+#include "arena.h"
+#include "camera.h"
+#include "checkpoint.h"
+#include "common.h"
+#include "framebuffer.h"
+#include "hittable.h"
+#include "render.h"
+#include "scheduler.h"
+#include "stats.h"
+#include "wavefront.h"
+#include "worker_pool.h"
+
+#include <atomic>
+#include <iostream>
+#include <vector>
+
+#define TILESIZE 32
+
+// samples taken by all workers, read after they join for the krps figure
+std::atomic<long> asamples;
+
+// the calling thread's renderers, whose tile buffers come from its scratch arena
+struct tile_renderers {
+    wavefront_renderer wavefront;
+    adaptive_renderer adaptive;
+};
+
+// render one tile in the configured mode, returning the samples taken
+long renderTile(framebuffer& image, const camera& cam, const hittable& world, const render_settings& settings, const tile_bounds& bounds, tile_renderers& renderers) {
+    thread_scratch().reset();
+
+    long samples = static_cast<long>(bounds.end_x - bounds.start_x) * (bounds.end_y - bounds.start_y) * settings.samples_per_pixel;
+    switch (settings.mode) {
+	case render_mode::path:
+	    render_tile_path(image, cam, world, settings, bounds);
+	    break;
+	case render_mode::wavefront:
+	    renderers.wavefront.render_tile(image, cam, world, settings, bounds);
+	    break;
+	case render_mode::adaptive:
+	    samples = renderers.adaptive.render_tile(image, cam, world, settings, bounds);
+	    break;
+    }
+    return samples;
+}
+
+void renderImage(framebuffer& image, const camera& cam, const hittable& world, const render_settings& settings, tile_scheduler& scheduler, int worker) {
+    tile_renderers renderers;
+
+    // for each tile
+    tile_bounds bounds;
+    while (scheduler.next(worker, bounds)) {
+	// done before a restart
+	if (settings.checkpoint && settings.checkpoint->holds(bounds, settings)) {
+	    scheduler.finish();
+	    continue;
+	}
+
+#ifdef TRACE_STATS
+	const double tile_start = stats_clock();
+#endif
+	const long samples = renderTile(image, cam, world, settings, bounds, renderers);
+	asamples += samples;
+	if (settings.checkpoint) settings.checkpoint->commit(image, bounds, settings);
+	if (settings.tile_done) (*settings.tile_done)(image, bounds, samples);
+	scheduler.finish();
+#ifdef TRACE_STATS
+	thread_stats().tiles.push_back({worker, bounds.start_x, bounds.start_y, bounds.end_x, bounds.end_y, tile_start, stats_clock()});
+#endif
+
+	if (settings.progress) {
+	    std::cerr << "\rtile " << scheduler.done() << " of " << scheduler.total() << " done\t\t\t" << std::flush;
+	}
+    }
+
+#ifdef TRACE_STATS
+    merge_thread_stats();
+#endif
+}
+
+// settings' region of interest, or the whole frame
+tile_bounds render_region(const render_settings& settings) {
+    const tile_bounds& region = settings.region;
+    if (region.end_x <= region.start_x || region.end_y <= region.start_y) return {0, 0, settings.image_width, settings.image_height};
+    return region;
+}
+
+tile_scheduler make_scheduler(const render_settings& settings, int worker_count) {
+    // adaptive budgets are per tile, so splitting would make them depend on scheduling
+    return tile_scheduler(render_region(settings), TILESIZE, worker_count, settings.mode != render_mode::adaptive);
+}
+
+// frames rendered on a worker_pool, so an animation pays for its threads
+// and their scratch arenas once rather than per frame
+class render_pool : public worker_pool {
+    public:
+	using worker_pool::worker_pool;
+
+	// render one frame on the pool's threads, returning once it is done
+	void render(framebuffer& image, const camera& cam, const hittable& world, const render_settings& settings) {
+	    tile_scheduler scheduler = make_scheduler(settings, size());
+	    run([&](int worker) { renderImage(image, cam, world, settings, scheduler, worker); });
+	}
+
+	// the same with a copy of the scene per numa node, indexed by node(), so
+	// each worker traces the copy in its own node's memory
+	void render(framebuffer& image, const camera& cam, const std::vector<const hittable*>& replicas, const render_settings& settings) {
+	    tile_scheduler scheduler = make_scheduler(settings, size());
+	    run([&](int worker) { renderImage(image, cam, *replicas[node(worker) % replicas.size()], settings, scheduler, worker); });
+	}
+};
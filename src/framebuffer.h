@@ -0,0 +1,132 @@
+#pragma once
+
+#include "arena.h"
+#include "common.h"
+#include "vec3.h"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <new>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+const int cache_line_size = 64;
+
+// pixel range [start, end) of one tile
+struct tile_bounds {
+    int start_x, start_y;
+    int end_x, end_y;
+};
+
+// one framebuffer pixel, float rgba whatever real is. four make a cache line
+struct alignas(16) pixel {
+    float r, g, b, a;
+
+    static pixel from(const colour& c) {
+	return {static_cast<float>(c.x()), static_cast<float>(c.y()), static_cast<float>(c.z()), 1.0f};
+    }
+
+    colour to_colour() const { return colour(r, g, b); }
+};
+
+// row major frame, which is the order the encoders and the progressive
+// accumulator walk it in. rows are padded to whole cache lines and start on
+// one, so tiles whose columns start on multiples of line_pixels never share
+// a line with their neighbours
+class framebuffer {
+    public:
+	static const int line_pixels = cache_line_size / sizeof(pixel);
+
+	framebuffer() {}
+	framebuffer(int width, int height)
+	    : frame_width(width), frame_height(height), row_stride((width + line_pixels - 1) / line_pixels * line_pixels) {
+	    const size_t bytes = static_cast<size_t>(row_stride) * height * sizeof(pixel);
+	    pixels.reset(static_cast<pixel*>(::operator new(bytes, std::align_val_t(cache_line_size))));
+	    std::memset(static_cast<void*>(pixels.get()), 0, bytes);
+	}
+
+	int width() const { return frame_width; }
+	int height() const { return frame_height; }
+	int stride() const { return row_stride; }
+
+	pixel* row(int y) { return pixels.get() + static_cast<size_t>(y) * row_stride; }
+	const pixel* row(int y) const { return pixels.get() + static_cast<size_t>(y) * row_stride; }
+
+	colour get(int x, int y) const { return row(y)[x].to_colour(); }
+	void set(int x, int y, const colour& c) { row(y)[x] = pixel::from(c); }
+
+    private:
+	struct aligned_delete {
+	    void operator()(pixel* p) const { ::operator delete(p, std::align_val_t(cache_line_size)); }
+	};
+
+	int frame_width = 0;
+	int frame_height = 0;
+	int row_stride = 0;
+	std::unique_ptr<pixel, aligned_delete> pixels;
+};
+
+// the denoiser's per pixel inputs, laid out as frames so tiles write their
+// own lines. albedo's fourth channel carries the variance of the pixel's
+// mean luminance and normal's the first hit depth
+struct feature_buffers {
+    feature_buffers(int width, int height) : albedo(width, height), normal(width, height) {}
+
+    framebuffer albedo;
+    framebuffer normal;
+};
+
+// columns where tiles may start, so no two tiles share a framebuffer line
+inline int snap_to_line(int x) {
+    return x / framebuffer::line_pixels * framebuffer::line_pixels;
+}
+
+// copy pixels to the framebuffer without first reading their lines into cache
+inline void stream_pixels(pixel* dst, const pixel* src, int count) {
+#if defined(__SSE2__)
+    for (int i = 0; i < count; i++) {
+	_mm_stream_ps(&dst[i].r, _mm_load_ps(&src[i].r));
+    }
+#else
+    std::copy(src, src + count, dst);
+#endif
+}
+
+// a tile's finished pixels, gathered in the render thread's scratch and
+// committed in one pass, so the shared frame is only touched once per tile
+class tile_buffer {
+    public:
+	tile_buffer(arena& scratch, const tile_bounds& tile)
+	    : tile(tile), row_stride((tile.end_x - tile.start_x + framebuffer::line_pixels - 1) / framebuffer::line_pixels * framebuffer::line_pixels) {
+	    const size_t count = static_cast<size_t>(row_stride) * (tile.end_y - tile.start_y);
+	    pixels = static_cast<pixel*>(scratch.allocate(count * sizeof(pixel), cache_line_size));
+	}
+
+	// in image coordinates
+	void set(int x, int y, const colour& c) {
+	    set(x, y, pixel::from(c));
+	}
+
+	void set(int x, int y, const pixel& p) {
+	    pixels[(y - tile.start_y) * row_stride + (x - tile.start_x)] = p;
+	}
+
+	void commit(framebuffer& image) const {
+	    const int width = tile.end_x - tile.start_x;
+	    for (int y = tile.start_y; y < tile.end_y; y++) {
+		stream_pixels(image.row(y) + tile.start_x, &pixels[(y - tile.start_y) * row_stride], width);
+	    }
+#if defined(__SSE2__)
+	    // streaming stores are weakly ordered, publish them before the tile is reported done
+	    _mm_sfence();
+#endif
+	}
+
+    private:
+	tile_bounds tile;
+	int row_stride;
+	pixel* pixels;
+};
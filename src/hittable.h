@@ -1,15 +1,19 @@
 #pragma once
 
+#include "aabb.h"
 #include "common.h"
 
+class hittable;
 class material;
 
 struct hit_record {
     point3 p;
     vec3 normal;
-    shared_ptr<material> mat_ptr;
-    double t;
+    const material* mat_ptr; // not owning, the scene outlives every hit
+    real t;
     bool front_face;
+    const hittable* source; // completes the record, null once it is complete
+    int part;               // which of source's primitives was hit
 
     inline void set_face_normal(const ray& r, const vec3& outward_normal) {
 	front_face = dot(r.direction(), outward_normal) < 0;
@@ -19,5 +23,33 @@ struct hit_record {
 
 class hittable {
     public:
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
+	virtual ~hittable() = default;
+
+	// rec is only written when a hit is reported, so callers can pass the
+	// record of their closest hit so far straight through
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const = 0;
+	virtual bool bounding_box(aabb& output_box) const = 0;
+
+	// the closest hit search in two steps, so aggregates only work out the
+	// point and normal for the winner rather than every nearer candidate.
+	// intersect() sets t and mat_ptr plus source and part for complete() to
+	// fill in the rest. the default does it all at once and leaves source null
+	virtual bool intersect(const ray& r, real t_min, real t_max, hit_record& rec) const {
+	    if (!hit(r, t_min, t_max, rec)) return false;
+	    rec.source = nullptr;
+	    return true;
+	}
+
+	virtual void complete(const ray& r, hit_record& rec) const {}
+
+	// any hit query for shadow rays: whether anything lies in [t_min, t_max],
+	// stopping at the first intersection found and filling in nothing
+	virtual bool occluded(const ray& r, real t_min, real t_max) const {
+	    hit_record rec;
+	    return hit(r, t_min, t_max, rec);
+	}
 };
+
+inline void complete_hit(const ray& r, hit_record& rec) {
+    if (rec.source) rec.source->complete(r, rec);
+}
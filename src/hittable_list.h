@@ -1,5 +1,6 @@
 #pragma once
 
+#include "arena.h"
 #include "hittable.h"
 #include "ray.h"
 
@@ -17,25 +18,66 @@ class hittable_list : public hittable {
 	void clear() { objects.clear(); }
 	void add(shared_ptr<hittable> object) { objects.push_back(object); }
 
+	// build objects and materials in the list's arena, packed in creation order.
+	// the pointers don't own them, anything keeping one must also hold storage
+	template <typename T, typename... Args>
+	shared_ptr<T> make(Args&&... args) {
+	    if (!storage) storage = make_shared<arena>();
+	    return arena_ptr(storage->make<T>(std::forward<Args>(args)...));
+	}
+
 	virtual bool hit(
-		const ray& r, double t_min, double t_max, hit_record& rec) const override;
+		const ray& r, real t_min, real t_max, hit_record& rec) const override;
+
+	virtual bool intersect(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+
+	virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+
+	virtual bool bounding_box(aabb& output_box) const override;
 
     public:
 	std::vector<shared_ptr<hittable>> objects;
+	shared_ptr<arena> storage;
 };
 
-bool hittable_list::hit(const ray &r, double t_min, double t_max, hit_record &rec) const {
-    hit_record temp_rec;
+bool hittable_list::hit(const ray &r, real t_min, real t_max, hit_record &rec) const {
+    if (!intersect(r, t_min, t_max, rec)) return false;
+    complete_hit(r, rec);
+    rec.source = nullptr;
+    return true;
+}
+
+bool hittable_list::intersect(const ray &r, real t_min, real t_max, hit_record &rec) const {
     bool hit_anything = false;
     auto closest_so_far = t_max;
 
     for (const auto& object : objects) {
-	if (object->hit(r, t_min, closest_so_far, temp_rec)) {
+	if (object->intersect(r, t_min, closest_so_far, rec)) {
 	    hit_anything = true;
-	    closest_so_far = temp_rec.t;
-	    rec = temp_rec;
+	    closest_so_far = rec.t;
 	}
     }
     
     return hit_anything;
 }
+
+bool hittable_list::occluded(const ray& r, real t_min, real t_max) const {
+    for (const auto& object : objects) {
+	if (object->occluded(r, t_min, t_max)) return true;
+    }
+    return false;
+}
+
+bool hittable_list::bounding_box(aabb& output_box) const {
+    if (objects.empty()) return false;
+
+    aabb temp_box;
+    output_box = aabb();
+
+    for (const auto& object : objects) {
+	if (!object->bounding_box(temp_box)) return false;
+	output_box.expand(temp_box);
+    }
+
+    return true;
+}
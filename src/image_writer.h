@@ -0,0 +1,231 @@
+#pragma once
+
+#include "colour.h"
+#include "framebuffer.h"
+#include "vec3.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <string>
+#include <vector>
+
+enum class image_format {
+    p3,  // ascii ppm
+    p6,  // binary ppm
+    png, // 8 bit rgb, stored deflate blocks
+    pfm  // linear 32 bit float rgb
+};
+
+inline bool parse_image_format(const std::string& name, image_format& format) {
+    if (name == "p3") format = image_format::p3;
+    else if (name == "p6" || name == "ppm") format = image_format::p6;
+    else if (name == "png") format = image_format::png;
+    else if (name == "pfm") format = image_format::pfm;
+    else return false;
+    return true;
+}
+
+// encodes a whole frame into one buffer, sized up front, so it can be
+// written out with a single call
+class image_writer {
+    public:
+	image_writer(int width, int height) : width(width), height(height) {}
+
+	const std::vector<unsigned char>& encode(const framebuffer& image, image_format format);
+
+	void write(std::ostream& out, const framebuffer& image, image_format format) {
+	    const auto& bytes = encode(image, format);
+	    out.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+	    out.flush();
+	}
+
+    private:
+	void encode_p3(const framebuffer& image);
+	void encode_p6(const framebuffer& image);
+	void encode_png(const framebuffer& image);
+	void encode_pfm(const framebuffer& image);
+
+	// gamma encode every channel of the frame into rgb bytes at dst
+	void quantize(const framebuffer& image, unsigned char* dst, int row_padding) const;
+
+	void put(const void* data, size_t size) {
+	    std::memcpy(&buffer[used], data, size);
+	    used += size;
+	}
+
+	void put_header(const std::string& header) {
+	    put(header.data(), header.size());
+	}
+
+	void put_be32(uint32_t v) {
+	    unsigned char b[4] = {
+		static_cast<unsigned char>(v >> 24), static_cast<unsigned char>(v >> 16),
+		static_cast<unsigned char>(v >> 8), static_cast<unsigned char>(v)
+	    };
+	    put(b, 4);
+	}
+
+	static uint32_t crc32(const unsigned char* data, size_t size, uint32_t crc = 0);
+
+	int width, height;
+	std::vector<unsigned char> buffer;
+	size_t used = 0;
+};
+
+const std::vector<unsigned char>& image_writer::encode(const framebuffer& image, image_format format) {
+    used = 0;
+    switch (format) {
+	case image_format::p3: encode_p3(image); break;
+	case image_format::p6: encode_p6(image); break;
+	case image_format::png: encode_png(image); break;
+	case image_format::pfm: encode_pfm(image); break;
+    }
+    buffer.resize(used);
+    return buffer;
+}
+
+void image_writer::quantize(const framebuffer& image, unsigned char* dst, int row_padding) const {
+    // straight loops over the channels so the compiler can vectorise
+    for (int y = 0; y < height; y++) {
+	dst += row_padding;
+	const pixel* in = image.row(y);
+	for (int x = 0; x < width; x++) {
+	    dst[3*x + 0] = encode_channel(in[x].r);
+	    dst[3*x + 1] = encode_channel(in[x].g);
+	    dst[3*x + 2] = encode_channel(in[x].b);
+	}
+	dst += 3 * width;
+    }
+}
+
+void image_writer::encode_p3(const framebuffer& image) {
+    const std::string header = "P3\n" + std::to_string(width) + ' ' + std::to_string(height) + "\n255\n";
+    const size_t pixels = static_cast<size_t>(width) * height;
+
+    // at most "255 255 255\n" per pixel
+    buffer.resize(header.size() + 12 * pixels);
+    put_header(header);
+
+    std::vector<unsigned char> rgb(3 * pixels);
+    quantize(image, rgb.data(), 0);
+
+    for (size_t i = 0; i < pixels; i++) {
+	for (int c = 0; c < 3; c++) {
+	    unsigned v = rgb[3*i + c];
+	    if (v >= 100) buffer[used++] = '0' + v / 100;
+	    if (v >= 10) buffer[used++] = '0' + (v / 10) % 10;
+	    buffer[used++] = '0' + v % 10;
+	    buffer[used++] = c == 2 ? '\n' : ' ';
+	}
+    }
+}
+
+void image_writer::encode_p6(const framebuffer& image) {
+    const std::string header = "P6\n" + std::to_string(width) + ' ' + std::to_string(height) + "\n255\n";
+    const size_t payload = static_cast<size_t>(width) * height * 3;
+
+    buffer.resize(header.size() + payload);
+    put_header(header);
+    quantize(image, &buffer[used], 0);
+    used += payload;
+}
+
+void image_writer::encode_png(const framebuffer& image) {
+    // scanlines are a filter byte followed by rgb, wrapped in a zlib stream of
+    // uncompressed deflate blocks so no compression library is needed
+    const size_t raw_size = static_cast<size_t>(height) * (1 + 3 * width);
+    const size_t max_block = 65535;
+    const size_t blocks = raw_size == 0 ? 1 : (raw_size + max_block - 1) / max_block;
+    const size_t zlib_size = 2 + blocks * 5 + raw_size + 4;
+
+    buffer.resize(8 + (12 + 13) + (12 + zlib_size) + 12);
+
+    const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    put(signature, 8);
+
+    // IHDR: 8 bit truecolour, no interlace
+    size_t chunk = used;
+    put_be32(13);
+    put("IHDR", 4);
+    put_be32(width);
+    put_be32(height);
+    const unsigned char ihdr[5] = {8, 2, 0, 0, 0};
+    put(ihdr, 5);
+    put_be32(crc32(&buffer[chunk + 4], used - chunk - 4));
+
+    // filter bytes stay zero, meaning no filter
+    std::vector<unsigned char> raw(raw_size);
+    quantize(image, raw.data(), 1);
+
+    chunk = used;
+    put_be32(static_cast<uint32_t>(zlib_size));
+    put("IDAT", 4);
+    const unsigned char zlib_header[2] = {0x78, 0x01};
+    put(zlib_header, 2);
+
+    uint32_t s1 = 1, s2 = 0;
+    for (size_t offset = 0, b = 0; b < blocks; b++) {
+	const size_t len = std::min(max_block, raw_size - offset);
+	const unsigned char block_header[5] = {
+	    static_cast<unsigned char>(b + 1 == blocks),
+	    static_cast<unsigned char>(len), static_cast<unsigned char>(len >> 8),
+	    static_cast<unsigned char>(~len), static_cast<unsigned char>(~len >> 8)
+	};
+	put(block_header, 5);
+	put(&raw[offset], len);
+
+	for (size_t i = offset; i < offset + len; i++) {
+	    s1 = (s1 + raw[i]) % 65521;
+	    s2 = (s2 + s1) % 65521;
+	}
+	offset += len;
+    }
+    put_be32((s2 << 16) | s1);
+    put_be32(crc32(&buffer[chunk + 4], used - chunk - 4));
+
+    put_be32(0);
+    put("IEND", 4);
+    put_be32(crc32(reinterpret_cast<const unsigned char*>("IEND"), 4));
+}
+
+void image_writer::encode_pfm(const framebuffer& image) {
+    // negative scale marks little endian, rows run bottom to top
+    const std::string header = "PF\n" + std::to_string(width) + ' ' + std::to_string(height) + "\n-1.0\n";
+    const size_t row = static_cast<size_t>(width) * 3;
+
+    buffer.resize(header.size() + row * height * sizeof(float));
+    put_header(header);
+
+    std::vector<float> line(row);
+    for (int y = height - 1; y >= 0; y--) {
+	const pixel* in = image.row(y);
+	for (int x = 0; x < width; x++) {
+	    line[3*x + 0] = in[x].r;
+	    line[3*x + 1] = in[x].g;
+	    line[3*x + 2] = in[x].b;
+	}
+	put(line.data(), row * sizeof(float));
+    }
+}
+
+uint32_t image_writer::crc32(const unsigned char* data, size_t size, uint32_t crc) {
+    static const auto table = [] {
+	std::vector<uint32_t> t(256);
+	for (uint32_t n = 0; n < 256; n++) {
+	    uint32_t c = n;
+	    for (int k = 0; k < 8; k++) {
+		c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+	    }
+	    t[n] = c;
+	}
+	return t;
+    }();
+
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) {
+	crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "aabb.h"
+#include "common.h"
+#include "hittable.h"
+#include "stats.h"
+#include "vec3.h"
+
+#include <cmath>
+
+// an affine placement: scale, then turn about y, then translate. the linear
+// part and its inverse are kept as rows so each apply is three dots
+struct transform {
+    vec3 rows[3];
+    vec3 inverse_rows[3];
+    vec3 offset;
+
+    transform() : transform(vec3(0, 0, 0), 0, 1) {}
+
+    transform(const vec3& translation, double rotate_y_degrees, double scale) : offset(translation) {
+	const double theta = degrees_to_radians(rotate_y_degrees);
+	const real c = cos(theta), s = sin(theta);
+	rows[0] = scale * vec3(c, 0, s);
+	rows[1] = scale * vec3(0, 1, 0);
+	rows[2] = scale * vec3(-s, 0, c);
+
+	// a scaled rotation inverts as the transposed rotation over the scale
+	inverse_rows[0] = vec3(c, 0, -s) / scale;
+	inverse_rows[1] = vec3(0, 1, 0) / scale;
+	inverse_rows[2] = vec3(s, 0, c) / scale;
+    }
+
+    vec3 apply_vector(const vec3& v) const { return vec3(dot(rows[0], v), dot(rows[1], v), dot(rows[2], v)); }
+    point3 apply_point(const point3& p) const { return apply_vector(p) + offset; }
+
+    vec3 invert_vector(const vec3& v) const {
+	return vec3(dot(inverse_rows[0], v), dot(inverse_rows[1], v), dot(inverse_rows[2], v));
+    }
+    point3 invert_point(const point3& p) const { return invert_vector(p - offset); }
+
+    // normals go through the inverse transpose
+    vec3 apply_normal(const vec3& n) const {
+	return n.x() * inverse_rows[0] + n.y() * inverse_rows[1] + n.z() * inverse_rows[2];
+    }
+};
+
+// a placement of shared geometry, usually a bvh of its own, so a scene
+// costs memory per unique object rather than per copy. the top level bvh
+// sees instances as ordinary boxed primitives, making the pair a two level
+// hierarchy. the direction is not renormalised, so t means the same in
+// both spaces
+class instance : public hittable {
+    public:
+	instance(shared_ptr<hittable> object, const transform& placement) : object(object), placement(placement) {
+	    aabb local;
+	    has_box = object->bounding_box(local);
+	    if (!has_box) return;
+
+	    for (int i = 0; i < 8; i++) {
+		const point3 corner(
+		    (i & 1 ? local.max() : local.min()).x(),
+		    (i & 2 ? local.max() : local.min()).y(),
+		    (i & 4 ? local.max() : local.min()).z());
+		box.expand(placement.apply_point(corner));
+	    }
+	}
+
+	virtual bool hit(
+		const ray& r, real t_min, real t_max, hit_record& rec) const override;
+
+	virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+
+	virtual bool bounding_box(aabb& output_box) const override;
+
+    public:
+	shared_ptr<hittable> object;
+	transform placement;
+
+    private:
+	ray to_local(const ray& r) const {
+	    return ray(placement.invert_point(r.origin()), placement.invert_vector(r.direction()));
+	}
+
+	aabb box;
+	bool has_box;
+};
+
+bool instance::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    // completed straight away, the record can only describe one space
+    const ray local = to_local(r);
+    if (!object->hit(local, t_min, t_max, rec)) return false;
+
+    rec.p = placement.apply_point(rec.p);
+    rec.normal = unit_vector(placement.apply_normal(rec.normal));
+    return true;
+}
+
+bool instance::occluded(const ray& r, real t_min, real t_max) const {
+    return object->occluded(to_local(r), t_min, t_max);
+}
+
+bool instance::bounding_box(aabb& output_box) const {
+    output_box = box;
+    return has_box;
+}
@@ -0,0 +1,195 @@
+#pragma once
+
+#include "common.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// owen scrambled sobol points and a blue noise dither mask
+//
+// following burley's practical hash-based owen scrambling, every pair of
+// dimensions is an independently shuffled and scrambled copy of the first
+// two sobol dimensions. that needs no direction number tables and keeps
+// each pair stratified however many dimensions a path goes on to use
+
+inline uint32_t reverse_bits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    return __builtin_bswap32(x);
+}
+
+// the first sobol dimension is van der corput
+inline uint32_t sobol_first(uint32_t index) {
+    return reverse_bits(index);
+}
+
+// the second comes from the primitive polynomial x + 1. its generator
+// matrix is applied a byte of the index at a time from tables, so there
+// is no branch on the index bits
+struct sobol_second_table {
+    uint32_t bytes[4][256];
+
+    constexpr sobol_second_table() : bytes() {
+	uint32_t direction[32] = {};
+	uint32_t v = 1u << 31;
+	for (int bit = 0; bit < 32; bit++, v ^= v >> 1) {
+	    direction[bit] = v;
+	}
+	for (int b = 0; b < 4; b++) {
+	    for (int value = 0; value < 256; value++) {
+		uint32_t result = 0;
+		for (int bit = 0; bit < 8; bit++) {
+		    if (value & (1 << bit)) result ^= direction[8 * b + bit];
+		}
+		bytes[b][value] = result;
+	    }
+	}
+    }
+};
+
+constexpr sobol_second_table sobol_second_bytes;
+
+inline uint32_t sobol_second(uint32_t index) {
+    const auto& t = sobol_second_bytes.bytes;
+    return t[0][index & 0xff] ^ t[1][(index >> 8) & 0xff] ^ t[2][(index >> 16) & 0xff] ^ t[3][index >> 24];
+}
+
+// a hash that only lets each bit depend on the bits below it
+inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+// owen scrambling: each bit is flipped by a hash of the bits above it
+inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+    return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+// dimension `dimension` of point `index` of the sequence scrambled by `seed`
+inline double sobol_sample(uint32_t index, int dimension, uint64_t seed) {
+    const uint64_t pair_seed = hash_seed(seed, dimension / 2);
+    const uint32_t shuffled = nested_uniform_scramble(index, static_cast<uint32_t>(pair_seed));
+    const uint32_t x = (dimension & 1) ? sobol_second(shuffled) : sobol_first(shuffled);
+    return nested_uniform_scramble(x, static_cast<uint32_t>(pair_seed >> 32) + (dimension & 1)) * 0x1.0p-32;
+}
+
+// a tileable blue noise mask built with ulichney's void and cluster method
+//
+// every value in [0, 1) appears once and neighbouring pixels take values
+// far apart, so shifting one shared sequence per pixel by the mask pushes
+// the remaining error into high frequencies
+class blue_noise_mask {
+    public:
+	static const int size = 64;
+
+	static const blue_noise_mask& get() {
+	    static const blue_noise_mask mask;
+	    return mask;
+	}
+
+	double at(int x, int y) const {
+	    return values[(y & (size - 1)) * size + (x & (size - 1))];
+	}
+
+    private:
+	static const int count = size * size;
+
+	blue_noise_mask();
+
+	void toggle(int i, double sign);
+	int tightest_cluster() const;
+	int largest_void() const;
+
+	std::vector<double> kernel;
+	std::vector<double> energy;
+	std::vector<bool> pattern;
+	std::vector<float> values;
+};
+
+blue_noise_mask::blue_noise_mask() : kernel(count), energy(count, 0), pattern(count, false), values(count) {
+    // gaussian of toroidal distance, indexed by wrapped offset
+    const double sigma = 1.5;
+    for (int dy = 0; dy < size; dy++) {
+	for (int dx = 0; dx < size; dx++) {
+	    const int wx = std::min(dx, size - dx);
+	    const int wy = std::min(dy, size - dy);
+	    kernel[dy * size + dx] = std::exp(-(wx * wx + wy * wy) / (2 * sigma * sigma));
+	}
+    }
+
+    // a random tenth of the pixels, relaxed until the tightest cluster is the largest void
+    rng generator(0x5eed);
+    int ones = 0;
+    while (ones < count / 10) {
+	const int i = static_cast<int>(generator.next() % count);
+	if (pattern[i]) continue;
+	toggle(i, 1);
+	ones++;
+    }
+    while (true) {
+	const int cluster = tightest_cluster();
+	toggle(cluster, -1);
+	const int gap = largest_void();
+	toggle(gap, 1);
+	if (gap == cluster) break;
+    }
+
+    std::vector<int> rank(count);
+    const std::vector<bool> initial = pattern;
+    const std::vector<double> initial_energy = energy;
+
+    // rank the initial points by removing the tightest cluster each time
+    for (int r = ones - 1; r >= 0; r--) {
+	const int cluster = tightest_cluster();
+	toggle(cluster, -1);
+	rank[cluster] = r;
+    }
+
+    // then fill the largest void each time for the rest
+    pattern = initial;
+    energy = initial_energy;
+    for (int r = ones; r < count; r++) {
+	const int gap = largest_void();
+	toggle(gap, 1);
+	rank[gap] = r;
+    }
+
+    for (int i = 0; i < count; i++) {
+	values[i] = (rank[i] + 0.5f) / count;
+    }
+}
+
+void blue_noise_mask::toggle(int i, double sign) {
+    pattern[i] = sign > 0;
+    const int ix = i % size;
+    const int iy = i / size;
+    for (int y = 0; y < size; y++) {
+	const double* row = &kernel[((y - iy) & (size - 1)) * size];
+	for (int x = 0; x < size; x++) {
+	    energy[y * size + x] += sign * row[(x - ix) & (size - 1)];
+	}
+    }
+}
+
+int blue_noise_mask::tightest_cluster() const {
+    int best = -1;
+    for (int i = 0; i < count; i++) {
+	if (pattern[i] && (best < 0 || energy[i] > energy[best])) best = i;
+    }
+    return best;
+}
+
+int blue_noise_mask::largest_void() const {
+    int best = -1;
+    for (int i = 0; i < count; i++) {
+	if (!pattern[i] && (best < 0 || energy[i] < energy[best])) best = i;
+    }
+    return best;
+}
@@ -1,91 +1,111 @@
 #pragma once
 
 #include "common.h"
-#include <functional>
+#include "hittable.h"
+#include "sampling.h"
+#include "stats.h"
 
-struct hit_record;
+#include <cstdint>
 
-class material {
-    public:
-	virtual bool scatter(
-		const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered
-		) const = 0;
+enum class material_kind : uint32_t {
+    lambertian = 0,
+    metal = 1,
+    dielectric = 2
 };
 
-class lambertian : public material {
+// every material is one plain record tagged with its kind
+//
+// scatter switches on the tag into kernels the compiler can inline, rather
+// than making a virtual call per bounce. lambertian, metal and dielectric
+// below only fill the record in, so they slice to a material freely
+class material {
     public:
-	lambertian(const colour& a) : albedo(a) {}
-
-	virtual bool scatter(
-		const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered
-    	) const override {
-	    auto scatter_direction = rec.normal + random_unit_vector();
+	material(material_kind kind, const colour& albedo, real param) : kind(kind), albedo(albedo), param(param) {}
 
-	    if(scatter_direction.near_zero()) {
-		scatter_direction = rec.normal;
-	    }
+	bool scatter(const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered) const;
 
-	    scattered = ray(rec.p, scatter_direction);
-	    attenuation = albedo;
-	    return true;
-	}
+	// the kernel for one kind, for callers that already grouped hits by kind
+	template <material_kind K>
+	bool scatter_as(const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered) const;
 
     public:
+	material_kind kind;
 	colour albedo;
-};
+	real param; // metal fuzz or dielectric index of refraction
 
-class metal : public material {
-    public:
-	metal(const colour& a, double f) : albedo(a), fuzz(f < 1 ? f : 1) {}
-
-	virtual bool scatter(
-		const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered
-    	) const override {
-	    vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-	    scattered = ray(rec.p, reflected + fuzz * random_in_unit_sphere());
-	    attenuation = albedo;
-	    return (dot(scattered.direction(), rec.normal) > 0);
+    private:
+	static double reflectance(double cosine, double ref_idx) {
+	    // schlicks approximation
+	    auto r0 = (1 - ref_idx) / (1 + ref_idx);
+	    r0 = r0 * r0;
+	    return r0 + (1 - r0) * pow((1 - cosine), 5);
 	}
+};
 
+class lambertian : public material {
     public:
-	colour albedo;
-	double fuzz;
+	lambertian(const colour& a) : material(material_kind::lambertian, a, 0) {}
 };
 
-class dielectric : public material {
+class metal : public material {
     public:
-	dielectric(double index_of_refraction) : ir(index_of_refraction) {}
-
-	virtual bool scatter(
-	    const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered
-	) const override {
-	    attenuation = colour(1.0, 1.0, 1.0);
-	    double refraction_ratio = rec.front_face ? (1.0/ir) : ir;
-
-	    vec3 unit_direction = unit_vector(r_in.direction());
-	    double cos_theta = fmin(dot(-unit_direction, rec.normal), 1.0);
-	    double sin_theta = sqrt(1.0 - cos_theta * cos_theta);
-
-	    bool cannot_refract = refraction_ratio * sin_theta > 1.0;
-	    vec3 direction;
-
-	    if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_double())
-		direction = reflect(unit_direction, rec.normal);
-	    else
-		direction = refract(unit_direction, rec.normal, refraction_ratio);
-
-	    scattered = ray(rec.p, direction);
-	    return true;
-	}
+	metal(const colour& a, real f) : material(material_kind::metal, a, f < 1 ? f : 1) {}
+};
 
+class dielectric : public material {
     public:
-	double ir; // index of refraction
-
-    private:
-	static double reflectance(double cosine, double ref_idx) {
-	    // schlicks approximation
-	    auto r0 = (1 - ref_idx) / (1 + ref_idx);
-	    r0 = r0 * r0;
-	    return r0 + (1 - r0) * pow((1 - cosine), 5);
-	}
+	dielectric(real index_of_refraction) : material(material_kind::dielectric, colour(1.0, 1.0, 1.0), index_of_refraction) {}
 };
+
+template <>
+inline bool material::scatter_as<material_kind::lambertian>(
+	const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered) const {
+    STAT_INC(scatter_lambertian);
+    scattered = ray(rec.p, sample_cosine_hemisphere(rec.normal));
+    attenuation = albedo;
+    return true;
+}
+
+template <>
+inline bool material::scatter_as<material_kind::metal>(
+	const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered) const {
+    STAT_INC(scatter_metal);
+    vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
+    scattered = ray(rec.p, reflected + param * sample_unit_ball());
+    attenuation = albedo;
+    return (dot(scattered.direction(), rec.normal) > 0);
+}
+
+template <>
+inline bool material::scatter_as<material_kind::dielectric>(
+	const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered) const {
+    STAT_INC(scatter_dielectric);
+    attenuation = albedo;
+    double refraction_ratio = rec.front_face ? (1.0/param) : param;
+
+    vec3 unit_direction = unit_vector(r_in.direction());
+    double cos_theta = fmin(dot(-unit_direction, rec.normal), 1.0);
+    double sin_theta = sqrt(1.0 - cos_theta * cos_theta);
+
+    bool cannot_refract = refraction_ratio * sin_theta > 1.0;
+    vec3 direction;
+
+    // always draw, so every bounce uses the same number of dimensions
+    const double u = sample_1d();
+    if (cannot_refract || reflectance(cos_theta, refraction_ratio) > u)
+	direction = reflect(unit_direction, rec.normal);
+    else
+	direction = refract(unit_direction, rec.normal, refraction_ratio);
+
+    scattered = ray(rec.p, direction);
+    return true;
+}
+
+inline bool material::scatter(const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered) const {
+    switch (kind) {
+	case material_kind::metal: return scatter_as<material_kind::metal>(r_in, rec, attenuation, scattered);
+	case material_kind::dielectric: return scatter_as<material_kind::dielectric>(r_in, rec, attenuation, scattered);
+	case material_kind::lambertian: break;
+    }
+    return scatter_as<material_kind::lambertian>(r_in, rec, attenuation, scattered);
+}
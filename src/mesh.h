@@ -0,0 +1,896 @@
+#pragma once
+
+#include "aabb.h"
+#include "bvh.h"
+#include "common.h"
+#include "hittable.h"
+#include "material.h"
+#include "stats.h"
+#include "vec3.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// triangle meshes from obj or ply files
+//
+// a mesh is three flat arrays: float vertex positions, triangles as vertex
+// index triples stored in the order the bvh leaves visit them, and an 8 wide
+// bvh whose child boxes are quantized to bytes within their parent's box.
+// like scene files, the first load compiles <file>.bin in exactly that
+// layout and later loads map it, so no triangle is ever its own hittable
+
+// eight child boxes, each axis stored as byte offsets in steps of 2^exponent
+// from origin. two cache lines
+struct mesh_node {
+    static const int width = 8;
+    static const uint8_t interior = 0;
+    static const int max_leaf = 255; // triangles a leaf slot can count
+
+    float origin[3];
+    int8_t exponent[3];
+    uint8_t child_count;
+    uint8_t lo[3][width];
+    uint8_t hi[3][width];
+    uint32_t child[width];    // node index, or first triangle of a leaf
+    uint8_t triangles[width]; // leaf triangle count, or interior
+    uint8_t pad[24];
+};
+
+static_assert(sizeof(mesh_node) == 128, "mesh nodes are two cache lines");
+
+// the file a cache was compiled from, as stat saw it then. a cache is
+// current only while its source keeps this size and modification time to
+// the nanosecond, so edits within a second, or an older file checked out
+// over the source, still recompile it
+struct cache_source {
+    uint64_t size;
+    int64_t mtime_ns;
+
+    bool operator==(const cache_source& other) const { return size == other.size && mtime_ns == other.mtime_ns; }
+};
+
+inline bool stat_source(const std::string& path, cache_source& source) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return false;
+    source.size = static_cast<uint64_t>(st.st_size);
+    source.mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    return true;
+}
+
+struct mesh_cache_header {
+    static const uint32_t current_version = 3;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t vertex_count;
+    uint32_t triangle_count;
+    uint32_t node_count;
+    uint64_t vertices_offset;
+    uint64_t triangles_offset;
+    uint64_t nodes_offset;
+    float bounds_min[3];
+    float bounds_max[3];
+    cache_source source;
+};
+
+const char mesh_cache_magic[8] = {'T', 'R', 'M', 'E', 'S', 'H', 0, 0};
+
+// 2^e as a float, for exponents well inside the normal range
+inline float exponent_scale(int e) {
+    uint32_t bits = static_cast<uint32_t>(e + 127) << 23;
+    float scale;
+    std::memcpy(&scale, &bits, sizeof(scale));
+    return scale;
+}
+
+// obj vertices and faces, polygons fanned into triangles
+bool parse_obj(const std::string& path, std::vector<float>& vertices, std::vector<uint32_t>& indices, std::string& error) {
+    std::ifstream in(path);
+    if (!in) {
+	error = "cannot open " + path;
+	return false;
+    }
+
+    std::string line;
+    int line_number = 0;
+    std::vector<uint32_t> face;
+    while (std::getline(in, line)) {
+	line_number++;
+	std::istringstream words(line);
+	std::string kind;
+	if (!(words >> kind)) continue;
+
+	if (kind == "v") {
+	    float x, y, z;
+	    if (!(words >> x >> y >> z)) {
+		error = path + ":" + std::to_string(line_number) + ": bad vertex";
+		return false;
+	    }
+	    vertices.insert(vertices.end(), {x, y, z});
+	} else if (kind == "f") {
+	    // v, v/vt, v//vn or v/vt/vn, negative indices count back from the latest vertex
+	    face.clear();
+	    std::string corner;
+	    const long vertex_count = static_cast<long>(vertices.size() / 3);
+	    while (words >> corner) {
+		long i = std::strtol(corner.c_str(), nullptr, 10);
+		i = i < 0 ? vertex_count + i : i - 1;
+		if (i < 0 || i >= vertex_count) {
+		    error = path + ":" + std::to_string(line_number) + ": face index out of range";
+		    return false;
+		}
+		face.push_back(static_cast<uint32_t>(i));
+	    }
+	    for (size_t k = 2; k < face.size(); k++) {
+		indices.insert(indices.end(), {face[0], face[k - 1], face[k]});
+	    }
+	}
+    }
+
+    return true;
+}
+
+// ply with x, y, z vertex properties and a face index list, ascii or binary little endian
+bool parse_ply(const std::string& path, std::vector<float>& vertices, std::vector<uint32_t>& indices, std::string& error) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+	error = "cannot open " + path;
+	return false;
+    }
+
+    auto fail = [&](const std::string& what) {
+	error = path + ": " + what;
+	return false;
+    };
+
+    auto type_size = [](const std::string& type) {
+	if (type == "char" || type == "uchar" || type == "int8" || type == "uint8") return 1;
+	if (type == "short" || type == "ushort" || type == "int16" || type == "uint16") return 2;
+	if (type == "int" || type == "uint" || type == "float" || type == "int32" || type == "uint32" || type == "float32") return 4;
+	if (type == "double" || type == "float64") return 8;
+	return 0;
+    };
+
+    struct property {
+	std::string name, type, count_type;
+	bool list;
+    };
+    struct element {
+	std::string name;
+	long count;
+	std::vector<property> properties;
+    };
+
+    std::string line;
+    std::getline(in, line);
+    if (line.compare(0, 3, "ply") != 0) return fail("not a ply file");
+
+    bool binary = false;
+    std::vector<element> elements;
+    while (std::getline(in, line)) {
+	std::istringstream words(line);
+	std::string kind;
+	words >> kind;
+	if (kind == "format") {
+	    std::string format;
+	    words >> format;
+	    if (format == "binary_little_endian") binary = true;
+	    else if (format != "ascii") return fail("unsupported format " + format);
+	} else if (kind == "element") {
+	    element e;
+	    words >> e.name >> e.count;
+	    elements.push_back(e);
+	} else if (kind == "property") {
+	    if (elements.empty()) return fail("property before any element");
+	    property p;
+	    words >> p.type;
+	    p.list = p.type == "list";
+	    if (p.list) words >> p.count_type >> p.type;
+	    words >> p.name;
+	    if (type_size(p.type) == 0 || (p.list && type_size(p.count_type) == 0)) return fail("unknown property type " + p.type);
+	    elements.back().properties.push_back(p);
+	} else if (kind == "end_header") {
+	    break;
+	}
+    }
+
+    // one value of the given type, widened to double
+    auto read_value = [&](const std::string& type, double& value) {
+	if (!binary) return bool(in >> value);
+
+	unsigned char bytes[8];
+	const int size = type_size(type);
+	if (!in.read(reinterpret_cast<char*>(bytes), size)) return false;
+	if (type == "float" || type == "float32") { float f; std::memcpy(&f, bytes, 4); value = f; }
+	else if (type == "double" || type == "float64") { double d; std::memcpy(&d, bytes, 8); value = d; }
+	else if (type == "char" || type == "int8") value = static_cast<int8_t>(bytes[0]);
+	else if (type == "uchar" || type == "uint8") value = bytes[0];
+	else if (type == "short" || type == "int16") { int16_t v; std::memcpy(&v, bytes, 2); value = v; }
+	else if (type == "ushort" || type == "uint16") { uint16_t v; std::memcpy(&v, bytes, 2); value = v; }
+	else if (type == "int" || type == "int32") { int32_t v; std::memcpy(&v, bytes, 4); value = v; }
+	else { uint32_t v; std::memcpy(&v, bytes, 4); value = v; }
+	return true;
+    };
+
+    std::vector<uint32_t> face;
+    for (const auto& e : elements) {
+	for (long n = 0; n < e.count; n++) {
+	    double position[3] = {0, 0, 0};
+	    face.clear();
+	    for (const auto& p : e.properties) {
+		double value;
+		if (!p.list) {
+		    if (!read_value(p.type, value)) return fail("truncated " + e.name + " data");
+		    if (p.name == "x") position[0] = value;
+		    else if (p.name == "y") position[1] = value;
+		    else if (p.name == "z") position[2] = value;
+		    continue;
+		}
+
+		double count;
+		if (!read_value(p.count_type, count)) return fail("truncated " + e.name + " data");
+		for (long k = 0; k < static_cast<long>(count); k++) {
+		    if (!read_value(p.type, value)) return fail("truncated " + e.name + " data");
+		    face.push_back(static_cast<uint32_t>(value));
+		}
+	    }
+
+	    if (e.name == "vertex") {
+		vertices.insert(vertices.end(), {float(position[0]), float(position[1]), float(position[2])});
+	    } else if (e.name == "face") {
+		for (uint32_t i : face) {
+		    if (i >= vertices.size() / 3) return fail("face index out of range");
+		}
+		for (size_t k = 2; k < face.size(); k++) {
+		    indices.insert(indices.end(), {face[0], face[k - 1], face[k]});
+		}
+	    }
+	}
+    }
+
+    return true;
+}
+
+// build the bvh and lay the mesh out as its cache file, in an aligned buffer
+class mesh_builder {
+    public:
+	static const int max_leaf_size = 4;
+
+	void build(const std::vector<float>& vertices, const std::vector<uint32_t>& indices);
+
+	std::vector<unsigned char> bytes;
+
+    private:
+	uint32_t collapse(int binary_index);
+	uint32_t split_leaf(int first, int count);
+	void quantize(mesh_node& node, const aabb* child_boxes, int count) const;
+
+	// a leaf's triangles are one contiguous run under a node that already
+	// paid for eight box tests, so a full leaf is priced like a single test
+	bvh_builder binary = bvh_builder(max_leaf_size, max_leaf_size);
+	std::vector<aabb> triangle_boxes;
+	std::vector<mesh_node> nodes;
+};
+
+void mesh_builder::build(const std::vector<float>& vertices, const std::vector<uint32_t>& indices) {
+    const size_t triangle_count = indices.size() / 3;
+    std::vector<aabb>& boxes = triangle_boxes;
+    boxes.assign(triangle_count, aabb());
+    aabb bounds;
+    for (size_t t = 0; t < triangle_count; t++) {
+	for (int k = 0; k < 3; k++) {
+	    const float* v = &vertices[3 * indices[3 * t + k]];
+	    boxes[t].expand(point3(v[0], v[1], v[2]));
+	}
+	bounds.expand(boxes[t]);
+    }
+
+    binary.build(boxes, std::vector<bool>(triangle_count, true));
+    nodes.clear();
+    if (!binary.nodes.empty()) collapse(0);
+
+    mesh_cache_header header = {};
+    std::memcpy(header.magic, mesh_cache_magic, sizeof(header.magic));
+    header.version = mesh_cache_header::current_version;
+    header.vertex_count = static_cast<uint32_t>(vertices.size() / 3);
+    header.triangle_count = static_cast<uint32_t>(triangle_count);
+    header.node_count = static_cast<uint32_t>(nodes.size());
+    for (int a = 0; a < 3; a++) {
+	header.bounds_min[a] = triangle_count ? static_cast<float>(bounds.min()[a]) : 0;
+	header.bounds_max[a] = triangle_count ? static_cast<float>(bounds.max()[a]) : 0;
+    }
+
+    auto align = [](uint64_t offset) { return (offset + 63) & ~uint64_t(63); };
+    header.nodes_offset = align(sizeof(header));
+    header.triangles_offset = align(header.nodes_offset + nodes.size() * sizeof(mesh_node));
+    header.vertices_offset = align(header.triangles_offset + indices.size() * sizeof(uint32_t));
+    const uint64_t size = header.vertices_offset + vertices.size() * sizeof(float);
+
+    bytes.assign(size, 0);
+    std::memcpy(&bytes[0], &header, sizeof(header));
+    if (!nodes.empty()) std::memcpy(&bytes[header.nodes_offset], nodes.data(), nodes.size() * sizeof(mesh_node));
+    if (!vertices.empty()) std::memcpy(&bytes[header.vertices_offset], vertices.data(), vertices.size() * sizeof(float));
+
+    // triangles in leaf order, so each leaf reads one contiguous run
+    auto triangles = reinterpret_cast<uint32_t*>(&bytes[header.triangles_offset]);
+    for (size_t i = 0; i < binary.order.size(); i++) {
+	std::memcpy(&triangles[3 * i], &indices[3 * binary.order[i]], 3 * sizeof(uint32_t));
+    }
+}
+
+// open the binary node with the largest box until the eight slots are full
+uint32_t mesh_builder::collapse(int binary_index) {
+    const uint32_t index = static_cast<uint32_t>(nodes.size());
+    nodes.push_back(mesh_node());
+
+    std::vector<int> children;
+    const auto& root = binary.nodes[binary_index];
+    if (root.count > 0) {
+	children.push_back(binary_index);
+    } else {
+	children.push_back(binary_index + 1);
+	children.push_back(root.offset);
+    }
+
+    while (static_cast<int>(children.size()) < mesh_node::width) {
+	int widest = -1;
+	double widest_area = -1;
+	for (size_t k = 0; k < children.size(); k++) {
+	    const auto& n = binary.nodes[children[k]];
+	    if (n.count == 0 && n.box.surface_area() > widest_area) {
+		widest = static_cast<int>(k);
+		widest_area = n.box.surface_area();
+	    }
+	}
+	if (widest < 0) break;
+
+	const int opened = children[widest];
+	children[widest] = opened + 1;
+	children.push_back(binary.nodes[opened].offset);
+    }
+
+    aabb boxes[mesh_node::width];
+    for (size_t k = 0; k < children.size(); k++) {
+	boxes[k] = binary.nodes[children[k]].box;
+    }
+    quantize(nodes[index], boxes, static_cast<int>(children.size()));
+
+    // recursing may grow nodes, so index rather than hold a reference
+    for (size_t k = 0; k < children.size(); k++) {
+	const auto& n = binary.nodes[children[k]];
+	if (n.count > mesh_node::max_leaf) {
+	    const uint32_t child = split_leaf(n.offset, n.count);
+	    nodes[index].child[k] = child;
+	    nodes[index].triangles[k] = mesh_node::interior;
+	} else if (n.count > 0) {
+	    nodes[index].child[k] = static_cast<uint32_t>(n.offset);
+	    nodes[index].triangles[k] = static_cast<uint8_t>(n.count);
+	} else {
+	    const uint32_t child = collapse(children[k]);
+	    nodes[index].child[k] = child;
+	    nodes[index].triangles[k] = mesh_node::interior;
+	}
+    }
+
+    return index;
+}
+
+// the binary build leaves a whole range as one leaf when nothing separates
+// its triangles, e.g. when their centroids coincide. a leaf slot counts at
+// most max_leaf, so such a leaf becomes nodes over runs that fit
+uint32_t mesh_builder::split_leaf(int first, int count) {
+    const uint32_t index = static_cast<uint32_t>(nodes.size());
+    nodes.push_back(mesh_node());
+
+    // whole runs of max_leaf per child, as few children as that allows
+    const int runs = (count + mesh_node::max_leaf - 1) / mesh_node::max_leaf;
+    const int per_child = (runs + mesh_node::width - 1) / mesh_node::width * mesh_node::max_leaf;
+    const int child_count = (count + per_child - 1) / per_child;
+
+    aabb boxes[mesh_node::width];
+    for (int k = 0; k < child_count; k++) {
+	const int end = std::min(count, (k + 1) * per_child);
+	for (int i = k * per_child; i < end; i++) {
+	    boxes[k].expand(triangle_boxes[binary.order[first + i]]);
+	}
+    }
+    quantize(nodes[index], boxes, child_count);
+
+    for (int k = 0; k < child_count; k++) {
+	const int start = k * per_child;
+	const int size = std::min(count, start + per_child) - start;
+	if (size > mesh_node::max_leaf) {
+	    const uint32_t child = split_leaf(first + start, size);
+	    nodes[index].child[k] = child;
+	    nodes[index].triangles[k] = mesh_node::interior;
+	} else {
+	    assert(size > 0);
+	    nodes[index].child[k] = static_cast<uint32_t>(first + start);
+	    nodes[index].triangles[k] = static_cast<uint8_t>(size);
+	}
+    }
+
+    return index;
+}
+
+// conservative byte boxes, checked in the same float arithmetic traversal decodes them with
+void mesh_builder::quantize(mesh_node& node, const aabb* child_boxes, int count) const {
+    aabb bounds;
+    for (int k = 0; k < count; k++) bounds.expand(child_boxes[k]);
+
+    node.child_count = static_cast<uint8_t>(count);
+    for (int a = 0; a < 3; a++) {
+	float origin = static_cast<float>(bounds.min()[a]);
+	if (origin > bounds.min()[a]) origin = std::nextafter(origin, -std::numeric_limits<float>::infinity());
+
+	const double extent = bounds.max()[a] - origin;
+	int e = extent > 0 ? static_cast<int>(std::ceil(std::log2(extent / 255))) : -100;
+	e = std::max(-100, std::min(100, e));
+	while (origin + 255 * exponent_scale(e) < bounds.max()[a]) e++;
+
+	const float scale = exponent_scale(e);
+	node.origin[a] = origin;
+	node.exponent[a] = static_cast<int8_t>(e);
+	for (int k = 0; k < count; k++) {
+	    int lo = static_cast<int>(std::floor((child_boxes[k].min()[a] - origin) / scale));
+	    int hi = static_cast<int>(std::ceil((child_boxes[k].max()[a] - origin) / scale));
+	    lo = std::max(0, std::min(255, lo));
+	    hi = std::max(0, std::min(255, hi));
+	    while (lo > 0 && origin + lo * scale > child_boxes[k].min()[a]) lo--;
+	    while (hi < 255 && origin + hi * scale < child_boxes[k].max()[a]) hi++;
+	    node.lo[a][k] = static_cast<uint8_t>(lo);
+	    node.hi[a][k] = static_cast<uint8_t>(hi);
+	}
+    }
+}
+
+// a mesh traversed in its cache layout, either mapped from a file or built in memory
+class triangle_mesh : public hittable {
+    public:
+	triangle_mesh(shared_ptr<material> m) : mat_ptr(m) {}
+	~triangle_mesh() { release(); }
+
+	triangle_mesh(const triangle_mesh&) = delete;
+	triangle_mesh& operator=(const triangle_mesh&) = delete;
+
+	bool open(const std::string& path, std::string& error);
+	void build(const std::vector<float>& vertices, const std::vector<uint32_t>& indices);
+
+	// swap a mapped cache for a copy first touched by the calling thread, so
+	// a thread pinned to a numa node puts the mesh in that node's memory
+	void localize();
+
+	int triangle_count() const { return header ? static_cast<int>(header->triangle_count) : 0; }
+	int node_count() const { return header ? static_cast<int>(header->node_count) : 0; }
+	bool compiled_from(const cache_source& source) const { return header && header->source == source; }
+
+	virtual bool hit(
+		const ray& r, real t_min, real t_max, hit_record& rec) const override;
+
+	virtual bool intersect(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+	virtual void complete(const ray& r, hit_record& rec) const override;
+
+	virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+
+	virtual bool bounding_box(aabb& output_box) const override;
+
+    public:
+	shared_ptr<material> mat_ptr;
+
+    private:
+	// the ray in float, with the watertight test's shear and axis order
+	struct mesh_ray {
+	    float origin[3];
+	    float inv_direction[3];
+	    int kx, ky, kz;
+	    float sx, sy, sz;
+	};
+
+	static mesh_ray prepare(const ray& r);
+	bool hit_triangle(const mesh_ray& r, uint32_t triangle, float t_min, float t_max, float& t) const;
+	int hit_children(const mesh_node& node, const mesh_ray& r, float t_min, float t_max, float* near, int* slots) const;
+
+	bool attach(const unsigned char* base, size_t size);
+	bool check(const unsigned char* base, size_t size);
+	void release();
+
+	void* mapping = nullptr;
+	size_t mapping_size = 0;
+	std::vector<unsigned char> owned;
+	const mesh_cache_header* header = nullptr;
+	const mesh_node* nodes = nullptr;
+	const uint32_t* triangles = nullptr;
+	const float* vertices = nullptr;
+};
+
+bool triangle_mesh::open(const std::string& path, std::string& error) {
+    release();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+	error = "cannot open " + path;
+	return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(mesh_cache_header))) {
+	::close(fd);
+	error = path + " is not a mesh cache";
+	return false;
+    }
+
+    mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+	mapping = nullptr;
+	error = "cannot map " + path;
+	return false;
+    }
+    mapping_size = st.st_size;
+
+    if (!attach(static_cast<const unsigned char*>(mapping), mapping_size)) {
+	release();
+	error = path + " is not a current mesh cache";
+	return false;
+    }
+    return true;
+}
+
+void triangle_mesh::build(const std::vector<float>& vertex_data, const std::vector<uint32_t>& index_data) {
+    release();
+    mesh_builder builder;
+    builder.build(vertex_data, index_data);
+    owned = std::move(builder.bytes);
+    attach(owned.data(), owned.size());
+}
+
+void triangle_mesh::localize() {
+    if (!mapping) return;
+    const auto base = static_cast<const unsigned char*>(mapping);
+    std::vector<unsigned char> copy(base, base + mapping_size);
+    release();
+    owned = std::move(copy);
+    attach(owned.data(), owned.size());
+}
+
+bool triangle_mesh::attach(const unsigned char* base, size_t size) {
+    header = reinterpret_cast<const mesh_cache_header*>(base);
+    if (size < sizeof(mesh_cache_header)
+	|| std::memcmp(header->magic, mesh_cache_magic, sizeof(header->magic)) != 0
+	|| header->version != mesh_cache_header::current_version
+	|| !check(base, size)) {
+	header = nullptr;
+	return false;
+    }
+    return true;
+}
+
+// whether the header's arrays fit in size bytes and every index in them,
+// node children, leaf triangle runs and triangle vertices, stays within the
+// arrays it indexes, as mapped_scene::check does for scenes. sets nodes,
+// triangles and vertices as it goes
+bool triangle_mesh::check(const unsigned char* base, size_t size) {
+    auto fits = [&](uint64_t offset, uint64_t count, uint64_t record) {
+	return offset <= size && count <= (size - offset) / record;
+    };
+    if (!fits(header->nodes_offset, header->node_count, sizeof(mesh_node))
+	|| !fits(header->triangles_offset, header->triangle_count, 3 * sizeof(uint32_t))
+	|| !fits(header->vertices_offset, header->vertex_count, 3 * sizeof(float))) {
+	return false;
+    }
+
+    nodes = reinterpret_cast<const mesh_node*>(base + header->nodes_offset);
+    triangles = reinterpret_cast<const uint32_t*>(base + header->triangles_offset);
+    vertices = reinterpret_cast<const float*>(base + header->vertices_offset);
+
+    for (uint64_t i = 0; i < 3 * uint64_t(header->triangle_count); i++) {
+	if (triangles[i] >= header->vertex_count) return false;
+    }
+
+    // children follow their parents, so one pass in order gives every depth.
+    // a node reached twice could sit deeper than its depth says, so the
+    // nodes must form a tree
+    const uint64_t node_count = header->node_count;
+    std::vector<int> depth(node_count, -1);
+    if (node_count > 0) depth[0] = 0;
+    for (uint64_t i = 0; i < node_count; i++) {
+	const mesh_node& n = nodes[i];
+	if (depth[i] < 0 || depth[i] > bvh_builder::max_depth || n.child_count > mesh_node::width) return false;
+	for (int k = 0; k < n.child_count; k++) {
+	    const uint64_t child = n.child[k];
+	    if (n.triangles[k] == mesh_node::interior) {
+		if (child <= i || child >= node_count || depth[child] != -1) return false;
+		depth[child] = depth[i] + 1;
+	    } else if (child + n.triangles[k] > header->triangle_count) {
+		return false;
+	    }
+	}
+    }
+    return true;
+}
+
+void triangle_mesh::release() {
+    if (mapping) munmap(mapping, mapping_size);
+    mapping = nullptr;
+    owned.clear();
+    header = nullptr;
+}
+
+triangle_mesh::mesh_ray triangle_mesh::prepare(const ray& r) {
+    mesh_ray m;
+    const vec3 d = r.direction();
+    for (int a = 0; a < 3; a++) {
+	m.origin[a] = static_cast<float>(r.origin()[a]);
+	m.inv_direction[a] = static_cast<float>(1 / d[a]);
+    }
+
+    // shear so the ray runs along +z from the origin, after woop, benthin and wald
+    m.kz = fabs(d.x()) > fabs(d.y()) ? (fabs(d.x()) > fabs(d.z()) ? 0 : 2) : (fabs(d.y()) > fabs(d.z()) ? 1 : 2);
+    m.kx = (m.kz + 1) % 3;
+    m.ky = (m.kx + 1) % 3;
+    if (d[m.kz] < 0) std::swap(m.kx, m.ky);
+    m.sx = static_cast<float>(d[m.kx] / d[m.kz]);
+    m.sy = static_cast<float>(d[m.ky] / d[m.kz]);
+    m.sz = static_cast<float>(1 / d[m.kz]);
+    return m;
+}
+
+// watertight: rays through a shared edge or vertex hit at least one of its triangles
+bool triangle_mesh::hit_triangle(const mesh_ray& r, uint32_t triangle, float t_min, float t_max, float& t) const {
+    STAT_INC(primitive_tests);
+    const float* a = &vertices[3 * triangles[3 * triangle + 0]];
+    const float* b = &vertices[3 * triangles[3 * triangle + 1]];
+    const float* c = &vertices[3 * triangles[3 * triangle + 2]];
+
+    const float az = a[r.kz] - r.origin[r.kz];
+    const float bz = b[r.kz] - r.origin[r.kz];
+    const float cz = c[r.kz] - r.origin[r.kz];
+    const float ax = a[r.kx] - r.origin[r.kx] - r.sx * az;
+    const float ay = a[r.ky] - r.origin[r.ky] - r.sy * az;
+    const float bx = b[r.kx] - r.origin[r.kx] - r.sx * bz;
+    const float by = b[r.ky] - r.origin[r.ky] - r.sy * bz;
+    const float cx = c[r.kx] - r.origin[r.kx] - r.sx * cz;
+    const float cy = c[r.ky] - r.origin[r.ky] - r.sy * cz;
+
+    float u = cx * by - cy * bx;
+    float v = ax * cy - ay * cx;
+    float w = bx * ay - by * ax;
+
+    // an edge through the ray exactly, decide it in double so neighbours agree
+    if (u == 0 || v == 0 || w == 0) {
+	u = static_cast<float>(double(cx) * by - double(cy) * bx);
+	v = static_cast<float>(double(ax) * cy - double(ay) * cx);
+	w = static_cast<float>(double(bx) * ay - double(by) * ax);
+    }
+
+    if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0)) return false;
+    const float det = u + v + w;
+    if (det == 0) return false;
+
+    const float hit_t = (u * r.sz * az + v * r.sz * bz + w * r.sz * cz) / det;
+    if (hit_t < t_min || hit_t > t_max) return false;
+    t = hit_t;
+    return true;
+}
+
+// slab test every child box, returning the hit ones nearest first. the
+// slabs run over all eight slots without branches so they vectorise, empty
+// slots are dropped afterwards
+int triangle_mesh::hit_children(const mesh_node& node, const mesh_ray& r, float t_min, float t_max, float* near, int* slots) const {
+    STAT_INC(bvh_nodes);
+    const int width = mesh_node::width;
+    float t0[width], t1[width];
+    for (int k = 0; k < width; k++) {
+	t0[k] = t_min;
+	t1[k] = t_max;
+    }
+
+    for (int a = 0; a < 3; a++) {
+	const float scale = exponent_scale(node.exponent[a]);
+	const float base = node.origin[a] - r.origin[a];
+	const float inv_d = r.inv_direction[a];
+	const bool negative = inv_d < 0;
+	const uint8_t* near_q = negative ? node.hi[a] : node.lo[a];
+	const uint8_t* far_q = negative ? node.lo[a] : node.hi[a];
+	// widen for the rounding in the float slabs, so hits on a box face aren't lost
+	const float far_inv_d = inv_d * (1 + 4 * std::numeric_limits<float>::epsilon());
+	for (int k = 0; k < width; k++) {
+	    t0[k] = std::max(t0[k], (base + near_q[k] * scale) * inv_d);
+	    t1[k] = std::min(t1[k], (base + far_q[k] * scale) * far_inv_d);
+	}
+    }
+
+    int hits = 0;
+    for (int k = 0; k < node.child_count; k++) {
+	if (t0[k] > t1[k]) continue;
+
+	int i = hits++;
+	while (i > 0 && near[i - 1] > t0[k]) {
+	    near[i] = near[i - 1];
+	    slots[i] = slots[i - 1];
+	    i--;
+	}
+	near[i] = t0[k];
+	slots[i] = k;
+    }
+    return hits;
+}
+
+bool triangle_mesh::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    if (!intersect(r, t_min, t_max, rec)) return false;
+    complete(r, rec);
+    rec.source = nullptr;
+    return true;
+}
+
+bool triangle_mesh::intersect(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    if (!header || header->node_count == 0) return false;
+
+    const mesh_ray m = prepare(r);
+    const float near_limit = static_cast<float>(t_min);
+    float closest = static_cast<float>(std::min<double>(t_max, std::numeric_limits<float>::max()));
+    int nearest = -1;
+
+    struct entry {
+	uint32_t node;
+	float t;
+    };
+    entry stack[(mesh_node::width - 1) * bvh_builder::max_depth + 1];
+    int stack_size = 0;
+    stack[stack_size++] = {0, near_limit};
+
+    while (stack_size > 0) {
+	const entry e = stack[--stack_size];
+	if (e.t > closest) continue;
+
+	const mesh_node& node = nodes[e.node];
+	float near[mesh_node::width];
+	int slots[mesh_node::width];
+	const int hits = hit_children(node, m, near_limit, closest, near, slots);
+
+	// leaves now, nearest first, so their hits can cull the nodes pushed next
+	for (int i = 0; i < hits; i++) {
+	    const int k = slots[i];
+	    if (node.triangles[k] == mesh_node::interior || near[i] > closest) continue;
+	    for (uint32_t t = node.child[k]; t < node.child[k] + node.triangles[k]; t++) {
+		float hit_t;
+		if (hit_triangle(m, t, near_limit, closest, hit_t)) {
+		    closest = hit_t;
+		    nearest = static_cast<int>(t);
+		}
+	    }
+	}
+	for (int i = hits - 1; i >= 0; i--) {
+	    const int k = slots[i];
+	    if (node.triangles[k] == mesh_node::interior && near[i] <= closest) {
+		stack[stack_size++] = {node.child[k], near[i]};
+	    }
+	}
+    }
+
+    if (nearest < 0) return false;
+    rec.t = closest;
+    rec.mat_ptr = mat_ptr.get();
+    rec.source = this;
+    rec.part = nearest;
+    return true;
+}
+
+void triangle_mesh::complete(const ray& r, hit_record& rec) const {
+    const float* a = &vertices[3 * triangles[3 * rec.part + 0]];
+    const float* b = &vertices[3 * triangles[3 * rec.part + 1]];
+    const float* c = &vertices[3 * triangles[3 * rec.part + 2]];
+    const vec3 ab(b[0] - a[0], b[1] - a[1], b[2] - a[2]);
+    const vec3 ac(c[0] - a[0], c[1] - a[1], c[2] - a[2]);
+
+    rec.p = r.at(rec.t);
+    rec.set_face_normal(r, unit_vector(cross(ab, ac)));
+}
+
+bool triangle_mesh::occluded(const ray& r, real t_min, real t_max) const {
+    if (!header || header->node_count == 0) return false;
+
+    const mesh_ray m = prepare(r);
+    const float near_limit = static_cast<float>(t_min);
+    const float far_limit = static_cast<float>(std::min<double>(t_max, std::numeric_limits<float>::max()));
+
+    uint32_t stack[(mesh_node::width - 1) * bvh_builder::max_depth + 1];
+    int stack_size = 0;
+    stack[stack_size++] = 0;
+
+    while (stack_size > 0) {
+	const mesh_node& node = nodes[stack[--stack_size]];
+	float near[mesh_node::width];
+	int slots[mesh_node::width];
+	const int hits = hit_children(node, m, near_limit, far_limit, near, slots);
+
+	for (int i = 0; i < hits; i++) {
+	    const int k = slots[i];
+	    if (node.triangles[k] == mesh_node::interior) {
+		stack[stack_size++] = node.child[k];
+		continue;
+	    }
+	    for (uint32_t t = node.child[k]; t < node.child[k] + node.triangles[k]; t++) {
+		float hit_t;
+		if (hit_triangle(m, t, near_limit, far_limit, hit_t)) return true;
+	    }
+	}
+    }
+
+    return false;
+}
+
+bool triangle_mesh::bounding_box(aabb& output_box) const {
+    if (!header || header->triangle_count == 0) return false;
+    output_box = aabb(
+	point3(header->bounds_min[0], header->bounds_min[1], header->bounds_min[2]),
+	point3(header->bounds_max[0], header->bounds_max[1], header->bounds_max[2]));
+    return true;
+}
+
+// parse path by its extension and write its cache, as load_scene does for scenes
+bool write_mesh_cache(const std::string& path, const std::string& cache, const cache_source& source, std::string& error) {
+    std::vector<float> vertices;
+    std::vector<uint32_t> indices;
+    const bool ply = path.size() > 4 && path.compare(path.size() - 4, 4, ".ply") == 0;
+    if (!(ply ? parse_ply(path, vertices, indices, error) : parse_obj(path, vertices, indices, error))) return false;
+
+    mesh_builder builder;
+    builder.build(vertices, indices);
+    reinterpret_cast<mesh_cache_header*>(builder.bytes.data())->source = source;
+
+    // write beside the target and rename, so concurrent readers see whole files only
+    const std::string temp = cache + ".tmp" + std::to_string(getpid());
+    {
+	std::ofstream out(temp, std::ios::binary);
+	out.write(reinterpret_cast<const char*>(builder.bytes.data()), builder.bytes.size());
+	if (!out) {
+	    error = "cannot write " + temp;
+	    return false;
+	}
+    }
+    if (std::rename(temp.c_str(), cache.c_str()) != 0) {
+	error = "cannot rename " + temp + " to " + cache;
+	return false;
+    }
+    return true;
+}
+
+// map path's cache, compiling it first when missing or not compiled from path as it is now
+bool load_mesh(const std::string& path, triangle_mesh& mesh, std::string& error) {
+    const std::string suffix = ".bin";
+    if (path.size() > suffix.size() && path.compare(path.size() - suffix.size(), suffix.size(), suffix) == 0) {
+	return mesh.open(path, error);
+    }
+
+    const std::string cache = path + suffix;
+    cache_source source;
+    if (!stat_source(path, source)) {
+	error = "cannot open " + path;
+	return false;
+    }
+
+    std::string ignored;
+    if (mesh.open(cache, ignored) && mesh.compiled_from(source)) {
+	return true;
+    }
+
+    if (!write_mesh_cache(path, cache, source, error)) return false;
+    return mesh.open(cache, error);
+}
@@ -7,19 +7,27 @@ class ray {
 	public:
 		ray() {}
 		ray(const point3& origin, const vec3& direction)
-			: orig(origin), dir(direction)
+			: orig(origin), dir(direction),
+			  inv_dir(1 / direction.x(), 1 / direction.y(), 1 / direction.z()),
+			  dir_length_squared(direction.length_squared())
 		{}
 
 		point3 origin() const { return orig; }
 		vec3 direction() const { return dir; }
 
-		point3 at(double t) const {
+		// per ray constants for the slab and sphere tests
+		vec3 inv_direction() const { return inv_dir; }
+		real direction_length_squared() const { return dir_length_squared; }
+
+		point3 at(real t) const {
 			return orig + t*dir;
 		}
 
 	public:
 		point3 orig;
 		vec3 dir;
+		vec3 inv_dir;
+		real dir_length_squared;
 };
 
 #endif
@@ -0,0 +1,203 @@
+#pragma once
+
+#include "camera.h"
+#include "colour.h"
+#include "common.h"
+#include "framebuffer.h"
+#include "hittable.h"
+#include "material.h"
+#include "sampling.h"
+#include "stats.h"
+#include "vec3.h"
+
+#include <functional>
+#include <optional>
+#include <vector>
+
+enum class render_mode {
+    path,      // one sample at a time, depth first
+    wavefront, // all samples of a tile at once, breadth first
+    adaptive   // path, stopping each pixel once its error is low enough
+};
+
+class render_checkpoint;
+
+// told of each tile as it's finished, on the thread that rendered it
+using tile_callback = std::function<void(const framebuffer& image, const tile_bounds& tile, long samples)>;
+
+struct render_settings {
+    int image_width;
+    int image_height;
+    int samples_per_pixel;
+    int max_depth;
+    uint64_t seed;
+    render_mode mode;
+    double adaptive_threshold; // relative standard error target
+    bool progress;             // report finished tiles on stderr
+    sample_pattern pattern;
+    int first_sample;          // index of the first sample, so passes continue the sequence
+    feature_buffers* features = nullptr; // filled in for the denoiser when given
+    render_checkpoint* checkpoint = nullptr; // finished tiles are committed to it, and tiles it holds skipped
+    const tile_callback* tile_done = nullptr;
+    tile_bounds region = {0, 0, 0, 0};      // the pixels to render, all of them when empty
+};
+
+// a camera ray's first hit, which the denoiser finds edges by
+struct first_hit {
+    colour albedo; // the surface's, or the sky's on a miss
+    vec3 normal;   // zero on a miss
+    real depth;    // distance to the hit, zero on a miss
+};
+
+// a pixel's first hits and sample luminances summed, for its feature pixels
+struct feature_sum {
+    colour albedo = colour(0, 0, 0);
+    vec3 normal = vec3(0, 0, 0);
+    real depth = 0;
+    int hits = 0;
+    double luminance_sum = 0;
+    double luminance_squared = 0;
+    int samples = 0;
+
+    void add_hit(const first_hit& hit) {
+	albedo += hit.albedo;
+	normal += hit.normal;
+	depth += hit.depth;
+	hits++;
+    }
+
+    void add_sample(const colour& c) {
+	const double l = luminance(c);
+	luminance_sum += l;
+	luminance_squared += l * l;
+	samples++;
+    }
+
+    // averaged albedo with the variance of the pixel's mean luminance
+    pixel albedo_pixel() const {
+	const double n = hits > 0 ? hits : 1;
+	const double m = samples > 0 ? samples : 1;
+	const double mean = luminance_sum / m;
+	const double variance = fmax(0.0, luminance_squared / m - mean * mean) / m;
+	return {float(albedo.x() / n), float(albedo.y() / n), float(albedo.z() / n), float(variance)};
+    }
+
+    pixel normal_pixel() const {
+	const double n = hits > 0 ? hits : 1;
+	return {float(normal.x() / n), float(normal.y() / n), float(normal.z() / n), float(depth / n)};
+    }
+};
+
+// a tile's feature pixels, gathered in scratch and committed like its colours
+class feature_tile {
+    public:
+	feature_tile(arena& scratch, const tile_bounds& tile) : albedo(scratch, tile), normal(scratch, tile) {}
+
+	void set(int x, int y, const feature_sum& f) {
+	    albedo.set(x, y, f.albedo_pixel());
+	    normal.set(x, y, f.normal_pixel());
+	}
+
+	void commit(feature_buffers& features) const {
+	    albedo.commit(features.albedo);
+	    normal.commit(features.normal);
+	}
+
+    private:
+	tile_buffer albedo;
+	tile_buffer normal;
+};
+
+inline colour sky_colour(const ray& r) {
+    vec3 unit_direction = unit_vector(r.direction());
+    auto t = 0.5*(unit_direction.y() + 1.0);
+    return (1.0-t)*colour(1.0, 1.0, 1.0) + t*colour(0.5, 0.7, 1.0);
+}
+
+// bounces before russian roulette may end a path
+const int roulette_depth = 3;
+
+// randomly end low throughput paths, reweighting survivors to stay unbiased
+inline bool survives_roulette(colour& throughput, int bounce) {
+    if (bounce < roulette_depth) return true;
+
+    auto p = fmin(fmax(throughput.x(), fmax(throughput.y(), throughput.z())), 0.95);
+    thread_sampler().start_bounce(bounce, sampler::bounce_dimensions - 1);
+    if (sample_1d() >= p) return false;
+
+    throughput /= p;
+    return true;
+}
+
+// first, when given, receives the camera ray's hit
+colour ray_colour(const ray& r, const hittable& world, int max_depth, first_hit* first = nullptr) {
+    hit_record rec;
+    ray current = r;
+    colour throughput(1, 1, 1);
+
+    for (int bounce = 0; bounce < max_depth; bounce++) {
+	STAT_INC(rays);
+	if (!world.hit(current, 0.001, infinity, rec)) {
+	    STAT_PATH(bounce + 1);
+	    if (first && bounce == 0) *first = {sky_colour(current), vec3(0, 0, 0), 0};
+	    return throughput * sky_colour(current);
+	}
+	if (first && bounce == 0) *first = {rec.mat_ptr->albedo, rec.normal, rec.t * current.direction().length()};
+
+	ray scattered;
+	colour attenuation;
+	thread_sampler().start_bounce(bounce);
+	if (!rec.mat_ptr->scatter(current, rec, attenuation, scattered)) {
+	    STAT_PATH(bounce + 1);
+	    return colour(0, 0, 0);
+	}
+
+	throughput = throughput * attenuation;
+	if (!survives_roulette(throughput, bounce)) {
+	    STAT_PATH(bounce + 1);
+	    return colour(0, 0, 0);
+	}
+
+	current = scattered;
+    }
+
+    STAT_PATH(max_depth);
+    return colour(0, 0, 0);
+}
+
+void render_tile_path(framebuffer& image, const camera& cam, const hittable& world, const render_settings& settings, const tile_bounds& tile) {
+    const int image_width = settings.image_width;
+    const int image_height = settings.image_height;
+    tile_buffer pixels(thread_scratch(), tile);
+    std::optional<feature_tile> features;
+    if (settings.features) features.emplace(thread_scratch(), tile);
+
+    for (int y = tile.start_y; y < tile.end_y; y++) {
+	for (int x = tile.start_x; x < tile.end_x; x++) {
+	    colour pixel_colour(0, 0, 0);
+	    feature_sum pixel_features;
+	    first_hit hit;
+	    sampler& samples = thread_sampler();
+	    samples.start_pixel(settings.pattern, settings.seed, x, y, image_width);
+	    for (int s = 0; s < settings.samples_per_pixel; s++) {
+		samples.start_sample(settings.first_sample + s);
+		auto u = double(x + sample_1d()) / (image_width - 1);
+		auto v = 1.0 - double(y + sample_1d()) / (image_height - 1);
+		ray r = cam.get_ray(u, v);
+		if (!features) {
+		    pixel_colour += ray_colour(r, world, settings.max_depth);
+		    continue;
+		}
+
+		const colour c = ray_colour(r, world, settings.max_depth, &hit);
+		pixel_colour += c;
+		pixel_features.add_hit(hit);
+		pixel_features.add_sample(c);
+	    }
+	    pixels.set(x, y, pixel_colour / settings.samples_per_pixel);
+	    if (features) features->set(x, y, pixel_features);
+	}
+    }
+    pixels.commit(image);
+    if (features) features->commit(*settings.features);
+}
@@ -0,0 +1,224 @@
+#pragma once
+
+#include "common.h"
+#include "low_discrepancy.h"
+#include "simd.h"
+#include "stats.h"
+#include "vec3.h"
+
+#include <cmath>
+#include <string>
+
+// sample generation for paths
+//
+// the warps below map a fixed number of uniform inputs straight onto their
+// domain, with no rejection loop and no data dependent branch. they are
+// templated on the lane type, so the same code runs on real and on vreal
+
+// sin and cos for |x| <= pi/4, where the truncated series are good to ~1e-11
+template <typename T>
+inline void sincos_octant(T x, T& s, T& c) {
+    auto k = [](double v) { return splat<T>(v); };
+    const T x2 = x * x;
+    s = x * (k(1) + x2 * (k(-1.0/6) + x2 * (k(1.0/120) + x2 * (k(-1.0/5040)
+	+ x2 * (k(1.0/362880) + x2 * k(-1.0/39916800))))));
+    c = k(1) + x2 * (k(-1.0/2) + x2 * (k(1.0/24) + x2 * (k(-1.0/720)
+	+ x2 * (k(1.0/40320) + x2 * (k(-1.0/3628800) + x2 * k(1.0/479001600))))));
+}
+
+// shirley and chiu's concentric map from the unit square onto the unit disk
+template <typename T>
+inline void concentric_disk(T u1, T u2, T& x, T& y) {
+    const T one = splat<T>(1);
+    const T a = splat<T>(2) * u1 - one;
+    const T b = splat<T>(2) * u2 - one;
+    const T abs_a = vmax(a, splat<T>(0) - a);
+    const T abs_b = vmax(b, splat<T>(0) - b);
+
+    // the larger coordinate is the radius, the ratio picks the angle in its octant
+    const auto major = abs_a >= abs_b;
+    const T r = select(major, a, b);
+    const T denom = select(vmax(abs_a, abs_b) <= splat<T>(0), one, r);
+    const T phi = splat<T>(pi / 4) * (select(major, b, a) / denom);
+
+    T s, c;
+    sincos_octant(phi, s, c);
+    x = r * select(major, c, s);
+    y = r * select(major, s, c);
+}
+
+// uniform on the unit sphere, lifted from the disk so no trig is needed
+template <typename T>
+inline void uniform_sphere(T u1, T u2, T& x, T& y, T& z) {
+    T dx, dy;
+    concentric_disk(u1, u2, dx, dy);
+    const T r2 = dx * dx + dy * dy;
+    const T scale = splat<T>(2) * vsqrt(vmax(splat<T>(0), splat<T>(1) - r2));
+    x = dx * scale;
+    y = dy * scale;
+    z = splat<T>(1) - splat<T>(2) * r2;
+}
+
+// cosine weighted about +z, projecting the disk up onto the hemisphere
+template <typename T>
+inline void cosine_hemisphere(T u1, T u2, T& x, T& y, T& z) {
+    concentric_disk(u1, u2, x, y);
+    z = vsqrt(vmax(splat<T>(0), splat<T>(1) - x * x - y * y));
+}
+
+// uniform in the unit ball. the largest of three uniforms has density 3r^2,
+// which is exactly the radial density needed
+template <typename T>
+inline void uniform_ball(T u1, T u2, T u3, T u4, T u5, T& x, T& y, T& z) {
+    uniform_sphere(u1, u2, x, y, z);
+    const T r = vmax(u3, vmax(u4, u5));
+    x = x * r;
+    y = y * r;
+    z = z * r;
+}
+
+enum class sample_pattern {
+    random,    // independent white noise
+    sobol,     // owen scrambled sobol, scrambled per pixel
+    blue_noise // one scrambled sobol sequence, shifted per pixel by a blue noise mask
+};
+
+inline bool parse_sample_pattern(const std::string& name, sample_pattern& pattern) {
+    if (name == "random") pattern = sample_pattern::random;
+    else if (name == "sobol") pattern = sample_pattern::sobol;
+    else if (name == "bluenoise") pattern = sample_pattern::blue_noise;
+    else return false;
+    return true;
+}
+
+// the uniform inputs a path draws, numbered by pixel, sample and dimension.
+// a path asks for its dimensions in the same order every run, so a sample
+// is the same whichever renderer or pass draws it
+class sampler {
+    public:
+	// the pixel jitter and lens take the first dimensions, then each bounce
+	// owns a block, so dimension d means the same thing for every sample of
+	// a pixel whatever the earlier bounces hit
+	static const int camera_dimensions = 4;
+	static const int bounce_dimensions = 8;
+
+	void start_pixel(sample_pattern p, uint64_t seed, int x, int y, int image_width) {
+	    pattern = p;
+	    frame_seed = seed;
+	    pixel_seed = hash_seed(seed, static_cast<uint64_t>(image_width) * y + x);
+	    pixel_x = x;
+	    pixel_y = y;
+	}
+
+	void start_sample(uint64_t sample) {
+	    index = sample;
+	    dimension = 0;
+	    if (pattern == sample_pattern::random) generator.reseed(hash_seed(pixel_seed, sample));
+	}
+
+	void start_bounce(int bounce, int offset = 0) {
+	    dimension = camera_dimensions + bounce * bounce_dimensions + offset;
+	}
+
+	double get_1d() {
+	    STAT_INC(sample_draws);
+	    const int d = dimension++;
+
+	    switch (pattern) {
+		case sample_pattern::sobol:
+		    return sobol_sample(static_cast<uint32_t>(index), d, pixel_seed);
+		case sample_pattern::blue_noise: {
+		    // a toroidal shift per dimension, read from a different spot in the mask
+		    const double shift = blue_noise_mask::get().at(pixel_x + 23 * d, pixel_y + 41 * d);
+		    const double u = sobol_sample(static_cast<uint32_t>(index), d, frame_seed) + shift;
+		    return u < 1 ? u : u - 1;
+		}
+		case sample_pattern::random:
+		    break;
+	    }
+	    return generator.next_double();
+	}
+
+    public:
+	sample_pattern pattern = sample_pattern::random;
+	rng generator;
+	uint64_t frame_seed = 0;
+	uint64_t pixel_seed = 0;
+	uint64_t index = 0;
+	int pixel_x = 0;
+	int pixel_y = 0;
+	int dimension = 0;
+};
+
+inline sampler& thread_sampler() {
+    thread_local sampler s;
+    return s;
+}
+
+inline double sample_1d() {
+    return thread_sampler().get_1d();
+}
+
+inline void sample_2d(real& u, real& v) {
+    u = sample_1d();
+    v = sample_1d();
+}
+
+// orthonormal tangents around a unit normal, without a branch (duff et al. 2017)
+inline void tangent_frame(const vec3& n, vec3& t, vec3& b) {
+    const real sign = std::copysign(real(1), n.z());
+    const real a = -1 / (sign + n.z());
+    const real c = n.x() * n.y() * a;
+    t = vec3(1 + sign * n.x() * n.x() * a, sign * c, -sign * n.x());
+    b = vec3(c, sign + n.y() * n.y() * a, -n.y());
+}
+
+inline vec3 sample_cosine_hemisphere(const vec3& normal) {
+    real u1, u2, x, y, z;
+    sample_2d(u1, u2);
+    cosine_hemisphere(u1, u2, x, y, z);
+    vec3 t, b;
+    tangent_frame(normal, t, b);
+    return x * t + y * b + z * normal;
+}
+
+inline vec3 sample_unit_ball() {
+    real u1, u2, u3, u4, u5, x, y, z;
+    sample_2d(u1, u2);
+    sample_2d(u3, u4);
+    u5 = sample_1d();
+    uniform_ball(u1, u2, u3, u4, u5, x, y, z);
+    return vec3(x, y, z);
+}
+
+inline vec3 sample_unit_disk() {
+    real u1, u2, x, y;
+    sample_2d(u1, u2);
+    concentric_disk(u1, u2, x, y);
+    return vec3(x, y, 0);
+}
+
+// the same warps driven by the thread rng, for building scenes
+
+inline vec3 random_in_unit_sphere() {
+    real x, y, z;
+    uniform_ball<real>(random_double(), random_double(), random_double(), random_double(), random_double(), x, y, z);
+    return vec3(x, y, z);
+}
+
+inline vec3 random_unit_vector() {
+    real x, y, z;
+    uniform_sphere<real>(random_double(), random_double(), x, y, z);
+    return vec3(x, y, z);
+}
+
+inline vec3 random_in_hemisphere(const vec3& normal) {
+    vec3 on_sphere = random_unit_vector();
+    return dot(on_sphere, normal) > 0.0 ? on_sphere : -on_sphere;
+}
+
+inline vec3 random_in_unit_disk() {
+    real x, y;
+    concentric_disk<real>(random_double(), random_double(), x, y);
+    return vec3(x, y, 0);
+}
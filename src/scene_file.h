@@ -0,0 +1,648 @@
+#pragma once
+
+#include "aabb.h"
+#include "bvh.h"
+#include "camera.h"
+#include "common.h"
+#include "hittable.h"
+#include "instance.h"
+#include "material.h"
+#include "mesh.h"
+#include "sphere.h"
+#include "stats.h"
+#include "vec3.h"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// scene description files and their memory mapped binary cache
+//
+// a scene file is line based, # starts a comment:
+//
+//   camera lookfrom 12 2 3 lookat 0 0 0 vup 0 1 0 fov 20 aperture 0.1 focus 10 aspect 1.5
+//   material ground lambertian 0.2 0.6 0.7
+//   material steel metal 0.7 0.6 0.5 0.0
+//   material glass dielectric 1.5
+//   sphere 0 -1000 0 1000 ground
+//   mesh bunny.obj steel 0 0 0 45 2   # at x y z, turned 45 degrees about y, scaled by 2
+//
+// the first load compiles it to <file>.bin: fixed size records for the
+// camera and materials, a prebuilt BVH with leaves as wide as bvh makes
+// them, and the spheres in leaf order as the padded arrays sphere_set tests
+// a vector at a time. later loads map that file and traverse it in place
+// with bvh's walks and sphere_set's tests, so nothing is parsed or built.
+// meshes are referenced by path, relative to the scene file, and compiled
+// into caches of their own by load_mesh
+
+struct scene_camera_record {
+    double lookfrom[3];
+    double lookat[3];
+    double vup[3];
+    double vfov;
+    double aperture;
+    double focus_dist;
+    double aspect_ratio;
+};
+
+struct scene_material_record {
+    material_kind type;
+    uint32_t pad;
+    double albedo[3];
+    double param; // metal fuzz or dielectric index of refraction
+};
+
+struct scene_sphere_record {
+    double center[3];
+    double radius;
+    uint32_t material;
+    uint32_t pad;
+};
+
+struct scene_mesh_record {
+    char path[256];
+    uint32_t material;
+    uint32_t pad;
+    double offset[3];
+    double turn;
+    double scale;
+};
+
+struct scene_node_record {
+    double min[3];
+    double max[3];
+    int32_t offset; // as bvh_builder::node, leaves counting sphere slots
+    int32_t count;
+    int32_t axis;
+    int32_t pad;
+};
+
+inline aabb node_box(const scene_node_record& n) {
+    return aabb(point3(n.min[0], n.min[1], n.min[2]), point3(n.max[0], n.max[1], n.max[2]));
+}
+
+// the arrays of sphere slots, each leaf's padded to whole vectors with NaN
+// spheres as sphere_set pads its own
+enum scene_lane { lane_cx, lane_cy, lane_cz, lane_radius_squared, lane_inv_radius, lane_count };
+
+struct scene_cache_header {
+    static const uint32_t current_version = 4;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t real_size;  // sizeof(real) and vreal::width where it was written,
+    uint32_t lane_width; // which the slot arrays are laid out for
+    uint32_t material_count;
+    uint32_t sphere_count;
+    uint32_t slot_count; // the spheres and their leaves' padding
+    uint32_t node_count;
+    uint32_t mesh_count;
+    uint64_t materials_offset;
+    uint64_t lanes_offset; // lane_count arrays of slot_count reals, lane_stride bytes apart
+    uint64_t lane_stride;
+    uint64_t slot_materials_offset; // a material index per slot
+    uint64_t nodes_offset;
+    uint64_t meshes_offset;
+    cache_source source;
+    scene_camera_record camera;
+};
+
+const char scene_cache_magic[8] = {'T', 'R', 'S', 'C', 'E', 'N', 'E', 0};
+
+struct scene_description {
+    scene_camera_record camera = {{3, 3, 2}, {0, 0, -1}, {0, 1, 0}, 50, 0.1, 5.2, 16.0/9.0};
+    std::vector<scene_material_record> materials;
+    std::vector<scene_sphere_record> spheres;
+    std::vector<scene_mesh_record> meshes;
+};
+
+inline camera make_camera(const scene_camera_record& c) {
+    return camera(
+	point3(c.lookfrom[0], c.lookfrom[1], c.lookfrom[2]),
+	point3(c.lookat[0], c.lookat[1], c.lookat[2]),
+	vec3(c.vup[0], c.vup[1], c.vup[2]),
+	c.vfov, c.aspect_ratio, c.aperture, c.focus_dist);
+}
+
+inline shared_ptr<material> make_material(const scene_material_record& m) {
+    const colour albedo(m.albedo[0], m.albedo[1], m.albedo[2]);
+    switch (m.type) {
+	case material_kind::metal: return make_shared<metal>(albedo, m.param);
+	case material_kind::dielectric: return make_shared<dielectric>(m.param);
+	case material_kind::lambertian: break;
+    }
+    return make_shared<lambertian>(albedo);
+}
+
+bool parse_scene(const std::string& path, scene_description& scene, std::string& error) {
+    std::ifstream in(path);
+    if (!in) {
+	error = "cannot open " + path;
+	return false;
+    }
+
+    std::map<std::string, uint32_t> material_names;
+    std::string line;
+    int line_number = 0;
+
+    auto fail = [&](const std::string& what) {
+	error = path + ":" + std::to_string(line_number) + ": " + what;
+	return false;
+    };
+
+    while (std::getline(in, line)) {
+	line_number++;
+	line = line.substr(0, line.find('#'));
+
+	std::istringstream words(line);
+	std::string kind;
+	if (!(words >> kind)) continue;
+
+	if (kind == "camera") {
+	    auto& c = scene.camera;
+	    std::string key;
+	    while (words >> key) {
+		bool ok;
+		if (key == "lookfrom") ok = bool(words >> c.lookfrom[0] >> c.lookfrom[1] >> c.lookfrom[2]);
+		else if (key == "lookat") ok = bool(words >> c.lookat[0] >> c.lookat[1] >> c.lookat[2]);
+		else if (key == "vup") ok = bool(words >> c.vup[0] >> c.vup[1] >> c.vup[2]);
+		else if (key == "fov") ok = bool(words >> c.vfov);
+		else if (key == "aperture") ok = bool(words >> c.aperture);
+		else if (key == "focus") ok = bool(words >> c.focus_dist);
+		else if (key == "aspect") ok = bool(words >> c.aspect_ratio);
+		else return fail("unknown camera setting " + key);
+		if (!ok) return fail("bad value for camera " + key);
+	    }
+	} else if (kind == "material") {
+	    std::string name, type;
+	    scene_material_record m = {};
+	    if (!(words >> name >> type)) return fail("expected material <name> <type>");
+
+	    bool ok;
+	    if (type == "lambertian") {
+		m.type = material_kind::lambertian;
+		ok = bool(words >> m.albedo[0] >> m.albedo[1] >> m.albedo[2]);
+	    } else if (type == "metal") {
+		m.type = material_kind::metal;
+		ok = bool(words >> m.albedo[0] >> m.albedo[1] >> m.albedo[2] >> m.param);
+	    } else if (type == "dielectric") {
+		m.type = material_kind::dielectric;
+		ok = bool(words >> m.param);
+	    } else {
+		return fail("unknown material type " + type);
+	    }
+	    if (!ok) return fail("bad parameters for " + type + " material " + name);
+
+	    material_names[name] = static_cast<uint32_t>(scene.materials.size());
+	    scene.materials.push_back(m);
+	} else if (kind == "sphere") {
+	    scene_sphere_record s = {};
+	    std::string name;
+	    if (!(words >> s.center[0] >> s.center[1] >> s.center[2] >> s.radius >> name)) {
+		return fail("expected sphere <x> <y> <z> <radius> <material>");
+	    }
+
+	    auto m = material_names.find(name);
+	    if (m == material_names.end()) return fail("unknown material " + name);
+	    s.material = m->second;
+	    scene.spheres.push_back(s);
+	} else if (kind == "mesh") {
+	    scene_mesh_record record = {};
+	    std::string file, name;
+	    record.scale = 1;
+	    if (!(words >> file >> name >> record.offset[0] >> record.offset[1] >> record.offset[2])) {
+		return fail("expected mesh <file> <material> <x> <y> <z> [<turn> [<scale>]]");
+	    }
+	    if (words >> record.turn) words >> record.scale;
+	    if (file.size() >= sizeof(record.path)) return fail("mesh path too long");
+
+	    auto m = material_names.find(name);
+	    if (m == material_names.end()) return fail("unknown material " + name);
+	    std::memcpy(record.path, file.c_str(), file.size());
+	    record.material = m->second;
+	    scene.meshes.push_back(record);
+	} else {
+	    return fail("unknown entry " + kind);
+	}
+    }
+
+    return true;
+}
+
+inline uint64_t align_cache_offset(uint64_t offset) {
+    return (offset + 63) & ~uint64_t(63);
+}
+
+// build the BVH, on pool's threads when given, and write the scene in its binary layout
+bool write_scene_cache(const std::string& path, const scene_description& scene, const cache_source& source, std::string& error, worker_pool* pool = nullptr) {
+    std::vector<aabb> boxes;
+    boxes.reserve(scene.spheres.size());
+    for (const auto& s : scene.spheres) {
+	const point3 c(s.center[0], s.center[1], s.center[2]);
+	const vec3 extent(fabs(s.radius), fabs(s.radius), fabs(s.radius));
+	boxes.push_back(aabb(c - extent, c + extent));
+    }
+
+    bvh_builder builder(bvh::max_leaf_size, vreal::width);
+    builder.build(boxes, std::vector<bool>(boxes.size(), true), pool);
+
+    auto padded = [](int count) { return (count + vreal::width - 1) / vreal::width * vreal::width; };
+    uint64_t slot_count = 0;
+    for (const auto& n : builder.nodes) {
+	if (n.count > 0) slot_count += padded(n.count);
+    }
+
+    scene_cache_header header = {};
+    std::memcpy(header.magic, scene_cache_magic, sizeof(header.magic));
+    header.version = scene_cache_header::current_version;
+    header.real_size = sizeof(real);
+    header.lane_width = vreal::width;
+    header.material_count = static_cast<uint32_t>(scene.materials.size());
+    header.sphere_count = static_cast<uint32_t>(scene.spheres.size());
+    header.slot_count = static_cast<uint32_t>(slot_count);
+    header.node_count = static_cast<uint32_t>(builder.nodes.size());
+    header.mesh_count = static_cast<uint32_t>(scene.meshes.size());
+    header.source = source;
+    header.camera = scene.camera;
+    header.materials_offset = align_cache_offset(sizeof(header));
+    header.lanes_offset = align_cache_offset(header.materials_offset + header.material_count * sizeof(scene_material_record));
+    header.lane_stride = align_cache_offset(slot_count * sizeof(real));
+    header.slot_materials_offset = align_cache_offset(header.lanes_offset + lane_count * header.lane_stride);
+    header.nodes_offset = align_cache_offset(header.slot_materials_offset + slot_count * sizeof(uint32_t));
+    header.meshes_offset = align_cache_offset(header.nodes_offset + header.node_count * sizeof(scene_node_record));
+    const uint64_t size = header.meshes_offset + header.mesh_count * sizeof(scene_mesh_record);
+
+    std::vector<char> bytes(size, 0);
+    std::memcpy(&bytes[0], &header, sizeof(header));
+    if (!scene.materials.empty()) {
+	std::memcpy(&bytes[header.materials_offset], scene.materials.data(), header.material_count * sizeof(scene_material_record));
+    }
+    if (!scene.meshes.empty()) {
+	std::memcpy(&bytes[header.meshes_offset], scene.meshes.data(), header.mesh_count * sizeof(scene_mesh_record));
+    }
+
+    // each leaf's spheres copied to its run of slots, the rest of the run
+    // padding that never hits
+    real* lanes[lane_count];
+    for (int l = 0; l < lane_count; l++) {
+	lanes[l] = reinterpret_cast<real*>(&bytes[header.lanes_offset + l * header.lane_stride]);
+    }
+    auto slot_materials = reinterpret_cast<uint32_t*>(&bytes[header.slot_materials_offset]);
+    auto nodes = reinterpret_cast<scene_node_record*>(&bytes[header.nodes_offset]);
+    const real nan = std::numeric_limits<real>::quiet_NaN();
+    int slot = 0;
+    for (size_t i = 0; i < builder.nodes.size(); i++) {
+	const auto& n = builder.nodes[i];
+	nodes[i] = {
+	    {n.box.min().x(), n.box.min().y(), n.box.min().z()},
+	    {n.box.max().x(), n.box.max().y(), n.box.max().z()},
+	    n.offset, n.count, n.axis, 0
+	};
+	if (n.count == 0) continue;
+
+	nodes[i].offset = slot;
+	nodes[i].count = padded(n.count);
+	for (int k = 0; k < nodes[i].count; k++, slot++) {
+	    for (int l = 0; l < lane_count; l++) lanes[l][slot] = nan;
+	    slot_materials[slot] = 0;
+	    if (k >= n.count) continue;
+
+	    const scene_sphere_record& s = scene.spheres[builder.order[n.offset + k]];
+	    const real radius = static_cast<real>(s.radius);
+	    lanes[lane_cx][slot] = static_cast<real>(s.center[0]);
+	    lanes[lane_cy][slot] = static_cast<real>(s.center[1]);
+	    lanes[lane_cz][slot] = static_cast<real>(s.center[2]);
+	    lanes[lane_radius_squared][slot] = radius * radius;
+	    lanes[lane_inv_radius][slot] = 1 / radius;
+	    slot_materials[slot] = s.material;
+	}
+    }
+
+    // write beside the target and rename, so concurrent readers see whole files only
+    const std::string temp = path + ".tmp" + std::to_string(getpid());
+    {
+	std::ofstream out(temp, std::ios::binary);
+	out.write(bytes.data(), bytes.size());
+	if (!out) {
+	    error = "cannot write " + temp;
+	    return false;
+	}
+    }
+    if (std::rename(temp.c_str(), path.c_str()) != 0) {
+	error = "cannot rename " + temp + " to " + path;
+	return false;
+    }
+
+    return true;
+}
+
+// a compiled scene traversed straight out of its memory mapping
+class mapped_scene : public hittable {
+    public:
+	mapped_scene() {}
+	~mapped_scene() { unmap(); }
+
+	mapped_scene(const mapped_scene&) = delete;
+	mapped_scene& operator=(const mapped_scene&) = delete;
+
+	bool open(const std::string& path, std::string& error);
+
+	// swap the mapping, and those of the meshes, for copies first touched by
+	// the calling thread, so a thread pinned to a numa node puts the scene in
+	// that node's memory rather than sharing the page cache's
+	void localize();
+
+	camera make_camera() const { return ::make_camera(header->camera); }
+	double aspect_ratio() const { return header->camera.aspect_ratio; }
+	int size() const { return static_cast<int>(header->sphere_count); }
+	bool compiled_from(const cache_source& source) const { return header && header->source == source; }
+
+	virtual bool hit(
+		const ray& r, real t_min, real t_max, hit_record& rec) const override;
+
+	virtual bool intersect(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+	virtual void complete(const ray& r, hit_record& rec) const override;
+
+	virtual bool bounding_box(aabb& output_box) const override;
+
+	virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+
+    private:
+	// a leaf's slots, as sphere_set hands its own to the vector tests
+	sphere_lanes leaf(const scene_node_record& n) const {
+	    return {lanes[lane_cx] + n.offset, lanes[lane_cy] + n.offset, lanes[lane_cz] + n.offset, lanes[lane_radius_squared] + n.offset, n.count};
+	}
+
+	void point_at(const char* base);
+	bool check();
+	void unmap();
+
+	void* mapping = nullptr;
+	size_t mapping_size = 0;
+	std::vector<unsigned char> owned;
+	const scene_cache_header* header = nullptr;
+	const real* lanes[lane_count] = {};
+	const uint32_t* slot_materials = nullptr;
+	const scene_node_record* nodes = nullptr;
+	std::vector<shared_ptr<material>> materials;
+	std::vector<shared_ptr<hittable>> meshes; // placed instances, tested before the sphere bvh
+};
+
+bool mapped_scene::open(const std::string& path, std::string& error) {
+    unmap();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+	error = "cannot open " + path;
+	return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(scene_cache_header))) {
+	::close(fd);
+	error = path + " is not a scene cache";
+	return false;
+    }
+
+    mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+	mapping = nullptr;
+	error = "cannot map " + path;
+	return false;
+    }
+    mapping_size = st.st_size;
+
+    const char* base = static_cast<const char*>(mapping);
+    header = reinterpret_cast<const scene_cache_header*>(base);
+    if (std::memcmp(header->magic, scene_cache_magic, sizeof(header->magic)) != 0
+	|| header->version != scene_cache_header::current_version
+	|| !check()) {
+	unmap();
+	error = path + " is not a current scene cache";
+	return false;
+    }
+
+    const auto records = reinterpret_cast<const scene_material_record*>(base + header->materials_offset);
+    for (uint32_t i = 0; i < header->material_count; i++) {
+	materials.push_back(make_material(records[i]));
+    }
+
+    // mesh paths are relative to the scene, which the cache sits beside
+    const std::string directory = path.find('/') == std::string::npos ? "." : path.substr(0, path.rfind('/'));
+    const auto mesh_records = reinterpret_cast<const scene_mesh_record*>(base + header->meshes_offset);
+    for (uint32_t i = 0; i < header->mesh_count; i++) {
+	const scene_mesh_record& m = mesh_records[i];
+	const std::string file(m.path, strnlen(m.path, sizeof(m.path)));
+	auto mesh = make_shared<triangle_mesh>(materials[m.material]);
+	if (!load_mesh(file[0] == '/' ? file : directory + "/" + file, *mesh, error)) {
+	    unmap();
+	    return false;
+	}
+
+	const transform placement(vec3(m.offset[0], m.offset[1], m.offset[2]), m.turn, m.scale);
+	meshes.push_back(make_shared<instance>(mesh, placement));
+    }
+
+    return true;
+}
+
+void mapped_scene::point_at(const char* base) {
+    header = reinterpret_cast<const scene_cache_header*>(base);
+    for (int l = 0; l < lane_count; l++) {
+	lanes[l] = reinterpret_cast<const real*>(base + header->lanes_offset + l * header->lane_stride);
+    }
+    slot_materials = reinterpret_cast<const uint32_t*>(base + header->slot_materials_offset);
+    nodes = reinterpret_cast<const scene_node_record*>(base + header->nodes_offset);
+}
+
+// whether the mapped header's arrays fit the file and every index in them,
+// slot materials and bvh node offsets, counts and depth, stays within the
+// arrays it indexes, so traversal never leaves the mapping. points the
+// arrays into the mapping as it goes
+bool mapped_scene::check() {
+    auto fits = [&](uint64_t offset, uint64_t count, uint64_t record) {
+	return offset % alignof(double) == 0 && offset <= mapping_size && count <= (mapping_size - offset) / record;
+    };
+    if (header->real_size != sizeof(real) || header->lane_width != vreal::width
+	|| header->sphere_count > header->slot_count
+	|| header->lane_stride % alignof(real) != 0 || header->lane_stride / sizeof(real) < header->slot_count
+	|| !fits(header->materials_offset, header->material_count, sizeof(scene_material_record))
+	|| !fits(header->lanes_offset, lane_count * header->lane_stride, 1)
+	|| !fits(header->slot_materials_offset, header->slot_count, sizeof(uint32_t))
+	|| !fits(header->nodes_offset, header->node_count, sizeof(scene_node_record))
+	|| !fits(header->meshes_offset, header->mesh_count, sizeof(scene_mesh_record))) {
+	return false;
+    }
+
+    point_at(reinterpret_cast<const char*>(header));
+    const auto mesh_records = reinterpret_cast<const scene_mesh_record*>(reinterpret_cast<const char*>(header) + header->meshes_offset);
+
+    for (uint32_t i = 0; i < header->slot_count; i++) {
+	if (slot_materials[i] >= header->material_count) return false;
+    }
+    for (uint32_t i = 0; i < header->mesh_count; i++) {
+	if (mesh_records[i].material >= header->material_count) return false;
+    }
+
+    // children follow their parents, so one pass in order gives every depth.
+    // a node reached twice could sit deeper than its depth says, so the
+    // records must form a tree. leaves are whole vectors of slots
+    const int64_t node_count = header->node_count, slot_count = header->slot_count;
+    std::vector<int> depth(node_count, -1);
+    if (node_count > 0) depth[0] = 0;
+    for (int64_t i = 0; i < node_count; i++) {
+	const scene_node_record& n = nodes[i];
+	if (depth[i] < 0 || depth[i] > bvh_builder::max_depth) return false;
+	if (n.count > 0) {
+	    if (n.offset < 0 || n.offset % vreal::width != 0 || n.count % vreal::width != 0
+		|| n.count > slot_count || n.offset > slot_count - n.count) return false;
+	} else {
+	    if (n.count < 0 || n.axis < 0 || n.axis > 2 || n.offset <= i + 1 || n.offset >= node_count) return false;
+	    if (depth[i + 1] != -1 || depth[n.offset] != -1) return false;
+	    depth[i + 1] = depth[n.offset] = depth[i] + 1;
+	}
+    }
+    return true;
+}
+
+void mapped_scene::localize() {
+    if (mapping) {
+	const auto base = static_cast<const unsigned char*>(mapping);
+	owned.assign(base, base + mapping_size);
+	munmap(mapping, mapping_size);
+	mapping = nullptr;
+
+	point_at(reinterpret_cast<const char*>(owned.data()));
+    }
+
+    for (const auto& placed : meshes) {
+	auto mesh = std::dynamic_pointer_cast<triangle_mesh>(static_cast<instance*>(placed.get())->object);
+	if (mesh) mesh->localize();
+    }
+}
+
+void mapped_scene::unmap() {
+    if (mapping) munmap(mapping, mapping_size);
+    mapping = nullptr;
+    owned.clear();
+    header = nullptr;
+    materials.clear();
+    meshes.clear();
+}
+
+void mapped_scene::complete(const ray& r, hit_record& rec) const {
+    const point3 center(lanes[lane_cx][rec.part], lanes[lane_cy][rec.part], lanes[lane_cz][rec.part]);
+    rec.p = r.at(rec.t);
+    vec3 outward_normal = (rec.p - center) * lanes[lane_inv_radius][rec.part];
+    rec.set_face_normal(r, outward_normal);
+}
+
+bool mapped_scene::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    if (!intersect(r, t_min, t_max, rec)) return false;
+    complete_hit(r, rec);
+    rec.source = nullptr;
+    return true;
+}
+
+bool mapped_scene::intersect(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    if (!header) return false;
+
+    bool hit_anything = false;
+    auto closest_so_far = t_max;
+
+    for (const auto& mesh : meshes) {
+	if (mesh->intersect(r, t_min, closest_so_far, rec)) {
+	    hit_anything = true;
+	    closest_so_far = rec.t;
+	}
+    }
+    if (header->node_count == 0) return hit_anything;
+
+    // the nearest slot, put in rec once the walk is done
+    int nearest = -1;
+    bvh_nearest(nodes, r, t_min, closest_so_far, [&](const scene_node_record& n, real& closest) {
+	STAT_ADD(primitive_tests, n.count);
+	real t;
+	int slot;
+	if (!nearest_sphere(leaf(n), r, t_min, closest, t, slot)) return false;
+	closest = t;
+	nearest = n.offset + slot;
+	return true;
+    });
+    if (nearest < 0) return hit_anything;
+
+    rec.t = closest_so_far;
+    rec.mat_ptr = materials[slot_materials[nearest]].get();
+    rec.source = this;
+    rec.part = nearest;
+    return true;
+}
+
+bool mapped_scene::occluded(const ray& r, real t_min, real t_max) const {
+    if (!header) return false;
+
+    for (const auto& mesh : meshes) {
+	if (mesh->occluded(r, t_min, t_max)) return true;
+    }
+    if (header->node_count == 0) return false;
+
+    return bvh_any(nodes, r, t_min, t_max, [&](const scene_node_record& n) {
+	STAT_ADD(primitive_tests, n.count);
+	return any_sphere(leaf(n), r, t_min, t_max);
+    });
+}
+
+bool mapped_scene::bounding_box(aabb& output_box) const {
+    if (!header) return false;
+
+    aabb bounds;
+    if (header->node_count > 0) {
+	const auto& n = nodes[0];
+	bounds = aabb(point3(n.min[0], n.min[1], n.min[2]), point3(n.max[0], n.max[1], n.max[2]));
+    }
+    for (const auto& mesh : meshes) {
+	aabb box;
+	if (mesh->bounding_box(box)) bounds.expand(box);
+    }
+
+    output_box = bounds;
+    return !bounds.empty();
+}
+
+// map the cache for a scene file, compiling it first if it's missing or was
+// compiled from another version of the file.
+// a path to a .bin cache is mapped as is
+bool load_scene(const std::string& path, mapped_scene& scene, std::string& error, worker_pool* pool = nullptr) {
+    const std::string suffix = ".bin";
+    if (path.size() > suffix.size() && path.compare(path.size() - suffix.size(), suffix.size(), suffix) == 0) {
+	return scene.open(path, error);
+    }
+
+    const std::string cache = path + suffix;
+    cache_source source;
+    if (!stat_source(path, source)) {
+	error = "cannot open " + path;
+	return false;
+    }
+
+    std::string ignored;
+    if (scene.open(cache, ignored) && scene.compiled_from(source)) {
+	return true;
+    }
+
+    scene_description description;
+    if (!parse_scene(path, description, error)) return false;
+    if (!write_scene_cache(cache, description, source, error, pool)) return false;
+    return scene.open(cache, error);
+}
@@ -0,0 +1,179 @@
+#pragma once
+
+#include "bvh.h"
+#include "camera.h"
+#include "common.h"
+#include "hittable_list.h"
+#include "instance.h"
+#include "material.h"
+#include "sphere.h"
+#include "vec3.h"
+
+#include <memory>
+
+void three_balls(hittable_list& world, camera& cam, double aspect_ratio) {
+    auto material_ground = world.make<lambertian>(colour(0.8, 0.8, 0.0));
+    auto material_center = world.make<lambertian>(colour(0.1, 0.2, 0.5));
+    auto material_left   = world.make<dielectric>(1.5);
+    auto material_right  = world.make<metal>(colour(0.8, 0.6, 0.2), 0.0);
+
+    world.add(world.make<sphere>(point3( 0.0, -100.5, -1.0), 100.0, material_ground));
+    world.add(world.make<sphere>(point3( 0.0,    0.0, -1.0),   0.5, material_center));
+    world.add(world.make<sphere>(point3(-1.0,    0.0, -1.0),   0.5, material_left));
+    world.add(world.make<sphere>(point3(-1.0,    0.0, -1.0),  -0.4, material_left));
+    world.add(world.make<sphere>(point3( 1.0,    0.0, -1.0),   0.5, material_right));
+
+    point3 lookfrom(3, 3, 2);
+    point3 lookat(0, 0, -1);
+    vec3 vup(0, 1, 0);
+    auto fov = 20;
+    auto dist_to_focus = (lookfrom-lookat).length();
+    auto aperture = 2.0;
+
+    cam = camera(lookfrom, lookat, vup, fov, aspect_ratio, aperture, dist_to_focus);
+}
+
+void two_balls(hittable_list& world, camera& cam, double aspect_ratio) {
+    auto R = cos(pi/4);
+    auto material_left = world.make<lambertian>(colour(0, 0, 1));
+    auto material_right = world.make<lambertian>(colour(1, 0, 0));
+
+    world.add(world.make<sphere>(point3(-R, 0, -1), R, material_left));
+    world.add(world.make<sphere>(point3( R, 0, -1), R, material_right));
+
+    point3 lookfrom(0, 0, 0);
+    point3 lookat(0, 0, -1);
+    vec3 vup(0, 1, 0);
+    auto fov = 90;
+    auto dist_to_focus = (lookfrom-lookat).length();
+    auto aperture = 0;
+
+    cam = camera(lookfrom, lookat, vup, fov, aspect_ratio, aperture, dist_to_focus);
+}
+
+void random_balls(hittable_list& world, camera& cam, double& aspect_ratio) {
+    auto ground_mat = world.make<lambertian>(colour(0.2, 0.6, 0.7));
+    world.add(world.make<sphere>(point3(0, -1000, 0), 1000, ground_mat));
+    
+    for (int a = -11; a < 11; a++) {
+	for (int b = -11; b < 11; b++) {
+	    auto choose_mat = random_double();
+	    point3 center(a + 0.9*random_double(), 0.2, b + 0.9*random_double());
+
+	    if ((center - point3(4, 0.2, 0)).length() > 0.9) {
+		shared_ptr<material> sphere_mat;
+
+		if (choose_mat < 0.8) {
+		    // diffuse
+		    auto albedo = colour::random() * colour::random();
+		    sphere_mat = world.make<lambertian>(albedo);
+		    world.add(world.make<sphere>(center, 0.2, sphere_mat));
+		} else if (choose_mat < 0.95) {
+		    // metal
+		    auto albedo = colour::random(0.5, 1);
+		    auto fuzz = random_double(0, 0.5);
+		    sphere_mat = world.make<metal>(albedo, fuzz);
+		    world.add(world.make<sphere>(center, 0.2, sphere_mat));
+		} else {
+		    // glass
+		    sphere_mat = world.make<dielectric>(1.5);
+		    world.add(world.make<sphere>(center, 0.2, sphere_mat));
+		}
+	    }
+	}
+    }
+
+    auto material1 = world.make<dielectric>(1.5);
+    world.add(world.make<sphere>(point3(0, 1, 0), 1.0, material1));
+    
+    auto material2 = world.make<lambertian>(colour(0.4, 0.2, 0.1));
+    world.add(world.make<sphere>(point3(-4, 1, 0), 1.0, material2));
+
+    auto material3 = world.make<metal>(colour(0.7, 0.6, 0.5), 0.0);
+    world.add(world.make<sphere>(point3(4, 1, 0), 1.0, material3));
+
+    aspect_ratio = 3.0/2.0;
+
+    point3 lookfrom(12, 2, 3);
+    point3 lookat(0, 0, 0);
+    vec3 vup(0, 1, 0);
+    auto fov = 20;
+    auto dist_to_focus = 10;
+    auto aperture = 0.1;
+
+    cam = camera(lookfrom, lookat, vup, fov, aspect_ratio, aperture, dist_to_focus);
+}
+
+// synthetic stress scene, count small spheres scattered around random_balls'
+// camera at roughly the same density
+void large_balls(hittable_list& world, camera& cam, double& aspect_ratio, int count) {
+    auto ground_mat = world.make<lambertian>(colour(0.2, 0.6, 0.7));
+    world.add(world.make<sphere>(point3(0, -1000, 0), 1000, ground_mat));
+
+    const double extent = sqrt(double(count)) / 2;
+    for (int i = 0; i < count; i++) {
+	auto choose_mat = random_double();
+	point3 center(random_double(-extent, extent), 0.2, random_double(-extent, extent));
+	shared_ptr<material> sphere_mat;
+
+	if (choose_mat < 0.8) {
+	    sphere_mat = world.make<lambertian>(colour::random() * colour::random());
+	} else if (choose_mat < 0.95) {
+	    sphere_mat = world.make<metal>(colour::random(0.5, 1), random_double(0, 0.5));
+	} else {
+	    sphere_mat = world.make<dielectric>(1.5);
+	}
+	world.add(world.make<sphere>(center, 0.2, sphere_mat));
+    }
+
+    aspect_ratio = 3.0/2.0;
+
+    point3 lookfrom(12, 2, 3);
+    point3 lookat(0, 0, 0);
+    vec3 vup(0, 1, 0);
+    auto fov = 20;
+    auto dist_to_focus = 10;
+    auto aperture = 0.1;
+
+    cam = camera(lookfrom, lookat, vup, fov, aspect_ratio, aperture, dist_to_focus);
+}
+
+// count copies of one small cluster of spheres, scattered like large_balls.
+// the cluster and its bvh exist once however many times it is placed
+void instanced_balls(hittable_list& world, camera& cam, double& aspect_ratio, int count) {
+    auto ground_mat = world.make<lambertian>(colour(0.2, 0.6, 0.7));
+    world.add(world.make<sphere>(point3(0, -1000, 0), 1000, ground_mat));
+
+    // a ring around a larger middle sphere, all resting on y = 0
+    hittable_list cluster;
+    cluster.storage = world.storage;
+    cluster.add(cluster.make<sphere>(point3(0, 0.3, 0), 0.3, cluster.make<dielectric>(1.5)));
+    for (int i = 0; i < 6; i++) {
+	const double angle = i * pi / 3;
+	shared_ptr<material> ring_mat;
+	if (i % 3 == 0) {
+	    ring_mat = cluster.make<metal>(colour::random(0.5, 1), random_double(0, 0.3));
+	} else {
+	    ring_mat = cluster.make<lambertian>(colour::random() * colour::random());
+	}
+	cluster.add(cluster.make<sphere>(point3(0.55 * cos(angle), 0.15, 0.55 * sin(angle)), 0.15, ring_mat));
+    }
+    auto shared = world.make<bvh>(cluster);
+
+    const double extent = sqrt(double(count)) / 2;
+    for (int i = 0; i < count; i++) {
+	const vec3 offset(random_double(-extent, extent), 0, random_double(-extent, extent));
+	world.add(world.make<instance>(shared, transform(offset, random_double(0, 360), random_double(0.3, 0.6))));
+    }
+
+    aspect_ratio = 3.0/2.0;
+
+    point3 lookfrom(12, 2, 3);
+    point3 lookat(0, 0, 0);
+    vec3 vup(0, 1, 0);
+    auto fov = 20;
+    auto dist_to_focus = 10;
+    auto aperture = 0.1;
+
+    cam = camera(lookfrom, lookat, vup, fov, aspect_ratio, aperture, dist_to_focus);
+}
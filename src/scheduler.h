@@ -0,0 +1,191 @@
+#pragma once
+
+#include "framebuffer.h"
+#include "render.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// work stealing tile scheduler
+//
+// tiles are laid out in Z order and dealt to workers in contiguous runs, so
+// each worker starts on a compact patch of the image. workers take from the
+// front of their own deque and steal from the back of others'. once fewer
+// tiles are queued than there are workers, big tiles are split into quarters
+// so the frame doesn't wait on one slow tile. tile columns start on
+// framebuffer lines, so neighbouring tiles never write the same line
+class tile_scheduler {
+    public:
+	// tiles are never split below this many pixels on a side
+	static const int min_split = 8;
+
+	tile_scheduler(int image_width, int image_height, int tile_size, int worker_count, bool allow_split)
+	    : tile_scheduler({0, 0, image_width, image_height}, tile_size, worker_count, allow_split) {}
+
+	// the tiles of one region of the frame
+	tile_scheduler(const tile_bounds& region, int tile_size, int worker_count, bool allow_split);
+
+	// the tiles covering region in Z order, tile_size stretched to divide it
+	// evenly. anything handing out tiles uses this layout, so renders that
+	// decide per tile, like adaptive ones, come out the same
+	static std::vector<tile_bounds> layout(const tile_bounds& region, int tile_size);
+
+	bool next(int worker, tile_bounds& tile);
+
+	int done() const { return completed; }
+	int total() const { return tile_total; }
+	void finish() { completed++; }
+
+    private:
+	struct worker_queue {
+	    std::mutex lock;
+	    std::deque<tile_bounds> tiles;
+	};
+
+	bool pop(int worker, tile_bounds& tile);
+	bool steal(int victim, tile_bounds& tile);
+	void split(int worker, tile_bounds& tile);
+
+	static uint32_t morton(uint32_t x, uint32_t y);
+
+	std::vector<std::unique_ptr<worker_queue>> queues;
+	std::atomic<int> queued;
+	std::atomic<int> tile_total;
+	std::atomic<int> completed;
+	bool allow_split;
+};
+
+uint32_t tile_scheduler::morton(uint32_t x, uint32_t y) {
+    auto spread = [](uint32_t v) {
+	v &= 0xffff;
+	v = (v | (v << 8)) & 0x00ff00ff;
+	v = (v | (v << 4)) & 0x0f0f0f0f;
+	v = (v | (v << 2)) & 0x33333333;
+	v = (v | (v << 1)) & 0x55555555;
+	return v;
+    };
+    return spread(x) | (spread(y) << 1);
+}
+
+std::vector<tile_bounds> tile_scheduler::layout(const tile_bounds& region, int tile_size) {
+    const int image_width = region.end_x - region.start_x;
+    const int image_height = region.end_y - region.start_y;
+
+    // target tile size
+    const int tiles_x = std::max(1, image_width / tile_size);
+    const int tiles_y = std::max(1, image_height / tile_size);
+    const int tile_count = tiles_x * tiles_y;
+
+    // stretched tile size
+    const double tsize_x = double(image_width) / tiles_x;
+    const double tsize_y = double(image_height) / tiles_y;
+
+    std::vector<std::pair<uint32_t, tile_bounds>> order;
+    order.reserve(tile_count);
+    for (int ty = 0; ty < tiles_y; ty++) {
+	for (int tx = 0; tx < tiles_x; tx++) {
+	    tile_bounds bounds;
+	    bounds.start_x = tx == 0 ? region.start_x : snap_to_line(region.start_x + static_cast<int>(tsize_x * tx));
+	    bounds.start_y = region.start_y + static_cast<int>(tsize_y * ty);
+	    bounds.end_x = tx + 1 == tiles_x ? region.end_x : snap_to_line(region.start_x + static_cast<int>(tsize_x * (tx + 1)));
+	    bounds.end_y = region.start_y + static_cast<int>(tsize_y * (ty + 1));
+	    order.push_back({morton(tx, ty), bounds});
+	}
+    }
+    std::sort(order.begin(), order.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+    std::vector<tile_bounds> tiles;
+    tiles.reserve(tile_count);
+    for (const auto& o : order) tiles.push_back(o.second);
+    return tiles;
+}
+
+tile_scheduler::tile_scheduler(const tile_bounds& region, int tile_size, int worker_count, bool allow_split)
+    : queued(0), tile_total(0), completed(0), allow_split(allow_split) {
+    const std::vector<tile_bounds> tiles = layout(region, tile_size);
+    const int tile_count = static_cast<int>(tiles.size());
+
+    worker_count = std::max(1, worker_count);
+    for (int i = 0; i < worker_count; i++) {
+	queues.push_back(std::make_unique<worker_queue>());
+    }
+
+    // deal contiguous runs of the curve to each worker
+    for (int i = 0; i < tile_count; i++) {
+	queues[static_cast<long>(i) * worker_count / tile_count]->tiles.push_back(tiles[i]);
+    }
+
+    queued = tile_count;
+    tile_total = tile_count;
+}
+
+bool tile_scheduler::next(int worker, tile_bounds& tile) {
+    const int n = static_cast<int>(queues.size());
+
+    if (!pop(worker, tile)) {
+	bool stolen = false;
+	for (int i = 1; i < n && !stolen; i++) {
+	    stolen = steal((worker + i) % n, tile);
+	}
+	if (!stolen) return false;
+    }
+
+    if (allow_split && queued < n) {
+	split(worker, tile);
+    }
+
+    return true;
+}
+
+bool tile_scheduler::pop(int worker, tile_bounds& tile) {
+    auto& q = *queues[worker];
+    std::lock_guard<std::mutex> guard(q.lock);
+    if (q.tiles.empty()) return false;
+
+    tile = q.tiles.front();
+    q.tiles.pop_front();
+    queued--;
+    return true;
+}
+
+bool tile_scheduler::steal(int victim, tile_bounds& tile) {
+    auto& q = *queues[victim];
+    std::lock_guard<std::mutex> guard(q.lock);
+    if (q.tiles.empty()) return false;
+
+    tile = q.tiles.back();
+    q.tiles.pop_back();
+    queued--;
+    return true;
+}
+
+void tile_scheduler::split(int worker, tile_bounds& tile) {
+    const int w = tile.end_x - tile.start_x;
+    const int h = tile.end_y - tile.start_y;
+    if (w < 2 * min_split || h < 2 * min_split) return;
+
+    const int mid_x = snap_to_line(tile.start_x + w / 2);
+    const int mid_y = tile.start_y + h / 2;
+
+    // keep the top left quarter, queue the rest where thieves can reach them
+    const tile_bounds rest[3] = {
+	{mid_x, tile.start_y, tile.end_x, mid_y},
+	{tile.start_x, mid_y, mid_x, tile.end_y},
+	{mid_x, mid_y, tile.end_x, tile.end_y},
+    };
+    tile.end_x = mid_x;
+    tile.end_y = mid_y;
+
+    auto& q = *queues[worker];
+    std::lock_guard<std::mutex> guard(q.lock);
+    for (const auto& t : rest) {
+	q.tiles.push_front(t);
+    }
+    queued += 3;
+    tile_total += 3;
+}
@@ -0,0 +1,315 @@
+#pragma once
+
+#include "camera.h"
+#include "distributed.h"
+#include "frame.h"
+#include "framebuffer.h"
+#include "hittable.h"
+#include "render.h"
+#include "sampling.h"
+#include "scene_file.h"
+
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+// a long running render server
+//
+// clients send render requests one after another, over a tcp connection or
+// over stdin when serving stdio. a request names its scene by path, empty
+// for the built in one, and seed, and may bring a camera to use instead of
+// the scene's. the rest is the resolution, samples, depth, mode and region
+// of interest. the reply streams back each tile as it's finished, as a
+// tile_result followed by its pixels the way workers send them, and ends
+// with a tile_result whose start_x is -1 and whose samples are the job's
+//
+// the last few scenes requests named stay loaded, bvhs and all. every
+// client's jobs take turns on the one pool of threads, each job using all of
+// them, so latency stays that of a single render
+
+const uint32_t request_magic = 0x51525254; // "TRRQ"
+const uint32_t server_version = 1;
+
+// scenes kept loaded at once, the least recently used going first, since any
+// client may name as many scene files and seeds as it likes
+const int max_resident_scenes = 8;
+
+struct render_request {
+    uint32_t magic;
+    uint32_t version;
+    int32_t image_width;
+    int32_t image_height;
+    int32_t samples_per_pixel;
+    int32_t max_depth;
+    uint64_t seed;
+    uint64_t scene_seed;
+    int32_t mode;
+    int32_t pattern;
+    double adaptive_threshold;
+    int32_t region[4];        // start x, start y, end x, end y, all zero for the whole frame
+    uint32_t has_camera;      // nonzero to render from camera rather than the scene's own
+    uint32_t scene_path_size; // followed by the path, empty for the built in scene
+    scene_camera_record camera;
+};
+
+// sent before any tiles. a nonzero status is followed by message_size bytes
+// saying what was wrong with the request, and no tiles
+struct render_reply {
+    uint32_t status;
+    uint32_t message_size;
+};
+
+// read and write rather than recv and send, so pipes serve as well as sockets
+inline bool read_fully(int fd, void* data, size_t size) {
+    char* p = static_cast<char*>(data);
+    while (size > 0) {
+	const ssize_t n = ::read(fd, p, size);
+	if (n <= 0) return false;
+	p += n;
+	size -= n;
+    }
+    return true;
+}
+
+inline bool write_fully(int fd, const void* data, size_t size) {
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+	const ssize_t n = ::write(fd, p, size);
+	if (n <= 0) return false;
+	p += n;
+	size -= n;
+    }
+    return true;
+}
+
+class render_server {
+    public:
+	// scenes are built on pool's threads too, between jobs
+	render_server(render_pool& pool, const world_loader& load) : pool(pool), load(load) {}
+
+	// answer the requests read from in on out, until in is closed
+	void serve(int in, int out);
+
+    private:
+	struct resident_scene {
+	    camera cam;
+	    std::unique_ptr<hittable> world;
+	};
+
+	// shared with the jobs using it, so one evicted between their lookup and
+	// their render lives until they are done
+	struct scene_entry {
+	    std::shared_ptr<const resident_scene> scene;
+	    uint64_t last_used;
+	};
+
+	static bool check(const render_request& request, std::string& error);
+	std::shared_ptr<const resident_scene> find_scene(const std::string& path, uint64_t seed, std::string& error);
+
+	render_pool& pool;
+	world_loader load;
+	std::mutex jobs; // held for a job's scene lookup and render
+	std::map<std::string, scene_entry> scenes;
+	uint64_t lookups = 0;
+};
+
+bool render_server::check(const render_request& r, std::string& error) {
+    if (r.image_width < 1 || r.image_width > max_image_size || r.image_height < 1 || r.image_height > max_image_size) {
+	error = "image sizes run from 1 to " + std::to_string(max_image_size);
+    } else if (r.samples_per_pixel < 1 || r.max_depth < 1) {
+	error = "samples per pixel and depth must be positive";
+    } else if (r.mode < 0 || r.mode > static_cast<int>(render_mode::adaptive)
+	       || r.pattern < 0 || r.pattern > static_cast<int>(sample_pattern::blue_noise)) {
+	error = "unknown mode or sampler";
+    } else if ((r.region[0] | r.region[1] | r.region[2] | r.region[3]) != 0
+	       && !(0 <= r.region[0] && r.region[0] < r.region[2] && r.region[2] <= r.image_width
+		    && 0 <= r.region[1] && r.region[1] < r.region[3] && r.region[3] <= r.image_height)) {
+	error = "the region must be a nonempty part of the image";
+    } else if (!(std::isfinite(r.adaptive_threshold) && r.adaptive_threshold >= 0)) {
+	error = "the adaptive threshold must be a finite number, zero or more";
+    } else if (r.has_camera && !(r.camera.vfov > 0 && r.camera.vfov < 180 && r.camera.aspect_ratio > 0)) {
+	error = "the camera needs a field of view between 0 and 180 degrees and a positive aspect ratio";
+    } else {
+	return true;
+    }
+    return false;
+}
+
+// called with jobs held, so no render is using the pool or the scenes
+std::shared_ptr<const render_server::resident_scene> render_server::find_scene(const std::string& path, uint64_t seed, std::string& error) {
+    const std::string key = path + "@" + std::to_string(seed);
+    auto found = scenes.find(key);
+    if (found != scenes.end()) {
+	found->second.last_used = ++lookups;
+	return found->second.scene;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    auto scene = std::make_shared<resident_scene>();
+    if (!load(path, seed, scene->cam, scene->world, error)) return nullptr;
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cerr << "server: loaded " << (path.empty() ? "the built in scene" : path) << " in " << elapsed.count() << " seconds\n";
+
+    if (static_cast<int>(scenes.size()) >= max_resident_scenes) {
+	auto oldest = scenes.begin();
+	for (auto i = scenes.begin(); i != scenes.end(); ++i) {
+	    if (i->second.last_used < oldest->second.last_used) oldest = i;
+	}
+	std::cerr << "server: unloaded " << oldest->first << " to make room\n";
+	scenes.erase(oldest);
+    }
+    scenes[key] = {scene, ++lookups};
+    return scene;
+}
+
+void render_server::serve(int in, int out) {
+    // kept while requests keep the same size, as an interactive client's do
+    framebuffer image;
+    render_request request;
+    while (read_fully(in, &request, sizeof(request))) {
+	if (request.magic != request_magic || request.version != server_version || request.scene_path_size > max_scene_path) {
+	    std::cerr << "server: not a render request\n";
+	    return;
+	}
+	std::string scene_path(request.scene_path_size, '\0');
+	if (!read_fully(in, &scene_path[0], scene_path.size())) return;
+
+	// the job lock is only held while the pool is in use, never while
+	// writing to a client that may not be reading
+	std::string error;
+	std::shared_ptr<const resident_scene> scene;
+	if (check(request, error)) {
+	    std::lock_guard<std::mutex> job(jobs);
+	    scene = find_scene(scene_path, request.scene_seed, error);
+	}
+	const render_reply reply = {scene ? 0u : 1u, static_cast<uint32_t>(error.size())};
+	if (!write_fully(out, &reply, sizeof(reply)) || !write_fully(out, error.data(), error.size())) return;
+	if (!scene) continue;
+
+	render_settings settings = {
+	    request.image_width, request.image_height, request.samples_per_pixel, request.max_depth, request.seed,
+	    static_cast<render_mode>(request.mode), request.adaptive_threshold, false,
+	    static_cast<sample_pattern>(request.pattern), 0
+	};
+	settings.region = {request.region[0], request.region[1], request.region[2], request.region[3]};
+	const camera cam = request.has_camera ? make_camera(request.camera) : scene->cam;
+
+	// render threads queue copies of their finished tiles, and this thread
+	// sends them, so a slow client only holds up itself
+	struct finished_tile {
+	    tile_result result;
+	    std::vector<pixel> pixels;
+	};
+	std::deque<finished_tile> ready;
+	std::mutex ready_lock;
+	std::condition_variable changed;
+	bool rendered = false;
+	long samples = 0;
+	int tiles = 0;
+	const tile_callback queue_tile = [&](const framebuffer& frame, const tile_bounds& t, long tile_samples) {
+	    finished_tile done = {{{t.start_x, t.start_y, t.end_x, t.end_y}, tile_samples}, {}};
+	    const int tile_width = t.end_x - t.start_x;
+	    done.pixels.reserve(static_cast<size_t>(tile_width) * (t.end_y - t.start_y));
+	    for (int y = t.start_y; y < t.end_y; y++) {
+		const pixel* row = frame.row(y) + t.start_x;
+		done.pixels.insert(done.pixels.end(), row, row + tile_width);
+	    }
+	    {
+		std::lock_guard<std::mutex> guard(ready_lock);
+		ready.push_back(std::move(done));
+		samples += tile_samples;
+		tiles++;
+	    }
+	    changed.notify_one();
+	};
+	settings.tile_done = &queue_tile;
+
+	if (image.width() != settings.image_width || image.height() != settings.image_height) {
+	    image = framebuffer(settings.image_width, settings.image_height);
+	}
+	std::thread renderer([&] {
+	    const auto start = std::chrono::steady_clock::now();
+	    {
+		std::lock_guard<std::mutex> job(jobs);
+		pool.render(image, cam, *scene->world, settings);
+	    }
+	    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	    std::lock_guard<std::mutex> guard(ready_lock);
+	    std::cerr << "server: " << settings.image_width << "x" << settings.image_height << " at " << settings.samples_per_pixel
+		      << " samples per pixel, " << tiles << " tiles in " << elapsed.count() << " seconds\n";
+	    rendered = true;
+	    changed.notify_one();
+	});
+
+	// once the client is gone the rest of the job still renders, but is dropped
+	bool lost = false;
+	while (true) {
+	    finished_tile next;
+	    {
+		std::unique_lock<std::mutex> guard(ready_lock);
+		changed.wait(guard, [&] { return !ready.empty() || rendered; });
+		if (ready.empty()) break;
+		next = std::move(ready.front());
+		ready.pop_front();
+	    }
+	    if (!lost) {
+		lost = !write_fully(out, &next.result, sizeof(next.result))
+		    || !write_fully(out, next.pixels.data(), next.pixels.size() * sizeof(pixel));
+	    }
+	}
+	renderer.join();
+
+	const tile_result end = {{-1, -1, -1, -1}, samples};
+	if (lost || !write_fully(out, &end, sizeof(end))) return;
+    }
+}
+
+// serve requests on stdin and stdout when port is 0, otherwise on every
+// connection to port, each on a thread of its own, forever
+int runServer(render_pool& pool, const world_loader& load, int port) {
+    // a client hanging up shows as a failed write, not a signal
+    std::signal(SIGPIPE, SIG_IGN);
+    render_server server(pool, load);
+
+    if (port == 0) {
+	std::cerr << "server: reading requests on stdin with " << pool.size() << " threads\n";
+	server.serve(STDIN_FILENO, STDOUT_FILENO);
+	return 0;
+    }
+
+    std::string error;
+    int listener = listen_on(port, error);
+    if (listener < 0) {
+	std::cerr << error << "\n";
+	return 1;
+    }
+    std::cerr << "server: listening on port " << port << " with " << pool.size() << " threads\n";
+
+    while (true) {
+	int fd = ::accept(listener, nullptr, nullptr);
+	if (fd < 0) continue;
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	// a client that stops reading for this long counts as gone
+	timeval timeout = {remote_timeout_seconds, 0};
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	std::thread([&server, fd] {
+	    server.serve(fd, fd);
+	    ::close(fd);
+	}).detach();
+    }
+}
@@ -0,0 +1,235 @@
+#pragma once
+
+// thin wrappers over the widest vector unit available
+//
+// vpack<T> holds `width` lanes of float or double and vbool<T> the result of
+// a lane-wise compare. kernels are written once against these and compile
+// down to AVX-512, AVX, SSE2 or plain scalar code depending on the target
+// flags. vreal matches the scalar type vec3 is built on
+
+#include "common.h"
+
+#include <cmath>
+
+template <typename T> struct vpack;
+template <typename T> struct vbool;
+
+#if defined(__AVX512F__)
+
+#include <immintrin.h>
+
+template <> struct vbool<double> { __mmask8 m; };
+template <> struct vbool<float> { __mmask16 m; };
+
+template <> struct vpack<double> {
+    static const int width = 8;
+    __m512d v;
+
+    static vpack set1(double x) { return {_mm512_set1_pd(x)}; }
+    static vpack load(const double* p) { return {_mm512_loadu_pd(p)}; }
+    static vpack lanes() { return {_mm512_set_pd(7, 6, 5, 4, 3, 2, 1, 0)}; }
+    void store(double* p) const { _mm512_storeu_pd(p, v); }
+};
+
+template <> struct vpack<float> {
+    static const int width = 16;
+    __m512 v;
+
+    static vpack set1(float x) { return {_mm512_set1_ps(x)}; }
+    static vpack load(const float* p) { return {_mm512_loadu_ps(p)}; }
+    static vpack lanes() { return {_mm512_set_ps(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0)}; }
+    void store(float* p) const { _mm512_storeu_ps(p, v); }
+};
+
+using vd = vpack<double>;
+using vf = vpack<float>;
+using bd = vbool<double>;
+using bf = vbool<float>;
+
+inline vd operator+(vd a, vd b) { return {_mm512_add_pd(a.v, b.v)}; }
+inline vd operator-(vd a, vd b) { return {_mm512_sub_pd(a.v, b.v)}; }
+inline vd operator*(vd a, vd b) { return {_mm512_mul_pd(a.v, b.v)}; }
+inline vd operator/(vd a, vd b) { return {_mm512_div_pd(a.v, b.v)}; }
+inline vd vsqrt(vd a) { return {_mm512_sqrt_pd(a.v)}; }
+inline vd vmax(vd a, vd b) { return {_mm512_max_pd(a.v, b.v)}; }
+inline bd operator>=(vd a, vd b) { return {_mm512_cmp_pd_mask(a.v, b.v, _CMP_GE_OQ)}; }
+inline bd operator<=(vd a, vd b) { return {_mm512_cmp_pd_mask(a.v, b.v, _CMP_LE_OQ)}; }
+inline bd operator&(bd a, bd b) { return {static_cast<__mmask8>(a.m & b.m)}; }
+inline bd operator|(bd a, bd b) { return {static_cast<__mmask8>(a.m | b.m)}; }
+inline vd select(bd m, vd a, vd b) { return {_mm512_mask_blend_pd(m.m, b.v, a.v)}; }
+inline bool any(bd m) { return m.m != 0; }
+
+inline vf operator+(vf a, vf b) { return {_mm512_add_ps(a.v, b.v)}; }
+inline vf operator-(vf a, vf b) { return {_mm512_sub_ps(a.v, b.v)}; }
+inline vf operator*(vf a, vf b) { return {_mm512_mul_ps(a.v, b.v)}; }
+inline vf operator/(vf a, vf b) { return {_mm512_div_ps(a.v, b.v)}; }
+inline vf vsqrt(vf a) { return {_mm512_sqrt_ps(a.v)}; }
+inline vf vmax(vf a, vf b) { return {_mm512_max_ps(a.v, b.v)}; }
+inline bf operator>=(vf a, vf b) { return {_mm512_cmp_ps_mask(a.v, b.v, _CMP_GE_OQ)}; }
+inline bf operator<=(vf a, vf b) { return {_mm512_cmp_ps_mask(a.v, b.v, _CMP_LE_OQ)}; }
+inline bf operator&(bf a, bf b) { return {static_cast<__mmask16>(a.m & b.m)}; }
+inline bf operator|(bf a, bf b) { return {static_cast<__mmask16>(a.m | b.m)}; }
+inline vf select(bf m, vf a, vf b) { return {_mm512_mask_blend_ps(m.m, b.v, a.v)}; }
+inline bool any(bf m) { return m.m != 0; }
+
+#elif defined(__AVX__)
+
+#include <immintrin.h>
+
+template <> struct vbool<double> { __m256d m; };
+template <> struct vbool<float> { __m256 m; };
+
+template <> struct vpack<double> {
+    static const int width = 4;
+    __m256d v;
+
+    static vpack set1(double x) { return {_mm256_set1_pd(x)}; }
+    static vpack load(const double* p) { return {_mm256_loadu_pd(p)}; }
+    static vpack lanes() { return {_mm256_set_pd(3, 2, 1, 0)}; }
+    void store(double* p) const { _mm256_storeu_pd(p, v); }
+};
+
+template <> struct vpack<float> {
+    static const int width = 8;
+    __m256 v;
+
+    static vpack set1(float x) { return {_mm256_set1_ps(x)}; }
+    static vpack load(const float* p) { return {_mm256_loadu_ps(p)}; }
+    static vpack lanes() { return {_mm256_set_ps(7, 6, 5, 4, 3, 2, 1, 0)}; }
+    void store(float* p) const { _mm256_storeu_ps(p, v); }
+};
+
+using vd = vpack<double>;
+using vf = vpack<float>;
+using bd = vbool<double>;
+using bf = vbool<float>;
+
+inline vd operator+(vd a, vd b) { return {_mm256_add_pd(a.v, b.v)}; }
+inline vd operator-(vd a, vd b) { return {_mm256_sub_pd(a.v, b.v)}; }
+inline vd operator*(vd a, vd b) { return {_mm256_mul_pd(a.v, b.v)}; }
+inline vd operator/(vd a, vd b) { return {_mm256_div_pd(a.v, b.v)}; }
+inline vd vsqrt(vd a) { return {_mm256_sqrt_pd(a.v)}; }
+inline vd vmax(vd a, vd b) { return {_mm256_max_pd(a.v, b.v)}; }
+inline bd operator>=(vd a, vd b) { return {_mm256_cmp_pd(a.v, b.v, _CMP_GE_OQ)}; }
+inline bd operator<=(vd a, vd b) { return {_mm256_cmp_pd(a.v, b.v, _CMP_LE_OQ)}; }
+inline bd operator&(bd a, bd b) { return {_mm256_and_pd(a.m, b.m)}; }
+inline bd operator|(bd a, bd b) { return {_mm256_or_pd(a.m, b.m)}; }
+inline vd select(bd m, vd a, vd b) { return {_mm256_blendv_pd(b.v, a.v, m.m)}; }
+inline bool any(bd m) { return _mm256_movemask_pd(m.m) != 0; }
+
+inline vf operator+(vf a, vf b) { return {_mm256_add_ps(a.v, b.v)}; }
+inline vf operator-(vf a, vf b) { return {_mm256_sub_ps(a.v, b.v)}; }
+inline vf operator*(vf a, vf b) { return {_mm256_mul_ps(a.v, b.v)}; }
+inline vf operator/(vf a, vf b) { return {_mm256_div_ps(a.v, b.v)}; }
+inline vf vsqrt(vf a) { return {_mm256_sqrt_ps(a.v)}; }
+inline vf vmax(vf a, vf b) { return {_mm256_max_ps(a.v, b.v)}; }
+inline bf operator>=(vf a, vf b) { return {_mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ)}; }
+inline bf operator<=(vf a, vf b) { return {_mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ)}; }
+inline bf operator&(bf a, bf b) { return {_mm256_and_ps(a.m, b.m)}; }
+inline bf operator|(bf a, bf b) { return {_mm256_or_ps(a.m, b.m)}; }
+inline vf select(bf m, vf a, vf b) { return {_mm256_blendv_ps(b.v, a.v, m.m)}; }
+inline bool any(bf m) { return _mm256_movemask_ps(m.m) != 0; }
+
+#elif defined(__SSE2__)
+
+#include <emmintrin.h>
+
+template <> struct vbool<double> { __m128d m; };
+template <> struct vbool<float> { __m128 m; };
+
+template <> struct vpack<double> {
+    static const int width = 2;
+    __m128d v;
+
+    static vpack set1(double x) { return {_mm_set1_pd(x)}; }
+    static vpack load(const double* p) { return {_mm_loadu_pd(p)}; }
+    static vpack lanes() { return {_mm_set_pd(1, 0)}; }
+    void store(double* p) const { _mm_storeu_pd(p, v); }
+};
+
+template <> struct vpack<float> {
+    static const int width = 4;
+    __m128 v;
+
+    static vpack set1(float x) { return {_mm_set1_ps(x)}; }
+    static vpack load(const float* p) { return {_mm_loadu_ps(p)}; }
+    static vpack lanes() { return {_mm_set_ps(3, 2, 1, 0)}; }
+    void store(float* p) const { _mm_storeu_ps(p, v); }
+};
+
+using vd = vpack<double>;
+using vf = vpack<float>;
+using bd = vbool<double>;
+using bf = vbool<float>;
+
+inline vd operator+(vd a, vd b) { return {_mm_add_pd(a.v, b.v)}; }
+inline vd operator-(vd a, vd b) { return {_mm_sub_pd(a.v, b.v)}; }
+inline vd operator*(vd a, vd b) { return {_mm_mul_pd(a.v, b.v)}; }
+inline vd operator/(vd a, vd b) { return {_mm_div_pd(a.v, b.v)}; }
+inline vd vsqrt(vd a) { return {_mm_sqrt_pd(a.v)}; }
+inline vd vmax(vd a, vd b) { return {_mm_max_pd(a.v, b.v)}; }
+inline bd operator>=(vd a, vd b) { return {_mm_cmpge_pd(a.v, b.v)}; }
+inline bd operator<=(vd a, vd b) { return {_mm_cmple_pd(a.v, b.v)}; }
+inline bd operator&(bd a, bd b) { return {_mm_and_pd(a.m, b.m)}; }
+inline bd operator|(bd a, bd b) { return {_mm_or_pd(a.m, b.m)}; }
+inline vd select(bd m, vd a, vd b) { return {_mm_or_pd(_mm_and_pd(m.m, a.v), _mm_andnot_pd(m.m, b.v))}; }
+inline bool any(bd m) { return _mm_movemask_pd(m.m) != 0; }
+
+inline vf operator+(vf a, vf b) { return {_mm_add_ps(a.v, b.v)}; }
+inline vf operator-(vf a, vf b) { return {_mm_sub_ps(a.v, b.v)}; }
+inline vf operator*(vf a, vf b) { return {_mm_mul_ps(a.v, b.v)}; }
+inline vf operator/(vf a, vf b) { return {_mm_div_ps(a.v, b.v)}; }
+inline vf vsqrt(vf a) { return {_mm_sqrt_ps(a.v)}; }
+inline vf vmax(vf a, vf b) { return {_mm_max_ps(a.v, b.v)}; }
+inline bf operator>=(vf a, vf b) { return {_mm_cmpge_ps(a.v, b.v)}; }
+inline bf operator<=(vf a, vf b) { return {_mm_cmple_ps(a.v, b.v)}; }
+inline bf operator&(bf a, bf b) { return {_mm_and_ps(a.m, b.m)}; }
+inline bf operator|(bf a, bf b) { return {_mm_or_ps(a.m, b.m)}; }
+inline vf select(bf m, vf a, vf b) { return {_mm_or_ps(_mm_and_ps(m.m, a.v), _mm_andnot_ps(m.m, b.v))}; }
+inline bool any(bf m) { return _mm_movemask_ps(m.m) != 0; }
+
+#else
+
+template <typename T> struct vbool { bool m; };
+
+template <typename T> struct vpack {
+    static const int width = 1;
+    T v;
+
+    static vpack set1(T x) { return {x}; }
+    static vpack load(const T* p) { return {*p}; }
+    static vpack lanes() { return {0}; }
+    void store(T* p) const { *p = v; }
+};
+
+template <typename T> inline vpack<T> operator+(vpack<T> a, vpack<T> b) { return {a.v + b.v}; }
+template <typename T> inline vpack<T> operator-(vpack<T> a, vpack<T> b) { return {a.v - b.v}; }
+template <typename T> inline vpack<T> operator*(vpack<T> a, vpack<T> b) { return {a.v * b.v}; }
+template <typename T> inline vpack<T> operator/(vpack<T> a, vpack<T> b) { return {a.v / b.v}; }
+template <typename T> inline vpack<T> vsqrt(vpack<T> a) { return {std::sqrt(a.v)}; }
+template <typename T> inline vpack<T> vmax(vpack<T> a, vpack<T> b) { return {a.v > b.v ? a.v : b.v}; }
+template <typename T> inline vbool<T> operator>=(vpack<T> a, vpack<T> b) { return {a.v >= b.v}; }
+template <typename T> inline vbool<T> operator<=(vpack<T> a, vpack<T> b) { return {a.v <= b.v}; }
+template <typename T> inline vbool<T> operator&(vbool<T> a, vbool<T> b) { return {a.m && b.m}; }
+template <typename T> inline vbool<T> operator|(vbool<T> a, vbool<T> b) { return {a.m || b.m}; }
+template <typename T> inline vpack<T> select(vbool<T> m, vpack<T> a, vpack<T> b) { return m.m ? a : b; }
+template <typename T> inline bool any(vbool<T> m) { return m.m; }
+
+#endif
+
+// plain scalars share the spelling, so a kernel templated on its lane type
+// can be instantiated on real as well as on vreal
+template <typename V> inline V splat(double x) { return V::set1(x); }
+template <> inline double splat<double>(double x) { return x; }
+template <> inline float splat<float>(double x) { return static_cast<float>(x); }
+
+inline double vsqrt(double a) { return std::sqrt(a); }
+inline float vsqrt(float a) { return std::sqrt(a); }
+inline double vmax(double a, double b) { return a > b ? a : b; }
+inline float vmax(float a, float b) { return a > b ? a : b; }
+inline double select(bool m, double a, double b) { return m ? a : b; }
+inline float select(bool m, float a, float b) { return m ? a : b; }
+
+using vdouble = vpack<double>;
+using vfloat = vpack<float>;
+using vreal = vpack<real>;
@@ -2,27 +2,75 @@
 
 #include "common.h"
 #include "hittable.h"
+#include "stats.h"
 #include "vec3.h"
 
 class sphere : public hittable {
     public:
 	sphere() {}
-	sphere(point3 cen, double r, shared_ptr<material> m) : center(cen), radius(r), mat_ptr(m) {};
+	sphere(point3 cen, real r, shared_ptr<material> m) : radius(r), mat_ptr(m), radius_squared(r*r), inv_radius(1 / r) {
+	    move_to(cen);
+	}
+
+	// the only way to move a sphere, keeping its box current
+	void move_to(point3 cen) {
+	    center = cen;
+	    auto extent = vec3(fabs(radius), fabs(radius), fabs(radius));
+	    box = aabb(center - extent, center + extent);
+	}
 
 	virtual bool hit(
-		const ray& r, double t_min, double t_max, hit_record& rec) const override;
+		const ray& r, real t_min, real t_max, hit_record& rec) const override;
+
+	virtual bool intersect(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+	virtual void complete(const ray& r, hit_record& rec) const override;
+
+	virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+
+	virtual bool bounding_box(aabb& output_box) const override;
 
     public:
 	point3 center;
-	double radius;
+	real radius;
 	shared_ptr<material> mat_ptr;
+
+    private:
+	real radius_squared;
+	real inv_radius;
+	aabb box;
 };
 
-bool sphere::hit(const ray &r, double t_min, double t_max, hit_record &rec) const {
+// whether either root of the ray sphere quadratic falls in [t_min, t_max]
+inline bool sphere_in_range(const point3& center, real radius_squared, const ray& r, real t_min, real t_max) {
     vec3 oc = r.origin() - center;
-    auto a = r.direction().length_squared();
+    auto a = r.direction_length_squared();
     auto half_b = dot(oc, r.direction());
-    auto c = oc.length_squared() - radius*radius;
+    auto c = oc.length_squared() - radius_squared;
+
+    auto discriminant = half_b*half_b - a*c;
+    if (discriminant < 0) {
+	return false;
+    }
+
+    auto sqrtd = sqrt(discriminant);
+    auto near_root = (-half_b - sqrtd) / a;
+    auto far_root = (-half_b + sqrtd) / a;
+    return (near_root >= t_min && near_root <= t_max) || (far_root >= t_min && far_root <= t_max);
+}
+
+bool sphere::hit(const ray &r, real t_min, real t_max, hit_record &rec) const {
+    if (!intersect(r, t_min, t_max, rec)) return false;
+    complete(r, rec);
+    rec.source = nullptr;
+    return true;
+}
+
+bool sphere::intersect(const ray &r, real t_min, real t_max, hit_record &rec) const {
+    STAT_INC(primitive_tests);
+    vec3 oc = r.origin() - center;
+    auto a = r.direction_length_squared();
+    auto half_b = dot(oc, r.direction());
+    auto c = oc.length_squared() - radius_squared;
 
     auto discriminant = half_b*half_b - a*c;
     if (discriminant < 0) {
@@ -40,10 +88,23 @@ bool sphere::hit(const ray &r, double t_min, double t_max, hit_record &rec) cons
     }
 
     rec.t = root;
+    rec.mat_ptr = mat_ptr.get();
+    rec.source = this;
+    return true;
+}
+
+void sphere::complete(const ray& r, hit_record& rec) const {
     rec.p = r.at(rec.t);
-    vec3 outward_normal = (rec.p - center) / radius;
+    vec3 outward_normal = (rec.p - center) * inv_radius;
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mat_ptr;
+}
+
+bool sphere::occluded(const ray& r, real t_min, real t_max) const {
+    STAT_INC(primitive_tests);
+    return sphere_in_range(center, radius_squared, r, t_min, t_max);
+}
 
+bool sphere::bounding_box(aabb& output_box) const {
+    output_box = box;
     return true;
 }
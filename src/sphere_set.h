@@ -0,0 +1,257 @@
+#pragma once
+
+#include "aabb.h"
+#include "common.h"
+#include "hittable.h"
+#include "simd.h"
+#include "stats.h"
+#include "sphere.h"
+#include "vec3.h"
+
+#include <limits>
+#include <vector>
+
+// spheres packed as structure of arrays and tested vreal::width at a time
+//
+// arrays are padded to a whole number of vectors with NaN spheres, which
+// fail every ordered compare and so never report a hit. the tests work on
+// bare arrays, so scene caches run them on their mapped leaves as well
+
+// padded arrays of sphere centres and squared radii
+struct sphere_lanes {
+    const real* cx;
+    const real* cy;
+    const real* cz;
+    const real* radius_squared;
+    int padded; // a whole number of vectors
+};
+
+// the nearest hit in [t_min, t_max], its t and the slot it's in
+bool nearest_sphere(const sphere_lanes& s, const ray& r, real t_min, real t_max, real& t, int& slot);
+
+// whether any hit falls in [t_min, t_max]
+bool any_sphere(const sphere_lanes& s, const ray& r, real t_min, real t_max);
+
+class sphere_set : public hittable {
+    public:
+	sphere_set() {}
+
+	void add(const sphere& s) { add(s.center, s.radius, s.mat_ptr); }
+	void add(point3 cen, real r, shared_ptr<material> m);
+	void update(int i, point3 cen, real r); // move slot i, keeping its material
+
+	int size() const { return count; }
+	sphere_lanes lanes() const { return {cx.data(), cy.data(), cz.data(), radius_squared.data(), static_cast<int>(cx.size())}; }
+
+	virtual bool hit(
+		const ray& r, real t_min, real t_max, hit_record& rec) const override;
+
+	virtual bool intersect(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+	virtual void complete(const ray& r, hit_record& rec) const override;
+
+	virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+
+	virtual bool bounding_box(aabb& output_box) const override;
+
+    public:
+	std::vector<real> cx, cy, cz;
+	std::vector<real> radius;
+	std::vector<real> radius_squared;
+	std::vector<int> mat_index;
+	std::vector<shared_ptr<material>> materials;
+
+    private:
+	int count = 0;
+};
+
+void sphere_set::add(point3 cen, real r, shared_ptr<material> m) {
+    // reuse the slot of an already known material
+    int mi = 0;
+    while (mi < static_cast<int>(materials.size()) && materials[mi] != m) mi++;
+    if (mi == static_cast<int>(materials.size())) materials.push_back(m);
+
+    // fill the next padding slot, growing by a whole vector when full
+    if (count == static_cast<int>(cx.size())) {
+	const real nan = std::numeric_limits<real>::quiet_NaN();
+	const size_t padded = cx.size() + vreal::width;
+	cx.resize(padded, nan);
+	cy.resize(padded, nan);
+	cz.resize(padded, nan);
+	radius.resize(padded, nan);
+	radius_squared.resize(padded, nan);
+	mat_index.resize(padded, 0);
+    }
+
+    cx[count] = cen.x();
+    cy[count] = cen.y();
+    cz[count] = cen.z();
+    radius[count] = r;
+    radius_squared[count] = r*r;
+    mat_index[count] = mi;
+    count++;
+}
+
+void sphere_set::update(int i, point3 cen, real r) {
+    cx[i] = cen.x();
+    cy[i] = cen.y();
+    cz[i] = cen.z();
+    radius[i] = r;
+    radius_squared[i] = r*r;
+}
+
+bool sphere_set::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    if (!intersect(r, t_min, t_max, rec)) return false;
+    complete(r, rec);
+    rec.source = nullptr;
+    return true;
+}
+
+bool nearest_sphere(const sphere_lanes& s, const ray& r, real t_min, real t_max, real& t, int& slot) {
+    const vec3 d = r.direction();
+    const real a = r.direction_length_squared();
+
+    const vreal ox = vreal::set1(r.origin().x());
+    const vreal oy = vreal::set1(r.origin().y());
+    const vreal oz = vreal::set1(r.origin().z());
+    const vreal dx = vreal::set1(d.x());
+    const vreal dy = vreal::set1(d.y());
+    const vreal dz = vreal::set1(d.z());
+    const vreal va = vreal::set1(a);
+    const vreal inv_a = vreal::set1(1.0 / a);
+    const vreal vt_min = vreal::set1(t_min);
+    const vreal zero = vreal::set1(0.0);
+
+    // each lane keeps its own nearest hit, reduced once at the end
+    vreal best_t = vreal::set1(t_max);
+    vreal best_i = vreal::set1(-1.0);
+    vreal index = vreal::lanes();
+    const vreal step = vreal::set1(vreal::width);
+
+    for (int i = 0; i < s.padded; i += vreal::width) {
+	const vreal ocx = ox - vreal::load(&s.cx[i]);
+	const vreal ocy = oy - vreal::load(&s.cy[i]);
+	const vreal ocz = oz - vreal::load(&s.cz[i]);
+
+	const vreal half_b = ocx*dx + ocy*dy + ocz*dz;
+	const vreal c = ocx*ocx + ocy*ocy + ocz*ocz - vreal::load(&s.radius_squared[i]);
+	const vreal discriminant = half_b*half_b - va*c;
+	const vbool<real> real_roots = discriminant >= zero;
+
+	if (any(real_roots)) {
+	    const vreal sqrtd = vsqrt(vmax(discriminant, zero));
+	    const vreal near_root = (zero - half_b - sqrtd) * inv_a;
+	    const vreal far_root = (sqrtd - half_b) * inv_a;
+
+	    const vbool<real> near_ok = real_roots & (near_root >= vt_min) & (near_root <= best_t);
+	    const vbool<real> far_ok = real_roots & (far_root >= vt_min) & (far_root <= best_t);
+	    const vreal root = select(near_ok, near_root, far_root);
+	    const vbool<real> ok = near_ok | far_ok;
+
+	    best_t = select(ok, root, best_t);
+	    best_i = select(ok, index, best_i);
+	}
+
+	index = index + step;
+    }
+
+    real lane_t[vreal::width];
+    real lane_i[vreal::width];
+    best_t.store(lane_t);
+    best_i.store(lane_i);
+
+    int nearest = -1;
+    real closest_so_far = t_max;
+    for (int l = 0; l < vreal::width; l++) {
+	if (lane_i[l] >= 0 && lane_t[l] <= closest_so_far) {
+	    closest_so_far = lane_t[l];
+	    nearest = static_cast<int>(lane_i[l]);
+	}
+    }
+
+    if (nearest < 0) {
+	return false;
+    }
+
+    t = closest_so_far;
+    slot = nearest;
+    return true;
+}
+
+bool any_sphere(const sphere_lanes& s, const ray& r, real t_min, real t_max) {
+    const vec3 d = r.direction();
+    const real a = r.direction_length_squared();
+
+    const vreal ox = vreal::set1(r.origin().x());
+    const vreal oy = vreal::set1(r.origin().y());
+    const vreal oz = vreal::set1(r.origin().z());
+    const vreal dx = vreal::set1(d.x());
+    const vreal dy = vreal::set1(d.y());
+    const vreal dz = vreal::set1(d.z());
+    const vreal va = vreal::set1(a);
+    const vreal inv_a = vreal::set1(1.0 / a);
+    const vreal vt_min = vreal::set1(t_min);
+    const vreal vt_max = vreal::set1(t_max);
+    const vreal zero = vreal::set1(0.0);
+
+    // no nearest hit to track, any lane in range will do
+    for (int i = 0; i < s.padded; i += vreal::width) {
+	const vreal ocx = ox - vreal::load(&s.cx[i]);
+	const vreal ocy = oy - vreal::load(&s.cy[i]);
+	const vreal ocz = oz - vreal::load(&s.cz[i]);
+
+	const vreal half_b = ocx*dx + ocy*dy + ocz*dz;
+	const vreal c = ocx*ocx + ocy*ocy + ocz*ocz - vreal::load(&s.radius_squared[i]);
+	const vreal discriminant = half_b*half_b - va*c;
+	const vbool<real> real_roots = discriminant >= zero;
+	if (!any(real_roots)) continue;
+
+	const vreal sqrtd = vsqrt(vmax(discriminant, zero));
+	const vreal near_root = (zero - half_b - sqrtd) * inv_a;
+	const vreal far_root = (sqrtd - half_b) * inv_a;
+	const vbool<real> near_ok = (near_root >= vt_min) & (near_root <= vt_max);
+	const vbool<real> far_ok = (far_root >= vt_min) & (far_root <= vt_max);
+	if (any(real_roots & (near_ok | far_ok))) return true;
+    }
+
+    return false;
+}
+
+bool sphere_set::intersect(const ray& r, real t_min, real t_max, hit_record& rec) const {
+    STAT_ADD(primitive_tests, count);
+    real t;
+    int nearest;
+    if (!nearest_sphere(lanes(), r, t_min, t_max, t, nearest)) return false;
+
+    rec.t = t;
+    rec.mat_ptr = materials[mat_index[nearest]].get();
+    rec.source = this;
+    rec.part = nearest;
+
+    return true;
+}
+
+void sphere_set::complete(const ray& r, hit_record& rec) const {
+    const point3 center(cx[rec.part], cy[rec.part], cz[rec.part]);
+    rec.p = r.at(rec.t);
+    vec3 outward_normal = (rec.p - center) / radius[rec.part];
+    rec.set_face_normal(r, outward_normal);
+}
+
+bool sphere_set::occluded(const ray& r, real t_min, real t_max) const {
+    STAT_ADD(primitive_tests, count);
+    return any_sphere(lanes(), r, t_min, t_max);
+}
+
+bool sphere_set::bounding_box(aabb& output_box) const {
+    if (count == 0) return false;
+
+    output_box = aabb();
+    for (int i = 0; i < count; i++) {
+	auto extent = vec3(fabs(radius[i]), fabs(radius[i]), fabs(radius[i]));
+	auto center = point3(cx[i], cy[i], cz[i]);
+	output_box.expand(center - extent);
+	output_box.expand(center + extent);
+    }
+
+    return true;
+}
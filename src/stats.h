@@ -0,0 +1,139 @@
+#pragma once
+
+// optional hot path counters, compiled in with -DTRACE_STATS
+//
+// every render thread counts into its own thread_local block, which is
+// merged into the global totals once the thread is done, so the hot path
+// never shares a cache line. without TRACE_STATS the macros expand to
+// nothing and none of this is built
+
+#ifdef TRACE_STATS
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+struct render_stats {
+    static const int max_path_length = 64;
+
+    struct tile_event {
+	int worker;
+	int start_x, start_y, end_x, end_y;
+	double start_us, end_us;
+    };
+
+    uint64_t rays = 0;
+    uint64_t bvh_nodes = 0;
+    uint64_t primitive_tests = 0;
+    uint64_t scatter_lambertian = 0;
+    uint64_t scatter_metal = 0;
+    uint64_t scatter_dielectric = 0;
+    uint64_t sample_draws = 0;
+    uint64_t path_length[max_path_length + 1] = {};
+    std::vector<tile_event> tiles;
+
+    void merge(const render_stats& other) {
+	rays += other.rays;
+	bvh_nodes += other.bvh_nodes;
+	primitive_tests += other.primitive_tests;
+	scatter_lambertian += other.scatter_lambertian;
+	scatter_metal += other.scatter_metal;
+	scatter_dielectric += other.scatter_dielectric;
+	sample_draws += other.sample_draws;
+	for (int i = 0; i <= max_path_length; i++) {
+	    path_length[i] += other.path_length[i];
+	}
+	tiles.insert(tiles.end(), other.tiles.begin(), other.tiles.end());
+    }
+
+    void record_path(int bounces) {
+	path_length[bounces < max_path_length ? bounces : max_path_length]++;
+    }
+
+    void print(std::ostream& out) const;
+    void write_chrome_trace(const std::string& path) const;
+};
+
+inline render_stats& thread_stats() {
+    thread_local render_stats stats;
+    return stats;
+}
+
+inline render_stats& global_stats() {
+    static render_stats stats;
+    return stats;
+}
+
+// microseconds since the first call, the time base of tile events
+inline double stats_clock() {
+    static const auto epoch = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+// fold the calling thread's counters into the totals and reset them
+inline void merge_thread_stats() {
+    static std::mutex lock;
+    std::lock_guard<std::mutex> guard(lock);
+    global_stats().merge(thread_stats());
+    thread_stats() = render_stats();
+}
+
+void render_stats::print(std::ostream& out) const {
+    auto per = [](uint64_t a, uint64_t b) { return b ? double(a) / b : 0.0; };
+
+    out << "rays traced:        " << rays << "\n";
+    out << "bvh nodes visited:  " << bvh_nodes << " (" << per(bvh_nodes, rays) << " per ray)\n";
+    out << "primitive tests:    " << primitive_tests << " (" << per(primitive_tests, rays) << " per ray)\n";
+    out << "scatter calls:      lambertian " << scatter_lambertian << ", metal " << scatter_metal << ", dielectric " << scatter_dielectric << "\n";
+    out << "sample draws:       " << sample_draws << " (" << per(sample_draws, rays) << " per ray)\n";
+
+    uint64_t paths = 0;
+    for (auto n : path_length) paths += n;
+    out << "path lengths:\n";
+    for (int i = 0; i <= max_path_length; i++) {
+	if (path_length[i] == 0) continue;
+	out << std::setw(6) << i << (i == max_path_length ? "+" : " ") << std::setw(12) << path_length[i]
+	    << std::setw(8) << std::fixed << std::setprecision(2) << 100.0 * per(path_length[i], paths) << "%\n";
+	out.unsetf(std::ios::fixed);
+    }
+
+    if (!tiles.empty()) {
+	double total = 0, slowest = 0;
+	for (const auto& t : tiles) {
+	    total += t.end_us - t.start_us;
+	    slowest = std::max(slowest, t.end_us - t.start_us);
+	}
+	out << "tiles:              " << tiles.size() << ", " << total / tiles.size() / 1000 << " ms mean, " << slowest / 1000 << " ms slowest\n";
+    }
+}
+
+void render_stats::write_chrome_trace(const std::string& path) const {
+    std::ofstream out(path);
+    out << "{\"traceEvents\": [\n";
+    for (size_t i = 0; i < tiles.size(); i++) {
+	const auto& t = tiles[i];
+	out << "  {\"name\": \"tile " << t.start_x << "," << t.start_y << "\", \"ph\": \"X\", \"pid\": 0, \"tid\": " << t.worker
+	    << ", \"ts\": " << t.start_us << ", \"dur\": " << t.end_us - t.start_us
+	    << ", \"args\": {\"width\": " << t.end_x - t.start_x << ", \"height\": " << t.end_y - t.start_y << "}}"
+	    << (i + 1 < tiles.size() ? "," : "") << "\n";
+    }
+    out << "]}\n";
+}
+
+#define STAT_INC(field) (thread_stats().field++)
+#define STAT_ADD(field, n) (thread_stats().field += (n))
+#define STAT_PATH(bounces) (thread_stats().record_path(bounces))
+
+#else
+
+#define STAT_INC(field) ((void)0)
+#define STAT_ADD(field, n) ((void)0)
+#define STAT_PATH(bounces) ((void)0)
+
+#endif
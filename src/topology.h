@@ -0,0 +1,179 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// where a worker_pool puts its threads
+enum class pin_policy {
+    none,    // anywhere, left to the scheduler
+    compact, // fill each numa node's cores in turn, smt siblings after the cores
+    scatter  // deal threads round the numa nodes, so every node gets its share
+};
+
+inline bool parse_pin_policy(const std::string& name, pin_policy& policy) {
+    if (name == "none") policy = pin_policy::none;
+    else if (name == "compact") policy = pin_policy::compact;
+    else if (name == "scatter") policy = pin_policy::scatter;
+    else return false;
+    return true;
+}
+
+struct pool_config {
+    int threads = 0; // 0 for one per usable cpu
+    pin_policy pinning = pin_policy::none;
+    bool smt = true; // false leaves every core's extra hardware threads idle
+};
+
+// a logical cpu. sibling counts the hardware threads before it on its core
+struct cpu_info {
+    int id;
+    int core;
+    int package;
+    int node;
+    int sibling;
+};
+
+// the cpus this process may run on, as linux describes them under /sys.
+// anywhere that can't be read every cpu is its own core on node 0
+class cpu_topology {
+    public:
+	static cpu_topology detect();
+
+	// the cpu for each of a pool's threads, -1 for threads left unpinned
+	std::vector<int> placement(const pool_config& config) const;
+
+	int node_of(int cpu) const {
+	    for (const auto& c : cpus) {
+		if (c.id == cpu) return c.node;
+	    }
+	    return 0;
+	}
+
+	std::vector<cpu_info> cpus;
+
+    private:
+	static int read_number(const std::string& path, int fallback) {
+	    std::ifstream in(path);
+	    int value;
+	    return in >> value ? value : fallback;
+	}
+
+	// a list like 0-3,8,10-11
+	static std::vector<int> read_list(const std::string& path) {
+	    std::vector<int> ids;
+	    FILE* in = std::fopen(path.c_str(), "r");
+	    if (!in) return ids;
+	    int first, last;
+	    while (std::fscanf(in, "%d", &first) == 1) {
+		last = first;
+		int c = std::fgetc(in);
+		if (c == '-') {
+		    if (std::fscanf(in, "%d", &last) != 1) break;
+		    c = std::fgetc(in);
+		}
+		for (int id = first; id <= last; id++) ids.push_back(id);
+		if (c != ',') break;
+	    }
+	    std::fclose(in);
+	    return ids;
+	}
+};
+
+cpu_topology cpu_topology::detect() {
+    cpu_topology topology;
+    std::vector<int> ids;
+#ifdef __linux__
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+	for (int id = 0; id < CPU_SETSIZE; id++) {
+	    if (CPU_ISSET(id, &allowed)) ids.push_back(id);
+	}
+    }
+#endif
+    if (ids.empty()) {
+	for (int id = 0; id < static_cast<int>(std::max(1u, std::thread::hardware_concurrency())); id++) ids.push_back(id);
+    }
+
+    const std::string cpu_path = "/sys/devices/system/cpu/cpu";
+    for (int id : ids) {
+	const std::string dir = cpu_path + std::to_string(id) + "/topology/";
+	topology.cpus.push_back({id, read_number(dir + "core_id", id), read_number(dir + "physical_package_id", 0), 0, 0});
+    }
+
+    const std::string node_path = "/sys/devices/system/node/";
+    for (int node : read_list(node_path + "online")) {
+	for (int id : read_list(node_path + "node" + std::to_string(node) + "/cpulist")) {
+	    for (auto& c : topology.cpus) {
+		if (c.id == id) c.node = node;
+	    }
+	}
+    }
+
+    // number the hardware threads of each core in cpu order
+    auto& cpus = topology.cpus;
+    std::sort(cpus.begin(), cpus.end(), [](const cpu_info& a, const cpu_info& b) {
+	return std::tie(a.package, a.core, a.id) < std::tie(b.package, b.core, b.id);
+    });
+    for (size_t i = 1; i < cpus.size(); i++) {
+	if (cpus[i].package == cpus[i - 1].package && cpus[i].core == cpus[i - 1].core) cpus[i].sibling = cpus[i - 1].sibling + 1;
+    }
+    return topology;
+}
+
+std::vector<int> cpu_topology::placement(const pool_config& config) const {
+    std::vector<cpu_info> usable;
+    for (const auto& c : cpus) {
+	if (config.smt || c.sibling == 0) usable.push_back(c);
+    }
+    const int count = config.threads > 0 ? config.threads : std::max<int>(1, usable.size());
+    if (config.pinning == pin_policy::none || usable.empty()) return std::vector<int>(count, -1);
+
+    // every core of a node before any second hardware thread on one
+    std::sort(usable.begin(), usable.end(), [](const cpu_info& a, const cpu_info& b) {
+	return std::tie(a.node, a.sibling, a.package, a.core, a.id) < std::tie(b.node, b.sibling, b.package, b.core, b.id);
+    });
+
+    std::vector<int> order;
+    if (config.pinning == pin_policy::compact) {
+	for (const auto& c : usable) order.push_back(c.id);
+    } else {
+	std::vector<std::vector<int>> nodes;
+	for (size_t i = 0; i < usable.size(); i++) {
+	    if (i == 0 || usable[i].node != usable[i - 1].node) nodes.emplace_back();
+	    nodes.back().push_back(usable[i].id);
+	}
+	for (size_t round = 0; order.size() < usable.size(); round++) {
+	    for (const auto& node : nodes) {
+		if (round < node.size()) order.push_back(node[round]);
+	    }
+	}
+    }
+
+    // more threads than cpus wrap round, doubling up in the same order
+    std::vector<int> result(count);
+    for (int i = 0; i < count; i++) result[i] = order[i % order.size()];
+    return result;
+}
+
+// bind the calling thread to one cpu, so the memory it touches first is
+// allocated on that cpu's node
+inline bool pin_current_thread(int cpu) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+}
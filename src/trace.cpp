@@ -1,185 +1,123 @@
 #include "common.h"
 
+#include "animation.h"
+#include "bvh.h"
 #include "camera.h"
+#include "checkpoint.h"
 #include "colour.h"
+#include "denoise.h"
+#include "distributed.h"
+#include "frame.h"
+#include "framebuffer.h"
 #include "hittable_list.h"
+#include "image_writer.h"
 #include "material.h"
+#include "render.h"
+#include "sampling.h"
+#include "scene_file.h"
+#include "scenes.h"
+#include "server.h"
 #include "sphere.h"
+#include "stats.h"
+#include "topology.h"
 #include "vec3.h"
 
+#include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
 #include <memory>
 #include <ostream>
 #include <string>
 #include <thread>
+#include <utility>
 #include <vector>
 
 #define DEFAULT_WIDTH 800
 #define DEFAULT_SAMPLES 100
 #define DEFAULT_DEPTH 50
-#define TILESIZE 32
-
-colour ray_colour(const ray& r, const hittable& world, int depth) {
-    hit_record rec;
-
-    if (depth <= 0) {
-	return colour(0, 0, 0);
+#define DEFAULT_SEED 0
+#define DEFAULT_THRESHOLD 0.02
+#define DEFAULT_PASS_SAMPLES 4
+#define DEFAULT_CHECKPOINT_SECONDS 30
+
+// write to a temporary and rename, so a viewer never sees a partial frame
+void writePreview(const std::string& path, image_writer& writer, const framebuffer& image, image_format format) {
+    const std::string temp = path + ".tmp";
+    {
+	std::ofstream out(temp, std::ios::binary);
+	writer.write(out, image, format);
     }
+    std::rename(temp.c_str(), path.c_str());
+}
 
-    if (world.hit(r, 0.001, infinity, rec)) {
-	ray scattered;
-	colour attenuation;
-	if (rec.mat_ptr->scatter(r, rec, attenuation, scattered)) {
-	    return attenuation * ray_colour(scattered, world, depth - 1);
+// the denoiser's inputs as linear pfms, for an external denoiser
+bool writeFeatures(const std::string& prefix, image_writer& writer, const feature_buffers& features) {
+    framebuffer depth(features.normal.width(), features.normal.height());
+    for (int y = 0; y < depth.height(); y++) {
+	for (int x = 0; x < depth.width(); x++) {
+	    const float d = features.normal.row(y)[x].a;
+	    depth.row(y)[x] = {d, d, d, 1.0f};
 	}
-
-	return colour(0, 0, 0);
     }
 
-    vec3 unit_direction = unit_vector(r.direction());
-    auto t = 0.5*(unit_direction.y() + 1.0);
-    return (1.0-t)*colour(1.0, 1.0, 1.0) + t*colour(0.5, 0.7, 1.0);
-}
-
-void three_balls(hittable_list& world, camera& cam, double aspect_ratio) {
-    auto material_ground = std::make_shared<lambertian>(colour(0.8, 0.8, 0.0));
-    auto material_center = std::make_shared<lambertian>(colour(0.1, 0.2, 0.5));
-    auto material_left   = std::make_shared<dielectric>(1.5);
-    auto material_right  = std::make_shared<metal>(colour(0.8, 0.6, 0.2), 0.0);
-
-    world.add(make_shared<sphere>(point3( 0.0, -100.5, -1.0), 100.0, material_ground));
-    world.add(make_shared<sphere>(point3( 0.0,    0.0, -1.0),   0.5, material_center));
-    world.add(make_shared<sphere>(point3(-1.0,    0.0, -1.0),   0.5, material_left));
-    world.add(make_shared<sphere>(point3(-1.0,    0.0, -1.0),  -0.4, material_left));
-    world.add(make_shared<sphere>(point3( 1.0,    0.0, -1.0),   0.5, material_right));
-
-    point3 lookfrom(3, 3, 2);
-    point3 lookat(0, 0, -1);
-    vec3 vup(0, 1, 0);
-    auto fov = 20;
-    auto dist_to_focus = (lookfrom-lookat).length();
-    auto aperture = 2.0;
-
-    cam = camera(lookfrom, lookat, vup, fov, aspect_ratio, aperture, dist_to_focus);
-}
-
-void two_balls(hittable_list& world, camera& cam, double aspect_ratio) {
-    auto R = cos(pi/4);
-    auto material_left = make_shared<lambertian>(colour(0, 0, 1));
-    auto material_right = make_shared<lambertian>(colour(1, 0, 0));
-
-    world.add(make_shared<sphere>(point3(-R, 0, -1), R, material_left));
-    world.add(make_shared<sphere>(point3( R, 0, -1), R, material_right));
-
-    point3 lookfrom(0, 0, 0);
-    point3 lookat(0, 0, -1);
-    vec3 vup(0, 1, 0);
-    auto fov = 90;
-    auto dist_to_focus = (lookfrom-lookat).length();
-    auto aperture = 0;
-
-    cam = camera(lookfrom, lookat, vup, fov, aspect_ratio, aperture, dist_to_focus);
+    const std::pair<const char*, const framebuffer*> files[] = {
+	{".albedo.pfm", &features.albedo}, {".normal.pfm", &features.normal}, {".depth.pfm", &depth}
+    };
+    for (const auto& file : files) {
+	std::ofstream out(prefix + file.first, std::ios::binary);
+	writer.write(out, *file.second, image_format::pfm);
+	if (!out) return false;
+    }
+    return true;
 }
 
-void random_balls(hittable_list& world, camera& cam, double& aspect_ratio) {
-    auto ground_mat = make_shared<lambertian>(colour(0.2, 0.6, 0.7));
-    world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, ground_mat));
-    
-    for (int a = -11; a < 11; a++) {
-	for (int b = -11; b < 11; b++) {
-	    auto choose_mat = random_double();
-	    point3 center(a + 0.9*random_double(), 0.2, b + 0.9*random_double());
-
-	    if ((center - point3(4, 0.2, 0)).length() > 0.9) {
-		shared_ptr<material> sphere_mat;
-
-		if (choose_mat < 0.8) {
-		    // diffuse
-		    auto albedo = colour::random() * colour::random();
-		    sphere_mat = make_shared<lambertian>(albedo);
-		    world.add(make_shared<sphere>(center, 0.2, sphere_mat));
-		} else if (choose_mat < 0.95) {
-		    // metal
-		    auto albedo = colour::random(0.5, 1);
-		    auto fuzz = random_double(0, 0.5);
-		    sphere_mat = make_shared<metal>(albedo, fuzz);
-		    world.add(make_shared<sphere>(center, 0.2, sphere_mat));
-		} else {
-		    // glass
-		    sphere_mat = make_shared<dielectric>(1.5);
-		    world.add(make_shared<sphere>(center, 0.2, sphere_mat));
-		}
-	    }
-	}
+// the built in scene, or a scene file when a path is given. objects, when
+// given, receives the built in scene's objects, which live as long as world.
+// BVHs are built on pool's threads when one is given
+bool loadWorld(const std::string& scene_path, uint64_t seed, camera& cam, double& aspect_ratio, std::unique_ptr<hittable>& world, std::string& error,
+	       std::vector<shared_ptr<hittable>>* objects = nullptr, worker_pool* pool = nullptr) {
+    seed_random(seed);
+    if (scene_path.empty()) {
+	hittable_list list;
+	//two_balls(list, cam, aspect_ratio);
+	//three_balls(list, cam, aspect_ratio);
+	random_balls(list, cam, aspect_ratio);
+	//instanced_balls(list, cam, aspect_ratio, 10000);
+	world.reset(new bvh(list, pool));
+	if (objects) *objects = list.objects;
+	return true;
     }
 
-    auto material1 = make_shared<dielectric>(1.5);
-    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
-    
-    auto material2 = make_shared<lambertian>(colour(0.4, 0.2, 0.1));
-    world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, material2));
-
-    auto material3 = make_shared<metal>(colour(0.7, 0.6, 0.5), 0.0);
-    world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
-
-    aspect_ratio = 3.0/2.0;
-
-    point3 lookfrom(12, 2, 3);
-    point3 lookat(0, 0, 0);
-    vec3 vup(0, 1, 0);
-    auto fov = 20;
-    auto dist_to_focus = 10;
-    auto aperture = 0.1;
-
-    cam = camera(lookfrom, lookat, vup, fov, aspect_ratio, aperture, dist_to_focus);
+    auto mapped = new mapped_scene();
+    world.reset(mapped);
+    if (!load_scene(scene_path, *mapped, error, pool)) return false;
+    cam = mapped->make_camera();
+    aspect_ratio = mapped->aspect_ratio();
+    return true;
 }
 
-std::atomic<int> atile;
-
-void renderImage(std::vector<colour>& image, const camera& cam, const hittable_list& world, int image_width, int image_height, int samples_per_pixel, int max_depth) {
-    // target tile size
-    const int tiles_x = image_width / TILESIZE;
-    const int tiles_y = image_height / TILESIZE;
-    const int tile_count = tiles_x * tiles_y;
-
-    // stretched tile size
-    const double tsize_x = double(image_width) / tiles_x;
-    const double tsize_y = double(image_height) / tiles_y;
-
-    // random delay so first batch of tiles don't race to output
-    std::this_thread::sleep_for(std::chrono::milliseconds(random_int(0, 200)));
-
-    // for each tile
-    while (true) {
-	int tile = atile++;
-	if (tile >= tile_count) break;
-
-	// tile offsets
-	const int tx = tile % tiles_x;
-	const int ty = tile / tiles_x;
-	const int start_x = static_cast<int>(tsize_x * tx);
-	const int start_y = static_cast<int>(tsize_y * ty);
-	const int end_x = static_cast<int>(tsize_x * (tx + 1));
-	const int end_y = static_cast<int>(tsize_y * (ty + 1));
-
-	// for each pixel in tile
-	for (int y = start_y; y < end_y; y++) {
-	    for (int x = start_x; x < end_x; x++) {
-		colour pixel_colour(0, 0, 0);
-		for (int s = 0; s < samples_per_pixel; s++) {
-		    auto u = double(x + random_double()) / (image_width - 1);
-		    auto v = 1.0 - double(y + random_double()) / (image_height - 1);
-		    ray r = cam.get_ray(u, v);
-		    pixel_colour += ray_colour(r, world, max_depth);
-		}
-		image[image_width*y+x] = pixel_colour / samples_per_pixel;
-	    }
+// how busy the pool's threads were while used was gathered, with a line
+// for each thread when per_thread is set
+void reportUtilisation(const worker_pool& pool, const worker_pool::usage& used, bool per_thread) {
+    if (used.wall <= 0) return;
+
+    auto percent = [](double part, double whole) { return std::round(1000 * part / whole) / 10; };
+    double total = 0, least = 1;
+    for (int i = 0; i < pool.size(); i++) {
+	const double busy = used.busy[i] / used.wall;
+	total += busy;
+	least = std::min(least, busy);
+	if (per_thread) {
+	    std::cerr << "thread " << i << " on ";
+	    if (pool.cpu(i) >= 0) std::cerr << "cpu " << pool.cpu(i) << ", node " << pool.node(i);
+	    else std::cerr << "any cpu";
+	    std::cerr << ": busy " << percent(used.busy[i], used.wall) << "%, on cpu " << percent(used.on_cpu[i], used.wall) << "%\n";
 	}
-
-	std::cerr << "\rtile " << tile << " of " << tile_count << " done\t\t\t" << std::flush;
     }
+    std::cerr << pool.size() << " threads over " << pool.node_count() << (pool.node_count() == 1 ? " node, " : " nodes, ") << percent(total, pool.size()) << "% busy on average, " << percent(least, 1) << "% at least\n";
 }
 
 int main(int argc, char *argv[]) {
@@ -187,29 +125,195 @@ int main(int argc, char *argv[]) {
     int image_width = DEFAULT_WIDTH;
     int samples_per_pixel = DEFAULT_SAMPLES;
     int max_depth = DEFAULT_DEPTH;
+    uint64_t seed = DEFAULT_SEED;
+    render_mode mode = render_mode::path;
+    double threshold = DEFAULT_THRESHOLD;
+    image_format format = image_format::p6;
+    sample_pattern pattern = sample_pattern::sobol;
+    int pass_samples = 0;
+    double time_budget = 0;
+    std::string preview_path;
+    std::string trace_path;
+    std::string scene_path;
+    std::vector<std::string> workers;
+    int worker_port = 0;
+    int serve_port = -1;
+    int frame_count = 0;
+    std::string output_pattern;
+    bool denoise_image = false;
+    std::string features_prefix;
+    pool_config threads;
+    bool replicate = false;
+    bool per_thread_usage = false;
+    std::string checkpoint_path;
+    double checkpoint_seconds = DEFAULT_CHECKPOINT_SECONDS;
+
+    // options may appear anywhere, everything else is positional
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; i++) {
+	std::string arg = argv[i];
+	if (arg == "--wavefront") {
+	    mode = render_mode::wavefront;
+	} else if (arg.rfind("--adaptive", 0) == 0) {
+	    mode = render_mode::adaptive;
+	    if (arg.size() > 11 && arg[10] == '=') threshold = std::stod(arg.substr(11));
+	} else if (arg.rfind("--format=", 0) == 0) {
+	    if (!parse_image_format(arg.substr(9), format)) {
+		std::cerr << "unknown format " << arg.substr(9) << ", expected p3, p6, png or pfm\n";
+		return 1;
+	    }
+	} else if (arg.rfind("--sampler=", 0) == 0) {
+	    if (!parse_sample_pattern(arg.substr(10), pattern)) {
+		std::cerr << "unknown sampler " << arg.substr(10) << ", expected random, sobol or bluenoise\n";
+		return 1;
+	    }
+	} else if (arg.rfind("--progressive", 0) == 0) {
+	    pass_samples = DEFAULT_PASS_SAMPLES;
+	    if (arg.size() > 14 && arg[13] == '=') pass_samples = std::max(1, std::stoi(arg.substr(14)));
+	} else if (arg.rfind("--time=", 0) == 0) {
+	    time_budget = std::stod(arg.substr(7));
+	} else if (arg.rfind("--preview=", 0) == 0) {
+	    preview_path = arg.substr(10);
+	} else if (arg.rfind("--trace=", 0) == 0) {
+	    trace_path = arg.substr(8);
+	} else if (arg.rfind("--worker=", 0) == 0) {
+	    worker_port = std::stoi(arg.substr(9));
+	} else if (arg.rfind("--serve=", 0) == 0) {
+	    serve_port = arg.substr(8) == "stdio" ? 0 : std::stoi(arg.substr(8));
+	} else if (arg.rfind("--workers=", 0) == 0) {
+	    std::string list = arg.substr(10);
+	    for (size_t start = 0, end; start < list.size(); start = end + 1) {
+		end = list.find(',', start);
+		if (end == std::string::npos) end = list.size();
+		if (end > start) workers.push_back(list.substr(start, end - start));
+	    }
+	} else if (arg.rfind("--frames=", 0) == 0) {
+	    frame_count = std::max(1, std::stoi(arg.substr(9)));
+	} else if (arg.rfind("--output=", 0) == 0) {
+	    output_pattern = arg.substr(9);
+	} else if (arg == "--denoise") {
+	    denoise_image = true;
+	} else if (arg.rfind("--features=", 0) == 0) {
+	    features_prefix = arg.substr(11);
+	} else if (arg.rfind("--threads=", 0) == 0) {
+	    threads.threads = std::max(0, std::stoi(arg.substr(10)));
+	} else if (arg.rfind("--pin=", 0) == 0) {
+	    if (!parse_pin_policy(arg.substr(6), threads.pinning)) {
+		std::cerr << "unknown pinning " << arg.substr(6) << ", expected none, compact or scatter\n";
+		return 1;
+	    }
+	} else if (arg == "--no-smt") {
+	    threads.smt = false;
+	} else if (arg == "--replicate") {
+	    replicate = true;
+	} else if (arg == "--utilisation") {
+	    per_thread_usage = true;
+	} else if (arg.rfind("--checkpoint=", 0) == 0) {
+	    checkpoint_path = arg.substr(13);
+	} else if (arg.rfind("--checkpoint-every=", 0) == 0) {
+	    checkpoint_seconds = std::stod(arg.substr(19));
+	} else if (arg.rfind("--scene=", 0) == 0) {
+	    scene_path = arg.substr(8);
+	} else {
+	    args.push_back(arg);
+	}
+    }
 
-    switch (argc) {
+    switch (args.size()) {
 	case 4:
-	    max_depth = std::stoi(argv[3]);
-	    if (max_depth == 0) max_depth = DEFAULT_DEPTH;
+	    seed = std::stoull(args[3]);
 	case 3:
-	    samples_per_pixel = std::stoi(argv[2]);
-	    if (samples_per_pixel == 0) samples_per_pixel = DEFAULT_SAMPLES;
+	    max_depth = std::stoi(args[2]);
+	    if (max_depth == 0) max_depth = DEFAULT_DEPTH;
 	case 2:
-	    image_width = std::stoi(argv[1]);
+	    samples_per_pixel = std::stoi(args[1]);
+	    if (samples_per_pixel == 0) samples_per_pixel = DEFAULT_SAMPLES;
+	case 1:
+	    image_width = std::stoi(args[0]);
 	    if (image_width == 0) image_width = DEFAULT_WIDTH;
     }
 
+    if (time_budget > 0 && pass_samples == 0) pass_samples = DEFAULT_PASS_SAMPLES;
+
+    // threads
+    const cpu_topology topology = cpu_topology::detect();
+    const int count = static_cast<int>(topology.placement(threads).size());
+
+    if (worker_port > 0) {
+	return runWorker(worker_port, count, [](const std::string& path, uint64_t scene_seed, camera& cam, std::unique_ptr<hittable>& world, std::string& error) {
+	    double aspect_ratio = 16.0/9.0;
+	    return loadWorld(path, scene_seed, cam, aspect_ratio, world, error);
+	});
+    }
+
+    // the scene is built and every frame rendered on the same threads
+    render_pool pool(threads, topology);
+    if (replicate && threads.pinning == pin_policy::none) {
+	std::cerr << "--replicate copies the scene to each node's pinned threads, add --pin\n";
+	return 1;
+    }
+
+    if (serve_port >= 0) {
+	return runServer(pool, [&pool](const std::string& path, uint64_t scene_seed, camera& cam, std::unique_ptr<hittable>& world, std::string& error) {
+	    double aspect_ratio = 16.0/9.0;
+	    return loadWorld(path, scene_seed, cam, aspect_ratio, world, error, nullptr, &pool);
+	}, serve_port);
+    }
+
     // world
     auto aspect_ratio = 16.0/9.0;
-    hittable_list world;
     camera cam;
-    //two_balls(world, cam, aspect_ratio);
-    //three_balls(world, cam, aspect_ratio);
-    random_balls(world, cam, aspect_ratio);
+    std::unique_ptr<hittable> world_ptr;
+    std::string error;
+    std::vector<shared_ptr<hittable>> objects;
+    auto build_start = std::chrono::steady_clock::now();
+    if (!loadWorld(scene_path, seed, cam, aspect_ratio, world_ptr, error, &objects, &pool)) {
+	std::cerr << error << "\n";
+	return 1;
+    }
+
+    // a copy of the scene per numa node, each loaded by one of the node's
+    // threads so its memory is allocated there. the scene file is compiled
+    // above, so the copies only map and copy it
+    std::vector<std::unique_ptr<hittable>> replicas;
+    std::vector<std::vector<shared_ptr<hittable>>> replica_objects;
+    if (replicate && pool.node_count() > 1) {
+	replicas.resize(pool.node_count());
+	replica_objects.resize(pool.node_count());
+	std::vector<std::string> errors(pool.node_count());
+	pool.run([&](int worker) {
+	    const int node = pool.node(worker);
+	    for (int i = 0; i < worker; i++) {
+		if (pool.node(i) == node) return;
+	    }
+	    camera node_cam;
+	    double node_aspect;
+	    if (!loadWorld(scene_path, seed, node_cam, node_aspect, replicas[node], errors[node], &replica_objects[node])) return;
+	    if (auto mapped = dynamic_cast<mapped_scene*>(replicas[node].get())) mapped->localize();
+	});
+	for (const auto& e : errors) {
+	    if (!e.empty()) {
+		std::cerr << e << "\n";
+		return 1;
+	    }
+	}
+	world_ptr = std::move(replicas[0]);
+	objects = std::move(replica_objects[0]);
+    }
+    std::vector<const hittable*> worlds = {world_ptr.get()};
+    for (size_t i = 1; i < replicas.size(); i++) worlds.push_back(replicas[i].get());
+
+    const hittable& scene = *world_ptr;
+    const std::chrono::duration<double> build_time = std::chrono::steady_clock::now() - build_start;
+    if (auto mapped = dynamic_cast<const mapped_scene*>(&scene)) {
+	std::cerr << "Loaded " << mapped->size() << " spheres from " << scene_path << "\n";
+    }
+    if (worlds.size() > 1) {
+	std::cerr << "Scene replicated on " << worlds.size() << " numa nodes\n";
+    }
 
     // image
-    const long image_height = static_cast<long>(image_width / aspect_ratio);
+    const long image_height = image_height_for(image_width, aspect_ratio);
     const long rays_per_line = image_width * samples_per_pixel;
     const long total_rays = rays_per_line * image_height;
 
@@ -217,31 +321,216 @@ int main(int argc, char *argv[]) {
     std::cerr << total_rays << " rays to cast\n";
 
     // render
-    std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
     const int pixel_count = image_height * image_width;
-    std::vector<colour> image(pixel_count);
+    framebuffer image(image_width, image_height);
+    const bool want_features = denoise_image || !features_prefix.empty();
+    std::unique_ptr<feature_buffers> features(want_features ? new feature_buffers(image_width, image_height) : nullptr);
+    std::unique_ptr<render_checkpoint> checkpoint(checkpoint_path.empty() ? nullptr : new render_checkpoint(checkpoint_seconds));
+    const render_settings settings = {image_width, static_cast<int>(image_height), samples_per_pixel, max_depth, seed, mode, threshold, true, pattern, 0, features.get(), checkpoint.get()};
+    denoiser filter;
+
+    image_writer writer(image_width, image_height);
+
+    // spread frames over remote workers when any are given
+    auto render = [&](framebuffer& frame, const render_settings& frame_settings) {
+	if (workers.empty()) {
+	    pool.render(frame, cam, worlds, frame_settings);
+	} else {
+	    renderFrameDistributed(frame, cam, scene, frame_settings, count, workers, scene_path, seed);
+	}
+    };
 
-    // threads
-    auto count = std::thread::hardware_concurrency();
-    std::vector<std::thread> threads;
+    // build the mask before the clock starts
+    if (pattern == sample_pattern::blue_noise) blue_noise_mask::get();
 
-    auto start = std::chrono::steady_clock::now();
-    for (int i = 0; i < count; i++) {
-	threads.emplace_back(std::thread(renderImage, std::ref(image), std::ref(cam), std::ref(world), image_width, image_height, samples_per_pixel, max_depth));
+    // features are gathered by local tiles in one pass over the frame
+    if (want_features && (pass_samples > 0 || time_budget > 0 || !workers.empty())) {
+	std::cerr << "--denoise and --features need the frame rendered in one pass on local threads, drop --progressive, --time and --workers\n";
+	return 1;
     }
-    for (auto &t : threads) {
-	t.join();
+
+    // the checkpoint holds colour only, for tiles rendered here
+    if (checkpoint && (want_features || frame_count > 0 || !workers.empty())) {
+	std::cerr << "--checkpoint keeps one image rendered on local threads, drop --denoise, --features, --frames and --workers\n";
+	return 1;
+    }
+    long resumed_samples = 0;
+    if (checkpoint) {
+	if (!checkpoint->open(checkpoint_path, render_checkpoint::describe(settings, pass_samples, scene_path), error)) {
+	    std::cerr << error << ", delete it to start again\n";
+	    return 1;
+	}
+	resumed_samples = checkpoint->samples_total();
+	const long finished = checkpoint->pixels_with(samples_per_pixel);
+	if (checkpoint->samples_done() > 0 || finished > 0) {
+	    std::cerr << "Resuming " << checkpoint_path << ": " << finished << " of " << pixel_count << " pixels done";
+	    if (checkpoint->samples_done() > 0) std::cerr << ", every pixel has " << checkpoint->samples_done() << " samples at least";
+	    std::cerr << "\n";
+	}
+    }
+
+    if (frame_count > 0) {
+	if (!features_prefix.empty()) {
+	    std::cerr << "--features writes one image's features, drop --frames\n";
+	    return 1;
+	}
+	if (pass_samples > 0 || time_budget > 0 || !workers.empty()) {
+	    std::cerr << "--frames renders each frame in one pass on local threads, drop --progressive, --time and --workers\n";
+	    return 1;
+	}
+	if (output_pattern.empty()) {
+	    const char* extensions[] = {"ppm", "ppm", "png", "pfm"};
+	    output_pattern = std::string("frame%04d.") + extensions[static_cast<int>(format)];
+	}
+
+	animation anim(cam);
+	anim.add_bouncers(objects);
+	bvh* hierarchy = dynamic_cast<bvh*>(world_ptr.get());
+
+	// the other nodes' copies hold objects of their own, moved in step
+	std::vector<animation> copy_anims;
+	std::vector<bvh*> copy_hierarchies;
+	for (size_t i = 1; i < replicas.size(); i++) {
+	    copy_anims.emplace_back(cam);
+	    copy_anims.back().add_bouncers(replica_objects[i]);
+	    copy_hierarchies.push_back(dynamic_cast<bvh*>(replicas[i].get()));
+	}
+	std::cerr << frame_count << " frames, " << anim.bouncer_count() << " moving spheres\n";
+
+	// the pool and scene persist across frames. each frame is encoded and
+	// written on its own thread while the next one renders into the other buffer
+	framebuffer frames[2] = {framebuffer(image_width, image_height), framebuffer(image_width, image_height)};
+	render_settings frame_settings = settings;
+	frame_settings.progress = false;
+	std::thread output;
+	bool output_failed = false;
+
+	pool.reset_utilisation();
+	auto start = std::chrono::steady_clock::now();
+	for (int f = 0; f < frame_count; f++) {
+	    const double t = double(f) / frame_count;
+	    auto frame_start = std::chrono::steady_clock::now();
+	    anim.move_objects(t);
+	    if (hierarchy) hierarchy->refit();
+	    for (size_t i = 0; i < copy_anims.size(); i++) {
+		copy_anims[i].move_objects(t);
+		if (copy_hierarchies[i]) copy_hierarchies[i]->refit();
+	    }
+	    const camera frame_cam = anim.camera_at(t);
+	    framebuffer& frame = frames[f % 2];
+	    pool.render(frame, frame_cam, worlds, frame_settings);
+	    if (denoise_image) filter.run(frame, *features, &pool);
+	    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - frame_start;
+
+	    if (output.joinable()) output.join();
+	    char path[4096];
+	    std::snprintf(path, sizeof(path), output_pattern.c_str(), f);
+	    output = std::thread([&writer, &frame, &output_failed, format, file = std::string(path)] {
+		std::ofstream out(file, std::ios::binary);
+		writer.write(out, frame, format);
+		if (!out) output_failed = true;
+	    });
+	    std::cerr << "frame " << f + 1 << " of " << frame_count << ": " << path << " in " << elapsed.count() << " seconds\n";
+	}
+	if (output.joinable()) output.join();
+
+	std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
+	int krps = asamples / 1000.0 / diff.count();
+	std::cerr << "Done.\n" << diff.count() << " seconds [" << krps << " krps], scene built in " << build_time.count() << " seconds\n";
+	reportUtilisation(pool, pool.utilisation(), per_thread_usage);
+	if (output_failed) {
+	    std::cerr << "could not write every frame\n";
+	    return 1;
+	}
+	return 0;
+    }
+
+    pool.reset_utilisation();
+    auto start = std::chrono::steady_clock::now();
+    if (pass_samples == 0 && time_budget == 0) {
+	render(image, settings);
+	if (checkpoint) checkpoint->resolve(image);
+    } else {
+	// progressive: add passes into an accumulator until the sample
+	// target or the time budget is reached, previewing after each one
+	// a checkpoint is the accumulator when there is one, and picks up where
+	// the killed render stopped
+	std::vector<colour> accum(checkpoint ? 0 : pixel_count);
+	framebuffer pass_image(image_width, image_height);
+	int samples_done = checkpoint ? checkpoint->samples_done() : 0;
+	if (checkpoint) checkpoint->resolve(image);
+
+	for (int pass = 0; samples_done < samples_per_pixel; pass++) {
+	    render_settings pass_settings = settings;
+	    pass_settings.samples_per_pixel = std::min(pass_samples, samples_per_pixel - samples_done);
+	    pass_settings.first_sample = samples_done;
+	    render(pass_image, pass_settings);
+
+	    samples_done += pass_settings.samples_per_pixel;
+	    if (checkpoint) {
+		checkpoint->resolve(image);
+	    } else {
+		for (int y = 0; y < image_height; y++) {
+		    for (int x = 0; x < image_width; x++) {
+			colour& sum = accum[y * image_width + x];
+			sum += pass_settings.samples_per_pixel * pass_image.get(x, y);
+			image.set(x, y, sum / samples_done);
+		    }
+		}
+	    }
+
+	    if (!preview_path.empty()) {
+		writePreview(preview_path, writer, image, format);
+	    }
+
+	    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	    std::cerr << "\npass " << pass + 1 << ": " << samples_done << " samples per pixel after " << elapsed.count() << " seconds";
+	    if (time_budget > 0 && elapsed.count() >= time_budget) break;
+	}
     }
     auto end = std::chrono::steady_clock::now();
+    const worker_pool::usage render_usage = pool.utilisation();
+
+    // after the clock, so krps stays a measure of the tracing alone
+    std::chrono::duration<double> denoise_time(0);
+    if (denoise_image) {
+	auto denoise_start = std::chrono::steady_clock::now();
+	filter.run(image, *features, &pool);
+	denoise_time = std::chrono::steady_clock::now() - denoise_start;
+    }
 
     std::cerr << "\nDone.\n";
     std::chrono::duration<double> diff = end - start;
-    int krps = total_rays / 1000.0 / diff.count();
-    std::cerr << diff.count() << " seconds [" << krps << " krps]\n";
+    // asamples has this run's samples alone, tiles a checkpoint held aren't rendered
+    int krps = asamples / 1000.0 / diff.count();
+    std::cerr << diff.count() << " seconds [" << krps << " krps], scene built in " << build_time.count() << " seconds\n";
+    reportUtilisation(pool, render_usage, per_thread_usage);
+    if (denoise_image) {
+	std::cerr << "denoised in " << denoise_time.count() << " seconds\n";
+    }
+    if (!features_prefix.empty() && !writeFeatures(features_prefix, writer, *features)) {
+	std::cerr << "could not write the features to " << features_prefix << ".*.pfm\n";
+	return 1;
+    }
+    const long image_samples = checkpoint ? checkpoint->samples_total() : long(asamples);
+    if (image_samples != total_rays) {
+	std::cerr << double(image_samples) / pixel_count << " samples per pixel on average\n";
+    }
+    if (resumed_samples > 0) {
+	std::cerr << double(asamples) / pixel_count << " samples per pixel rendered this run, "
+		  << double(resumed_samples) / pixel_count << " resumed from " << checkpoint_path << "\n";
+    }
 
-    for (colour c : image) {
-	std::cout << static_cast<int>(256 * clamp(c.x(), 0.0, 0.999)) << ' '
-		  << static_cast<int>(256 * clamp(c.y(), 0.0, 0.999)) << ' '
-		  << static_cast<int>(256 * clamp(c.z(), 0.0, 0.999)) << '\n';
+#ifdef TRACE_STATS
+    global_stats().print(std::cerr);
+    if (!trace_path.empty()) {
+	global_stats().write_chrome_trace(trace_path);
     }
+#else
+    if (!trace_path.empty()) {
+	std::cerr << "--trace needs a build with -DTRACE_STATS\n";
+    }
+#endif
+
+    writer.write(std::cout, image, format);
 }
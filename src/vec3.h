@@ -5,54 +5,65 @@
 #include <cmath>
 #include <iostream>
 
+#if defined(TRACE_SIMD_VEC3) && defined(__SSE4_1__)
+#include <smmintrin.h>
+#endif
+
 using std::sqrt;
 using std::fabs;
 
-class vec3 {
+// three component vector over scalar type T
+//
+// arithmetic is defined as hidden friends so mixed expressions such as
+// 0.5 * v still work when T is float
+template <typename T>
+class vec3_t {
     public:
-	vec3() : e{0,0,0} {}
-	vec3(double e0, double e1, double e2) : e{e0, e1, e2} {}
+	using value_type = T;
+
+	vec3_t() : e{0,0,0} {}
+	vec3_t(T e0, T e1, T e2) : e{e0, e1, e2} {}
 
-	double x() const { return e[0]; }
-	double y() const { return e[1]; }
-	double z() const { return e[2]; }
+	T x() const { return e[0]; }
+	T y() const { return e[1]; }
+	T z() const { return e[2]; }
 
-	vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
-	double operator[](int i) const { return e[i]; }
-	double& operator[](int i) { return e[i]; }
+	vec3_t operator-() const { return vec3_t(-e[0], -e[1], -e[2]); }
+	T operator[](int i) const { return e[i]; }
+	T& operator[](int i) { return e[i]; }
 
-	vec3& operator+=(const vec3 &v) {
+	vec3_t& operator+=(const vec3_t &v) {
 	    e[0] += v.e[0];
 	    e[1] += v.e[1];
 	    e[2] += v.e[2];
 	    return *this;
 	}
 
-	vec3& operator*=(const double t) {
+	vec3_t& operator*=(const T t) {
 	    e[0] *= t;
 	    e[1] *= t;
 	    e[2] *= t;
 	    return *this;
 	}
 
-	vec3 operator/=(const double t) {
+	vec3_t operator/=(const T t) {
 	    return *this *= 1/t;
 	}
 
-	double length() const {
+	T length() const {
 	    return sqrt(length_squared());
 	}
 
-	double length_squared() const {
+	T length_squared() const {
 	    return e[0]*e[0] + e[1]*e[1] + e[2]*e[2];
 	}
 
-	inline static vec3 random() {
-	    return vec3(random_double(), random_double(), random_double());
+	inline static vec3_t random() {
+	    return vec3_t(random_double(), random_double(), random_double());
 	}
 
-	inline static vec3 random(double min, double max) {
-	    return vec3(random_double(min, max), random_double(min, max), random_double(min, max));
+	inline static vec3_t random(double min, double max) {
+	    return vec3_t(random_double(min, max), random_double(min, max), random_double(min, max));
 	}
 
 	bool near_zero() const {
@@ -60,93 +71,155 @@ class vec3 {
 	    return (fabs(e[0]) < s) && (fabs(e[1]) < s) && (fabs(e[2]) < s);
 	}
 
+	friend std::ostream& operator<<(std::ostream &out, const vec3_t &v) {
+	    return out << v.e[0] << ' ' << v.e[1] << ' ' << v.e[2];
+	}
+
+	friend vec3_t operator+(const vec3_t &u, const vec3_t &v) {
+	    return vec3_t(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
+	}
+
+	friend vec3_t operator-(const vec3_t &u, const vec3_t &v) {
+	    return vec3_t(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
+	}
+
+	friend vec3_t operator*(const vec3_t &u, const vec3_t &v) {
+	    return vec3_t(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
+	}
+
+	friend vec3_t operator*(T t, const vec3_t &v) {
+	    return vec3_t(t*v.e[0], t*v.e[1], t*v.e[2]);
+	}
+
+	friend vec3_t operator*(const vec3_t &v, T t) {
+	    return t*v;
+	}
+
+	friend vec3_t operator/(const vec3_t &v, T t) {
+	    return (1/t)*v;
+	}
+
+	friend T dot(const vec3_t &u, const vec3_t &v) {
+	    return u.e[0] * v.e[0]
+		 + u.e[1] * v.e[1]
+		 + u.e[2] * v.e[2];
+	}
+
+	friend vec3_t cross(const vec3_t &u, const vec3_t &v) {
+	    return vec3_t(u.e[1] * v.e[2] - u.e[2] * v.e[1],
+			u.e[2] * v.e[0] - u.e[0] * v.e[2],
+			u.e[0] * v.e[1] - u.e[1] * v.e[0]);
+	}
+
+	friend vec3_t unit_vector(vec3_t v) {
+	    return v / v.length();
+	}
+
     public:
-	double e[3];
+	T e[3];
 };
 
-using point3 = vec3;
-using colour = vec3;
+#if defined(TRACE_SIMD_VEC3) && defined(__SSE4_1__)
 
-inline std::ostream& operator<<(std::ostream &out, const vec3 &v) {
-    return out << v.e[0] << ' ' << v.e[1] << ' ' << v.e[2];
-}
+// float vectors padded to four lanes and kept in an sse register
+template <>
+class vec3_t<float> {
+    public:
+	using value_type = float;
 
-inline vec3 operator+(const vec3 &u, const vec3 &v) {
-    return vec3(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
-}
+	vec3_t() : v(_mm_setzero_ps()) {}
+	vec3_t(float e0, float e1, float e2) : v(_mm_set_ps(0, e2, e1, e0)) {}
+	explicit vec3_t(__m128 m) : v(m) {}
 
-inline vec3 operator-(const vec3 &u, const vec3 &v) {
-    return vec3(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
-}
+	float x() const { return e[0]; }
+	float y() const { return e[1]; }
+	float z() const { return e[2]; }
 
-inline vec3 operator*(const vec3 &u, const vec3 &v) {
-    return vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
-}
+	vec3_t operator-() const { return vec3_t(_mm_sub_ps(_mm_setzero_ps(), v)); }
+	float operator[](int i) const { return e[i]; }
+	float& operator[](int i) { return e[i]; }
 
-inline vec3 operator*(double t, const vec3 &v) {
-    return vec3(t*v.e[0], t*v.e[1], t*v.e[2]);
-}
+	vec3_t& operator+=(const vec3_t &u) {
+	    v = _mm_add_ps(v, u.v);
+	    return *this;
+	}
 
-inline vec3 operator*(const vec3 &v, double t) {
-    return t*v;
-}
+	vec3_t& operator*=(const float t) {
+	    v = _mm_mul_ps(v, _mm_set1_ps(t));
+	    return *this;
+	}
 
-inline vec3 operator/(const vec3 &v, double t) {
-    return (1/t)*v;
-}
+	vec3_t operator/=(const float t) {
+	    return *this *= 1/t;
+	}
 
-inline double dot(const vec3 &u, const vec3 &v) {
-    return u.e[0] * v.e[0]
-	 + u.e[1] * v.e[1]
-	 + u.e[2] * v.e[2];
-}
+	float length() const {
+	    return sqrt(length_squared());
+	}
 
-inline vec3 cross(const vec3 &u, const vec3 &v) {
-    return vec3(u.e[1] * v.e[2] - u.e[2] * v.e[1],
-		u.e[2] * v.e[0] - u.e[0] * v.e[2],
-		u.e[0] * v.e[1] - u.e[1] * v.e[0]);
-}
+	float length_squared() const {
+	    return _mm_cvtss_f32(_mm_dp_ps(v, v, 0x71));
+	}
+
+	inline static vec3_t random() {
+	    return vec3_t(random_double(), random_double(), random_double());
+	}
+
+	inline static vec3_t random(double min, double max) {
+	    return vec3_t(random_double(min, max), random_double(min, max), random_double(min, max));
+	}
+
+	bool near_zero() const {
+	    const __m128 abs = _mm_andnot_ps(_mm_set1_ps(-0.0f), v);
+	    return (_mm_movemask_ps(_mm_cmplt_ps(abs, _mm_set1_ps(1e-8f))) & 0x7) == 0x7;
+	}
+
+	friend std::ostream& operator<<(std::ostream &out, const vec3_t &u) {
+	    return out << u.e[0] << ' ' << u.e[1] << ' ' << u.e[2];
+	}
+
+	friend vec3_t operator+(const vec3_t &a, const vec3_t &b) { return vec3_t(_mm_add_ps(a.v, b.v)); }
+	friend vec3_t operator-(const vec3_t &a, const vec3_t &b) { return vec3_t(_mm_sub_ps(a.v, b.v)); }
+	friend vec3_t operator*(const vec3_t &a, const vec3_t &b) { return vec3_t(_mm_mul_ps(a.v, b.v)); }
+	friend vec3_t operator*(float t, const vec3_t &a) { return vec3_t(_mm_mul_ps(_mm_set1_ps(t), a.v)); }
+	friend vec3_t operator*(const vec3_t &a, float t) { return t*a; }
+	friend vec3_t operator/(const vec3_t &a, float t) { return (1/t)*a; }
+
+	friend float dot(const vec3_t &a, const vec3_t &b) {
+	    return _mm_cvtss_f32(_mm_dp_ps(a.v, b.v, 0x71));
+	}
+
+	friend vec3_t cross(const vec3_t &a, const vec3_t &b) {
+	    const __m128 a_yzx = _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(3, 0, 2, 1));
+	    const __m128 b_yzx = _mm_shuffle_ps(b.v, b.v, _MM_SHUFFLE(3, 0, 2, 1));
+	    const __m128 c = _mm_sub_ps(_mm_mul_ps(a.v, b_yzx), _mm_mul_ps(a_yzx, b.v));
+	    return vec3_t(_mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1)));
+	}
+
+	friend vec3_t unit_vector(vec3_t u) {
+	    return u / u.length();
+	}
+
+    public:
+	union {
+	    __m128 v;
+	    float e[4]; // e[3] is padding and always zero
+	};
+};
+
+#endif
+
+using vec3 = vec3_t<real>;
+using point3 = vec3;
+using colour = vec3;
 
 vec3 reflect(const vec3& v, const vec3& n) {
     return v - 2 * dot(v, n) * n;
 }
 
-vec3 refract(const vec3& uv, const vec3& n, double etai_over_etat) {
+vec3 refract(const vec3& uv, const vec3& n, real etai_over_etat) {
     auto cos_theta = fmin(dot(-uv, n), 1.0);
     vec3 r_out_perp = etai_over_etat * (uv + cos_theta * n);
     vec3 r_out_parallel = -sqrt(fabs(1.0 - r_out_perp.length_squared())) * n;
     return r_out_perp + r_out_parallel;
 }
-
-inline vec3 unit_vector(vec3 v) {
-    return v / v.length();
-}
-
-vec3 random_in_unit_sphere() {
-    while (true) {
-	auto p = vec3::random(-1, 1);
-	if (p.length_squared() >= 1) continue;
-	return p;
-    }
-}
-
-vec3 random_unit_vector() {
-    return unit_vector(random_in_unit_sphere());
-}
-
-vec3 random_in_hemisphere(const vec3& normal) {
-    vec3 in_unit_sphere = random_in_unit_sphere();
-    if(dot(in_unit_sphere, normal) > 0.0) {
-	return in_unit_sphere;
-    } else {
-	return -in_unit_sphere;
-    }
-}
-
-vec3 random_in_unit_disk() {
-    while (true) {
-	auto p = vec3(random_double(-1, 1), random_double(-1, 1), 0);
-	if (p.length_squared() >= 1) continue;
-	return p;
-    }
-}
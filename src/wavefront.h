@@ -0,0 +1,212 @@
+#pragma once
+
+#include "arena.h"
+#include "camera.h"
+#include "common.h"
+#include "hittable.h"
+#include "material.h"
+#include "render.h"
+#include "sampling.h"
+#include "stats.h"
+#include "vec3.h"
+
+#include <algorithm>
+#include <optional>
+#include <vector>
+
+// breadth first tile renderer
+//
+// every sample of a tile becomes a path in a queue. each bounce intersects
+// the whole queue, sorts the hits by material kind and shades each kind in
+// one run of its own kernel, then compacts the scattered rays into the next
+// queue. paths carry their own sampler so the result doesn't depend on queue
+// order
+class wavefront_renderer {
+    public:
+	// upper bound on paths in flight, samples are split into passes to fit
+	static const int max_paths = 1 << 16;
+
+	void render_tile(framebuffer& image, const camera& cam, const hittable& world, const render_settings& settings, const tile_bounds& tile);
+
+    private:
+	struct path {
+	    ray r;
+	    colour throughput;
+	    int pixel; // index into the tile accumulator
+	    sampler samples;
+	};
+
+	void generate(const camera& cam, const render_settings& settings, const tile_bounds& tile, int first_sample, int sample_count);
+	void intersect(const hittable& world, int bounce);
+	void shade(int bounce);
+
+	template <material_kind K>
+	void shade_run(const int* begin, const int* end, int bounce);
+
+	// a path's contribution is known once it ends, which is when its
+	// sample reaches the pixel's features
+	void end_path(const path& p, const colour& c) {
+	    if (collect_features) features[p.pixel].add_sample(c);
+	}
+
+	// per tile, carved from the thread's scratch arena
+	scratch_array<path> paths;
+	scratch_array<path> next_paths;
+	scratch_array<hit_record> hits;
+	scratch_array<int> order;
+	scratch_array<colour> accum;
+	scratch_array<feature_sum> features;
+	bool collect_features = false;
+};
+
+void wavefront_renderer::render_tile(framebuffer& image, const camera& cam, const hittable& world, const render_settings& settings, const tile_bounds& tile) {
+    const int tile_width = tile.end_x - tile.start_x;
+    const int tile_pixels = tile_width * (tile.end_y - tile.start_y);
+    const int samples_per_pass = std::max(1, std::min(settings.samples_per_pixel, max_paths / std::max(1, tile_pixels)));
+    const int queue_size = samples_per_pass * tile_pixels;
+
+    arena& scratch = thread_scratch();
+    paths = scratch_array<path>(scratch, queue_size);
+    next_paths = scratch_array<path>(scratch, queue_size);
+    hits = scratch_array<hit_record>(scratch, queue_size);
+    order = scratch_array<int>(scratch, queue_size);
+    accum = scratch_array<colour>(scratch, tile_pixels);
+    accum.assign(tile_pixels, colour(0, 0, 0));
+    collect_features = settings.features != nullptr;
+    if (collect_features) {
+	features = scratch_array<feature_sum>(scratch, tile_pixels);
+	features.assign(tile_pixels, feature_sum());
+    }
+
+    for (int s = 0; s < settings.samples_per_pixel; s += samples_per_pass) {
+	generate(cam, settings, tile, s, std::min(samples_per_pass, settings.samples_per_pixel - s));
+
+	for (int bounce = 0; bounce < settings.max_depth && !paths.empty(); bounce++) {
+	    intersect(world, bounce);
+	    shade(bounce);
+	}
+
+	// paths still alive ran out of depth and contribute nothing
+	for (size_t i = 0; i < paths.size(); i++) {
+	    STAT_PATH(settings.max_depth);
+	    end_path(paths[i], colour(0, 0, 0));
+	}
+	paths.clear();
+    }
+
+    tile_buffer pixels(scratch, tile);
+    std::optional<feature_tile> feature_pixels;
+    if (collect_features) feature_pixels.emplace(scratch, tile);
+    for (int y = tile.start_y; y < tile.end_y; y++) {
+	for (int x = tile.start_x; x < tile.end_x; x++) {
+	    const int i = (y - tile.start_y) * tile_width + (x - tile.start_x);
+	    pixels.set(x, y, accum[i] / settings.samples_per_pixel);
+	    if (feature_pixels) feature_pixels->set(x, y, features[i]);
+	}
+    }
+    pixels.commit(image);
+    if (feature_pixels) feature_pixels->commit(*settings.features);
+}
+
+void wavefront_renderer::generate(const camera& cam, const render_settings& settings, const tile_bounds& tile, int first_sample, int sample_count) {
+    const int tile_width = tile.end_x - tile.start_x;
+    paths.clear();
+
+    for (int y = tile.start_y; y < tile.end_y; y++) {
+	for (int x = tile.start_x; x < tile.end_x; x++) {
+	    thread_sampler().start_pixel(settings.pattern, settings.seed, x, y, settings.image_width);
+
+	    for (int s = first_sample; s < first_sample + sample_count; s++) {
+		thread_sampler().start_sample(settings.first_sample + s);
+		auto u = double(x + sample_1d()) / (settings.image_width - 1);
+		auto v = 1.0 - double(y + sample_1d()) / (settings.image_height - 1);
+
+		path p;
+		p.r = cam.get_ray(u, v);
+		p.throughput = colour(1, 1, 1);
+		p.pixel = (y - tile.start_y) * tile_width + (x - tile.start_x);
+		p.samples = thread_sampler();
+		paths.push_back(p);
+	    }
+	}
+    }
+}
+
+void wavefront_renderer::intersect(const hittable& world, int bounce) {
+    const int count = static_cast<int>(paths.size());
+    hits.resize(count);
+    order.clear();
+
+    for (int i = 0; i < count; i++) {
+	STAT_INC(rays);
+	const path& p = paths[i];
+	if (world.hit(p.r, 0.001, infinity, hits[i])) {
+	    order.push_back(i);
+	    if (collect_features && bounce == 0) {
+		features[p.pixel].add_hit({hits[i].mat_ptr->albedo, hits[i].normal, hits[i].t * p.r.direction().length()});
+	    }
+	} else {
+	    STAT_PATH(bounce + 1);
+	    const colour c = p.throughput * sky_colour(p.r);
+	    accum[p.pixel] += c;
+	    end_path(p, c);
+	    if (collect_features && bounce == 0) features[p.pixel].add_hit({sky_colour(p.r), vec3(0, 0, 0), 0});
+	}
+    }
+
+    // group hits by kind then material, keeping queue order within a group.
+    // ties break on the index in place, where stable_sort would allocate a buffer
+    std::sort(order.begin(), order.end(), [&](int a, int b) {
+	const material* ma = hits[a].mat_ptr;
+	const material* mb = hits[b].mat_ptr;
+	if (ma->kind != mb->kind) return ma->kind < mb->kind;
+	return ma != mb ? ma < mb : a < b;
+    });
+}
+
+void wavefront_renderer::shade(int bounce) {
+    next_paths.clear();
+
+    const int* begin = order.begin();
+    while (begin != order.end()) {
+	const material_kind kind = hits[*begin].mat_ptr->kind;
+	const int* end = begin;
+	while (end != order.end() && hits[*end].mat_ptr->kind == kind) end++;
+
+	switch (kind) {
+	    case material_kind::lambertian: shade_run<material_kind::lambertian>(begin, end, bounce); break;
+	    case material_kind::metal: shade_run<material_kind::metal>(begin, end, bounce); break;
+	    case material_kind::dielectric: shade_run<material_kind::dielectric>(begin, end, bounce); break;
+	}
+	begin = end;
+    }
+
+    std::swap(paths, next_paths);
+}
+
+template <material_kind K>
+void wavefront_renderer::shade_run(const int* begin, const int* end, int bounce) {
+    for (const int* it = begin; it != end; it++) {
+	const int i = *it;
+	path p = paths[i];
+	ray scattered;
+	colour attenuation;
+
+	thread_sampler() = p.samples;
+	thread_sampler().start_bounce(bounce);
+	bool scatters = hits[i].mat_ptr->scatter_as<K>(p.r, hits[i], attenuation, scattered);
+	if (scatters) {
+	    p.throughput = p.throughput * attenuation;
+	    scatters = survives_roulette(p.throughput, bounce);
+	}
+	p.samples = thread_sampler();
+
+	if (scatters) {
+	    p.r = scattered;
+	    next_paths.push_back(p);
+	} else {
+	    STAT_PATH(bounce + 1);
+	    end_path(p, colour(0, 0, 0));
+	}
+    }
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include "topology.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// threads kept across jobs, so the scene build and every frame's render
+// share them and their scratch arenas rather than each starting their own
+class worker_pool {
+    public:
+	worker_pool(int thread_count) {
+	    start_threads(std::vector<int>(thread_count, -1), nullptr);
+	}
+
+	// threads placed on topology's cpus as config asks. pinned threads know
+	// their numa node, so work can be handed the copy of the data on it
+	worker_pool(const pool_config& config, const cpu_topology& topology) {
+	    start_threads(topology.placement(config), &topology);
+	}
+
+	~worker_pool() {
+	    {
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	    }
+	    start.notify_all();
+	    for (auto &t : threads) {
+		t.join();
+	    }
+	}
+
+	worker_pool(const worker_pool&) = delete;
+	worker_pool& operator=(const worker_pool&) = delete;
+
+	int size() const { return static_cast<int>(threads.size()); }
+
+	// the cpu a worker is pinned to, or -1
+	int cpu(int worker) const { return cpus[worker]; }
+
+	// the numa nodes the workers are pinned on, numbered from 0 in the order
+	// workers reach them. unpinned workers all count as node 0
+	int node(int worker) const { return nodes[worker]; }
+	int node_count() const { return node_total; }
+
+	// call task(worker) once on every thread, returning when all are done
+	void run(const std::function<void(int)>& task) {
+	    const auto run_start = std::chrono::steady_clock::now();
+	    std::unique_lock<std::mutex> guard(lock);
+	    job = &task;
+	    running = size();
+	    generation++;
+	    start.notify_all();
+	    finished.wait(guard, [this] { return running == 0; });
+	    used.wall += std::chrono::duration<double>(std::chrono::steady_clock::now() - run_start).count();
+	}
+
+	// seconds each thread spent in tasks, and how much of that it was on a
+	// cpu, against the seconds run() took, all since the last reset
+	struct usage {
+	    double wall = 0;
+	    std::vector<double> busy;
+	    std::vector<double> on_cpu;
+	};
+
+	const usage& utilisation() const { return used; }
+
+	void reset_utilisation() {
+	    used.wall = 0;
+	    used.busy.assign(cpus.size(), 0);
+	    used.on_cpu.assign(cpus.size(), 0);
+	}
+
+    private:
+	void start_threads(const std::vector<int>& placement, const cpu_topology* topology) {
+	    cpus = placement;
+	    std::vector<int> seen;
+	    for (int cpu : cpus) {
+		const int os_node = cpu >= 0 && topology ? topology->node_of(cpu) : 0;
+		const auto at = std::find(seen.begin(), seen.end(), os_node);
+		nodes.push_back(static_cast<int>(at - seen.begin()));
+		if (at == seen.end()) seen.push_back(os_node);
+	    }
+	    node_total = std::max<int>(1, seen.size());
+	    reset_utilisation();
+
+	    for (int i = 0; i < static_cast<int>(cpus.size()); i++) {
+		threads.emplace_back([this, i] { work(i); });
+	    }
+	}
+
+	static double thread_seconds() {
+	    timespec t;
+	    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+	    return t.tv_sec + t.tv_nsec * 1e-9;
+	}
+
+	void work(int worker) {
+	    // before anything is allocated, so the thread's arenas are local
+	    if (cpus[worker] >= 0) pin_current_thread(cpus[worker]);
+
+	    uint64_t seen = 0;
+	    while (true) {
+		const std::function<void(int)>* current;
+		{
+		    std::unique_lock<std::mutex> guard(lock);
+		    start.wait(guard, [&] { return stopping || generation != seen; });
+		    if (stopping) return;
+		    seen = generation;
+		    current = job;
+		}
+
+		const auto task_start = std::chrono::steady_clock::now();
+		const double cpu_start = thread_seconds();
+		(*current)(worker);
+		const double on_cpu = thread_seconds() - cpu_start;
+		const double busy = std::chrono::duration<double>(std::chrono::steady_clock::now() - task_start).count();
+
+		std::lock_guard<std::mutex> guard(lock);
+		used.busy[worker] += busy;
+		used.on_cpu[worker] += on_cpu;
+		if (--running == 0) finished.notify_one();
+	    }
+	}
+
+	std::vector<std::thread> threads;
+	std::vector<int> cpus;
+	std::vector<int> nodes;
+	int node_total = 1;
+	usage used;
+	std::mutex lock;
+	std::condition_variable start;
+	std::condition_variable finished;
+	const std::function<void(int)>* job = nullptr;
+	uint64_t generation = 0;
+	int running = 0;
+	bool stopping = false;
+};